@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
@@ -21,6 +22,7 @@
 #include <string>
 #include <streambuf>
 #include <unordered_set>
+#include <vector>
 
 extern "C" {
 #include <err.h>
@@ -30,6 +32,7 @@ extern "C" {
 #include <libjob/job.h>
 #include <libjob/ipc.h>
 #include <libjob/manifest.hpp>
+#include <libjob/statusTable.hpp>
 #include <libjob/namespaceImport.hpp>
 
 using std::cout;
@@ -43,10 +46,17 @@ const std::unordered_set<string> commands = {
 	"list",
 };
 
+// Commands that can be given to `jobadm bulk'
+const std::unordered_set<string> bulk_commands = {
+	"load", "unload", "enable", "disable", "clear",
+};
+
 void usage() {
 	std::cout <<
 		"Usage:\n\n"
 		"  jobadm <list>\n"
+		"  jobadm bulk <load|unload|enable|disable|clear> < paths-or-labels\n"
+		"  jobadm watch [label-prefix ...]\n"
 		"  -or-\n"
 		"  job [-h|--help|-v|--version]\n"
 		"\n"
@@ -60,11 +70,11 @@ void show_version() {
 	std::cout << "job version " + jobd_config->getVersion() << std::endl;
 }
 
-std::string format_job_status(json& status) {
-	if (status["Enabled"].get<bool>() == false) {
+std::string format_job_status(bool enabled, const std::string& state) {
+	if (!enabled) {
 		return "disabled";
 	} else {
-		if (status["State"] == "running") {
+		if (state == "running") {
 			return "\033[0;32mrunning\033[0m ";
 		} else {
 			return "\033[1;31moffline\033[0m ";
@@ -72,15 +82,17 @@ std::string format_job_status(json& status) {
 	}
 }
 
+static const char* list_format = "%s     %s\n";
+
 void list_response_handler(libjob::jsonRpcResponse& response)
 {
 	try {
-		const char* format = "%s     %s\n";
 		json o = response.getResult();
-		printf(format, "\033[4mSTATUS\033[0m  ", "\033[4mLABEL\033[0m");
+		printf(list_format, "\033[4mSTATUS\033[0m  ", "\033[4mLABEL\033[0m");
 		for (json::iterator it = o.begin(); it != o.end(); ++it) {
-			std::string status = format_job_status(it.value());
-			printf(format, status.c_str(), it.key().c_str());
+			std::string status = format_job_status(it.value()["Enabled"].get<bool>(),
+					it.value()["State"].get<std::string>());
+			printf(list_format, status.c_str(), it.key().c_str());
 		}
 	} catch(const std::exception& e) {
 		std::cout << "ERROR: Unhandled exception: " << e.what() << '\n';
@@ -88,28 +100,163 @@ void list_response_handler(libjob::jsonRpcResponse& response)
 	}
 }
 
-bool validateManifest(const char* path)
+/*
+ * List the jobs by reading the status table that jobd publishes, instead of
+ * asking jobd. Returns false if the table is not available. A table that a
+ * crashed jobd left behind is not trusted.
+ */
+bool list_from_status_table()
 {
-	libjob::Manifest manifest;
+	libjob::StatusTableReader reader;
+	std::vector<libjob::JobStatusRecord> records;
 
 	try {
-		manifest.readFile(path);
-	} catch (...) {
+		reader.open(jobd_config->getStatusTablePath());
+	} catch (const std::exception& e) {
 		return false;
 	}
+	try {
+		records = reader.read();
+	} catch (const std::exception& e) {
+		printf("ERROR: %s\n", e.what());
+		exit(EXIT_FAILURE);
+	}
 
+	std::sort(records.begin(), records.end(),
+			[](const libjob::JobStatusRecord& a, const libjob::JobStatusRecord& b) {
+		return a.label < b.label;
+	});
+
+	printf(list_format, "\033[4mSTATUS\033[0m  ", "\033[4mLABEL\033[0m");
+	for (auto& rec : records) {
+		std::string status = format_job_status(rec.enabled, rec.getStateString());
+		printf(list_format, status.c_str(), rec.label.c_str());
+	}
 	return true;
 }
 
+/* Throws std::runtime_error explaining what is wrong with the manifest at @path */
+void validateManifest(const char* path)
+{
+	libjob::Manifest manifest;
+
+	try {
+		manifest.readFile(path);
+	} catch (const std::exception& e) {
+		throw std::runtime_error(std::string("invalid manifest ") + path + ": " + e.what());
+	} catch (...) {
+		throw std::runtime_error(std::string("invalid manifest ") + path);
+	}
+}
+
 void validateInput(int argc, char *argv[])
 {
 	std::string command = argv[0];
 
 	if (command == "load") {
-		if (!validateManifest(argv[1])) {
-			throw std::runtime_error("invalid manifest");
+		if (argc < 2) {
+			throw std::runtime_error("load requires the path to a manifest");
+		}
+		validateManifest(argv[1]);
+	}
+	if (command == "bulk") {
+		if (argc < 2 || bulk_commands.count(argv[1]) == 0) {
+			throw std::runtime_error("bulk requires one of: load, unload, enable, disable, clear");
+		}
+	}
+}
+
+/*
+ * Read manifest paths (for load) or labels from standard input, one per
+ * line, and send them to jobd as a single batch. Returns the number of
+ * requests that failed.
+ */
+unsigned int bulk_request(libjob::ipcClient& ipc_client, const std::string& method)
+{
+	std::vector<std::string> items;
+	std::string line;
+	libjob::jsonRpcBatch batch;
+	unsigned int failures = 0;
+
+	while (std::getline(std::cin, line)) {
+		line.erase(0, line.find_first_not_of(" \t"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::string param = line;
+		if (method == "load") {
+			char *resolved_path = realpath(line.c_str(), NULL);
+			if (!resolved_path) {
+				printf("ERROR: %s: unable to resolve path\n", line.c_str());
+				failures++;
+				continue;
+			}
+			param = resolved_path;
+			free(resolved_path);
+		}
+
+		libjob::jsonRpcRequest request;
+		request.setId(items.size() + 1);
+		request.setMethod(method);
+		request.addParam(param);
+		batch.add(request);
+		items.push_back(line);
+	}
+	if (items.empty())
+		return failures;
+
+	ipc_client.dispatch(batch);
+
+	for (size_t i = 0; i < batch.getResponseCount(); i++) {
+		libjob::jsonRpcResponse& response = batch.getResponse(i);
+		if (!response.isError())
+			continue;
+		failures++;
+		if (response.hasId() && response.id() >= 1 && response.id() <= items.size()) {
+			printf("ERROR: %s: %s\n", items[response.id() - 1].c_str(),
+					response.getErrorMessage().c_str());
+		} else {
+			printf("ERROR: %s\n", response.getErrorMessage().c_str());
 		}
 	}
+	return failures;
+}
+
+/*
+ * Print the job events that match @prefixes, one per line, until jobd
+ * closes the connection.
+ */
+void watch_events(libjob::ipcClient& ipc_client, const std::vector<std::string>& prefixes)
+{
+	json notification;
+
+	ipc_client.subscribe(prefixes);
+	for (;;) {
+		ipc_client.readEvent(notification);
+		const json& params = notification["params"];
+		if (notification["method"] == "jobEventsDropped") {
+			printf("WARNING: %u events were dropped\n",
+					params["Count"].get<unsigned int>());
+			continue;
+		}
+		if (notification["method"] != "jobEvent")
+			continue;
+
+		std::string detail;
+		if (params.count("Pid"))
+			detail += " pid=" + std::to_string(params["Pid"].get<int>());
+		if (params.count("ExitStatus"))
+			detail += " status=" + std::to_string(params["ExitStatus"].get<int>());
+		if (params.count("TermSignal") && params["TermSignal"].get<int>() != 0)
+			detail += " signal=" + std::to_string(params["TermSignal"].get<int>());
+		if (params.count("Message"))
+			detail += " (" + params["Message"].get<std::string>() + ")";
+		printf("%ld %-9s %s%s\n", params["Time"].get<long>(),
+				params["Event"].get<std::string>().c_str(),
+				params["Label"].get<std::string>().c_str(), detail.c_str());
+		fflush(stdout);
+	}
 }
 
 int
@@ -122,8 +269,9 @@ main(int argc, char *argv[])
 			{ NULL, 0, NULL, 0 }
 	};
 
+	std::unique_ptr<libjob::jobdConfig> jc;
 	try {
-		std::unique_ptr<libjob::jobdConfig> jc(new libjob::jobdConfig);
+		jc.reset(new libjob::jobdConfig);
 		jobd_config = jc.get();
 	} catch (std::exception& e) {
 		printf("ERROR: jobd_config: %s\n", e.what());
@@ -170,6 +318,10 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (command == "list" && list_from_status_table()) {
+		return 0;
+	}
+
 	try {
 		std::unique_ptr<libjob::ipcClient> ipc_client(new libjob::ipcClient());
 		libjob::jsonRpcResponse response;
@@ -177,6 +329,11 @@ main(int argc, char *argv[])
 
 		request.setId(1); // Not used
 
+		/* These replies can be large, and CBOR is much quicker to decode */
+		if (command == "list" || command == "bulk") {
+			ipc_client->setEncoding(libjob::JSONRPC_ENCODING_CBOR);
+		}
+
 		if (command == "list") {
 			request.setMethod("list");
 			ipc_client->dispatch(request, response);
@@ -202,6 +359,15 @@ main(int argc, char *argv[])
 			ipc_client->dispatch(request, response);
 			//FIXME: check response
 		}
+
+		if (command == "bulk") {
+			if (bulk_request(*ipc_client, argv[1]) > 0)
+				exit(EXIT_FAILURE);
+		}
+
+		if (command == "watch") {
+			watch_events(*ipc_client, std::vector<std::string>(argv + 1, argv + argc));
+		}
 	} catch(const std::system_error& e) {
 		std::cout << "Caught system_error with code " << e.code()
 	                  << " meaning " << e.what() << '\n';
@@ -21,7 +21,6 @@
 #include <limits.h>
 #endif
 #include <sys/types.h>
-#include <sys/event.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -33,6 +32,8 @@
 
 // XXX-FIXME this entire file is disabled until after the major C++ refactor is complete
 #if 0
+#include <sys/event.h>
+
 /* The main kqueue descriptor used by launchd */
 static int parent_kqfd;
 
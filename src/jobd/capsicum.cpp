@@ -16,7 +16,6 @@
 
 extern "C" {
 #include <sys/types.h>
-#include <sys/event.h>
 #include <sys/time.h>
 #include <unistd.h>
 }
@@ -151,11 +150,11 @@ static void set_rights(int fd, const json_t& json)
 }
 #endif // HAVE_CAPSICUM
 
-void capsicum_resources_acquire(json_t& manifest, std::map<std::string, int> descriptors)
+void capsicum_resources_acquire(const json_t& manifest, std::map<std::string, int> descriptors)
 {
 #if HAVE_CAPSICUM
 	if (manifest.find("CapsicumRights") != manifest.end()) {
-		json_t o = manifest["CapsicumRights"];
+		json_t o = manifest.at("CapsicumRights");
 		for (nlohmann::json::iterator it = o.begin(); it != o.end(); ++it) {
 			string key = it.key();
 			auto kv = descriptors.find(key);
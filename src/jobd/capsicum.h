@@ -31,5 +31,5 @@ extern "C" {
 #include <libjob/namespaceImport.hpp>
 #include <libjob/parser.hpp>
 
-void capsicum_resources_acquire(nlohmann::json& manifest,
+void capsicum_resources_acquire(const nlohmann::json& manifest,
 		std::map<std::string, int> descriptors);
@@ -16,7 +16,9 @@
 
 extern "C" {
 #include <sys/types.h>
+#ifndef __linux__
 #include <sys/event.h>
+#endif
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -25,14 +27,16 @@ extern "C" {
 #include <libjob/logger.h>
 #include "descriptor.h"
 
-using json_t = nlohmann::json;
+using args_t = std::vector<std::string>;
 
-static int create_sys_kqueue(const json_t& j)
+#ifndef __linux__
+static int create_sys_kqueue(const args_t& args)
 {
 	return kqueue();
 }
+#endif
 
-static int create_sys_socket(const json_t& j)
+static int create_sys_socket(const args_t& args)
 {
 	static const std::map<string, int> socket_domains = {
 			{ "PF_LOCAL", PF_LOCAL },
@@ -45,18 +49,22 @@ static int create_sys_socket(const json_t& j)
 			{ "SOCK_DGRAM", SOCK_DGRAM },
 	};
 
-	if (j[3] != "0") {
+	if (args.size() != 4) {
+		log_error("socket requires 3 arguments");
+		return -1;
+	}
+	if (args[3] != "0") {
 		log_error("unsupported protocol");
 		return -1;
 	}
 
-	auto kv = socket_domains.find(j[1]);
+	auto kv = socket_domains.find(args[1]);
 	if (kv == socket_domains.end()) {
 		return -1;
 	}
 	int domain = kv->second;
 
-	kv = socket_types.find(j[2]);
+	kv = socket_types.find(args[2]);
 	if (kv == socket_types.end()) {
 		return -1;
 	}
@@ -65,14 +73,16 @@ static int create_sys_socket(const json_t& j)
 	return socket(domain, sock_type, 0);
 }
 
-int create_descriptor_for(const json_t& j)
+int create_descriptor_for(const args_t& args)
 {
-	static const std::map<string, int (*)(const json_t&)> vtable = {
+	static const std::map<string, int (*)(const args_t&)> vtable = {
+#ifndef __linux__
 		{"kqueue", create_sys_kqueue},
+#endif
 		{"socket", create_sys_socket},
 	};
 	int fd;
-	string syscall = j[0];
+	string syscall = args[0];
 
 	auto kv = vtable.find(syscall);
 	if (kv == vtable.end()) {
@@ -80,8 +90,8 @@ int create_descriptor_for(const json_t& j)
 		return -1;
 	}
 
-	int (*func)(const json_t&) = kv->second;
-	fd = (*func)(j);
+	int (*func)(const args_t&) = kv->second;
+	fd = (*func)(args);
 
 	if (fd < 0) {
 		log_errno("%s syscall", syscall.c_str());
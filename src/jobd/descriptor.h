@@ -20,4 +20,8 @@
 
 #include "job.h"
 
-int create_descriptor_for(const nlohmann::json& j);
+/**
+ * Create a descriptor by calling the system call named by the first element
+ * of @args, with the rest of @args as its arguments. Returns -1 on failure.
+ */
+int create_descriptor_for(const std::vector<std::string>& args);
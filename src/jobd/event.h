@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef RELAUNCHD_EVENT_H_
+#define RELAUNCHD_EVENT_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+/** The kinds of events that an EventBackend can deliver */
+typedef enum {
+	/** A signal was delivered to jobd. ident is the signal number */
+	EVENT_SIGNAL = 0,
+	/** A child process exited and has been reaped. ident is the pid */
+	EVENT_PROCESS_EXIT,
+	/** A one-shot timer expired. ident is the timer identifier */
+	EVENT_TIMER,
+	/** A descriptor is readable. ident is the descriptor */
+	EVENT_READ,
+	/** A descriptor is writable. ident is the descriptor */
+	EVENT_WRITE,
+	/** The contents of a watched directory changed */
+	EVENT_DIRECTORY,
+} event_type_t;
+
+/** An event harvested from an EventBackend */
+struct Event {
+	event_type_t type;
+	uintptr_t ident;
+
+	/** For EVENT_PROCESS_EXIT, the status returned by waitpid(2) */
+	int status;
+
+	/** The pointer that was given when the watch was created */
+	void *udata;
+};
+
+/**
+ * The source of events for the main loop of jobd.
+ *
+ * Each platform has a native implementation: kqueue(2) on the BSDs and
+ * macOS, and epoll(7) on Linux. All watches are level-triggered, except
+ * for timers, which fire once, and process watches, which are removed
+ * after the exit of the process has been delivered.
+ *
+ * Errors when creating a watch are logged and thrown as std::system_error.
+ */
+class EventBackend {
+public:
+	virtual ~EventBackend() {}
+
+	/** Create the native backend for this platform */
+	static std::unique_ptr<EventBackend> create();
+
+	/** Deliver the given signal as an event instead of to a handler */
+	virtual void watchSignal(int signum, void *udata) = 0;
+
+	/**
+	 * Reap the given child process when it exits, and deliver its
+	 * exit status as an event.
+	 */
+	virtual void watchProcess(pid_t pid, void *udata) = 0;
+	virtual void unwatchProcess(pid_t pid) = 0;
+
+	virtual void watchRead(int fd, void *udata) = 0;
+	virtual void unwatchRead(int fd) = 0;
+
+	/**
+	 * Deliver an event while there is room to write to a descriptor.
+	 * A descriptor may be watched for reading and writing at the same
+	 * time, with a different udata for each.
+	 */
+	virtual void watchWrite(int fd, void *udata) = 0;
+	virtual void unwatchWrite(int fd) = 0;
+
+	/** Deliver an event when entries are added to or removed from a directory */
+	virtual void watchDirectory(const std::string& path, void *udata) = 0;
+
+	/**
+	 * Append the paths of the directory entries that changed since the
+	 * last call to @paths. Returns false if the backend does not know
+	 * which entries changed, in which case every entry must be checked.
+	 */
+	virtual bool takeDirectoryChanges(std::vector<std::string>& paths)
+	{
+		(void) paths;
+		return false;
+	}
+
+	/** Arm a one-shot timer, replacing any other timer with the same ident */
+	virtual void setTimer(uintptr_t ident, unsigned int msec, void *udata) = 0;
+	virtual void cancelTimer(uintptr_t ident) = 0;
+
+	/**
+	 * Wait until something happens, and append the events from at most
+	 * @max ready sources to @events. Returns the number of events added,
+	 * which may be zero if the wait was interrupted.
+	 */
+	virtual size_t wait(std::vector<Event>& events, size_t max) = 0;
+
+	/** Called in the child process after fork(2), before exec(2) */
+	virtual void forkHandler() = 0;
+};
+
+std::unique_ptr<EventBackend> create_kqueue_backend();
+#ifdef __linux__
+std::unique_ptr<EventBackend> create_epoll_backend();
+#endif
+
+inline std::unique_ptr<EventBackend> EventBackend::create()
+{
+#ifdef __linux__
+	return create_epoll_backend();
+#else
+	return create_kqueue_backend();
+#endif
+}
+
+#endif /* RELAUNCHD_EVENT_H_ */
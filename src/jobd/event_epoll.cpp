@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+
+extern "C" {
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include <libjob/logger.h>
+#include "event.h"
+
+/* Older C libraries do not know about pidfd_open(2), which is in Linux 5.3 and newer */
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/**
+ * An EventBackend that uses epoll(7), with a descriptor for each kind of
+ * event source: signalfd(2) for signals, pidfd_open(2) for child processes,
+ * timerfd_create(2) for timers and inotify(7) for directories.
+ */
+class EpollEventBackend : public EventBackend {
+public:
+	EpollEventBackend()
+	{
+		if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+			log_errno("epoll_create1(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+		sigemptyset(&sigmask);
+
+		/* Without it, no job could be reaped, so find out now */
+		int fd = syscall(SYS_pidfd_open, getpid(), 0);
+		if (fd < 0) {
+			log_errno("pidfd_open(2)");
+			(void) close(epfd);
+			throw std::runtime_error("pidfd_open(2) is not available; jobd requires Linux 5.3 or newer");
+		}
+		(void) close(fd);
+	}
+
+	~EpollEventBackend()
+	{
+		for (auto& it : processes) {
+			(void) close(it.second.fd);
+		}
+		for (auto& it : timers) {
+			(void) close(it.second.fd);
+		}
+		if (signalWatch.fd >= 0) {
+			(void) close(signalWatch.fd);
+		}
+		if (directoryWatch.fd >= 0) {
+			(void) close(directoryWatch.fd);
+		}
+		(void) close(epfd);
+	}
+
+	void watchSignal(int signum, void *udata)
+	{
+		/* The signal must be blocked, or it will never reach the signalfd */
+		sigaddset(&sigmask, signum);
+		if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
+			log_errno("sigprocmask(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+		int fd = signalfd(signalWatch.fd, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (fd < 0) {
+			log_errno("signalfd(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+		signalUdata[signum] = udata;
+		if (signalWatch.fd < 0) {
+			signalWatch.fd = fd;
+			add(fd, &signalWatch);
+		}
+	}
+
+	void watchProcess(pid_t pid, void *udata)
+	{
+		int fd = syscall(SYS_pidfd_open, pid, 0);
+		if (fd < 0) {
+			log_errno("pidfd_open(2) of pid %d", pid);
+			throw std::system_error(errno, std::system_category());
+		}
+
+		Watch& watch = processes[pid];
+		watch = { EVENT_PROCESS_EXIT, (uintptr_t) pid, fd, udata };
+		try {
+			add(fd, &watch);
+		} catch (...) {
+			(void) close(fd);
+			processes.erase(pid);
+			throw;
+		}
+	}
+
+	void unwatchProcess(pid_t pid)
+	{
+		auto it = processes.find(pid);
+		if (it != processes.end()) {
+			(void) close(it->second.fd);
+			processes.erase(it);
+		}
+	}
+
+	void watchRead(int fd, void *udata)
+	{
+		Watch& watch = descriptors[fd];
+		watch.type = EVENT_READ;
+		watch.ident = (uintptr_t) fd;
+		watch.fd = fd;
+		watch.udata = udata;
+		updateDescriptor(watch, watch.events | EPOLLIN);
+	}
+
+	void unwatchRead(int fd)
+	{
+		auto it = descriptors.find(fd);
+		if (it != descriptors.end()) {
+			updateDescriptor(it->second, it->second.events & ~EPOLLIN);
+		}
+	}
+
+	void watchWrite(int fd, void *udata)
+	{
+		Watch& watch = descriptors[fd];
+		watch.type = EVENT_READ;
+		watch.ident = (uintptr_t) fd;
+		watch.fd = fd;
+		watch.writeUdata = udata;
+		updateDescriptor(watch, watch.events | EPOLLOUT);
+	}
+
+	void unwatchWrite(int fd)
+	{
+		auto it = descriptors.find(fd);
+		if (it != descriptors.end()) {
+			updateDescriptor(it->second, it->second.events & ~EPOLLOUT);
+		}
+	}
+
+	void watchDirectory(const std::string& path, void *udata)
+	{
+		if (directoryWatch.fd < 0) {
+			int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			if (fd < 0) {
+				log_errno("inotify_init1(2)");
+				throw std::system_error(errno, std::system_category());
+			}
+			directoryWatch.fd = fd;
+			add(fd, &directoryWatch);
+		}
+
+		int wd = inotify_add_watch(directoryWatch.fd, path.c_str(),
+				IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+				IN_CLOSE_WRITE | IN_ATTRIB);
+		if (wd < 0) {
+			log_errno("inotify_add_watch(2) of %s", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		directoryUdata[wd] = udata;
+		directoryPaths[wd] = path;
+	}
+
+	bool takeDirectoryChanges(std::vector<std::string>& paths)
+	{
+		bool complete = !directoryOverflow;
+
+		if (complete) {
+			paths.insert(paths.end(), changedPaths.begin(), changedPaths.end());
+		}
+		changedPaths.clear();
+		directoryOverflow = false;
+		return complete;
+	}
+
+	void setTimer(uintptr_t ident, unsigned int msec, void *udata)
+	{
+		struct itimerspec its = {};
+		auto it = timers.find(ident);
+
+		if (it == timers.end()) {
+			int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (fd < 0) {
+				log_errno("timerfd_create(2)");
+				throw std::system_error(errno, std::system_category());
+			}
+			it = timers.emplace(ident, Watch{ EVENT_TIMER, ident, fd, udata }).first;
+			add(fd, &it->second);
+		}
+		it->second.udata = udata;
+
+		/* A zero it_value would disarm the timer */
+		its.it_value.tv_sec = msec / 1000;
+		its.it_value.tv_nsec = ((msec % 1000) * 1000000) + (msec == 0 ? 1 : 0);
+		if (timerfd_settime(it->second.fd, 0, &its, NULL) < 0) {
+			log_errno("timerfd_settime(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	void cancelTimer(uintptr_t ident)
+	{
+		struct itimerspec its = {};
+		auto it = timers.find(ident);
+
+		if (it != timers.end() && timerfd_settime(it->second.fd, 0, &its, NULL) < 0) {
+			log_errno("timerfd_settime(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	size_t wait(std::vector<Event>& events, size_t max)
+	{
+		size_t count = 0;
+
+		ready.resize(max);
+		int rv = epoll_wait(epfd, ready.data(), ready.size(), -1);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				return 0;
+			}
+			log_errno("epoll_wait(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+
+		for (int i = 0; i < rv; i++) {
+			const Watch& watch = *static_cast<Watch *>(ready[i].data.ptr);
+
+			switch (watch.type) {
+			case EVENT_SIGNAL:
+				count += readSignal(events);
+				break;
+			case EVENT_PROCESS_EXIT:
+				count += reapProcess(watch, events);
+				break;
+			case EVENT_TIMER:
+				count += readTimer(watch, events);
+				break;
+			case EVENT_READ:
+				/* Errors and hangups are reported to both sides, so the owner gets to see them */
+				if ((watch.events & EPOLLIN) && (ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+					events.push_back(Event{ EVENT_READ, watch.ident, 0, watch.udata });
+					count++;
+				}
+				if ((watch.events & EPOLLOUT) && (ready[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+					events.push_back(Event{ EVENT_WRITE, watch.ident, 0, watch.writeUdata });
+					count++;
+				}
+				break;
+			case EVENT_WRITE:
+				break;
+			case EVENT_DIRECTORY:
+				count += readDirectoryChanges(events);
+				break;
+			}
+		}
+		return count;
+	}
+
+	void forkHandler()
+	{
+		/* Signals are only blocked so that jobd can read them from the signalfd */
+		(void) sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+	}
+
+private:
+	/** Something that was added to the epoll set */
+	struct Watch {
+		event_type_t type;
+		uintptr_t ident;
+		int fd;
+		void *udata;
+
+		/* For descriptors, the udata of the write side and the epoll events that are watched */
+		void *writeUdata;
+		uint32_t events;
+	};
+
+	int epfd;
+
+	/* Signals */
+	sigset_t sigmask;
+	Watch signalWatch = { EVENT_SIGNAL, 0, -1, NULL };
+	std::map<int, void *> signalUdata;
+
+	/* Directories; the key is the inotify watch descriptor */
+	Watch directoryWatch = { EVENT_DIRECTORY, 0, -1, NULL };
+	std::unordered_map<int, void *> directoryUdata;
+	std::unordered_map<int, std::string> directoryPaths;
+
+	/* Entries that changed since the last takeDirectoryChanges() */
+	std::set<std::string> changedPaths;
+	bool directoryOverflow = false;
+
+	std::unordered_map<pid_t, Watch> processes;
+	std::unordered_map<uintptr_t, Watch> timers;
+	/* Descriptors watched with watchRead() or watchWrite(); the type is always EVENT_READ */
+	std::unordered_map<int, Watch> descriptors;
+
+	std::vector<struct epoll_event> ready;
+
+	/* Change the events of a descriptor, and forget about it once there are none */
+	void updateDescriptor(Watch& watch, uint32_t events)
+	{
+		struct epoll_event ev;
+		int fd = watch.fd;
+		int op;
+
+		if (events == watch.events) {
+			return;
+		}
+		if (events == 0) {
+			/* The descriptor may already be closed, which removes it from the epoll set */
+			(void) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+			descriptors.erase(fd);
+			return;
+		}
+
+		op = (watch.events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		ev.events = events;
+		ev.data.ptr = &watch;
+		if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+			log_errno("epoll_ctl(2)");
+			if (watch.events == 0) {
+				descriptors.erase(fd);
+			}
+			throw std::system_error(errno, std::system_category());
+		}
+		watch.events = events;
+	}
+
+	void add(int fd, Watch* watch)
+	{
+		struct epoll_event ev = {};
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = watch;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			log_errno("epoll_ctl(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	/* Read one pending signal; the signalfd stays readable if there are more */
+	size_t readSignal(std::vector<Event>& events)
+	{
+		struct signalfd_siginfo si;
+
+		if (read(signalWatch.fd, &si, sizeof(si)) != sizeof(si)) {
+			if (errno != EAGAIN) {
+				log_errno("read(2) of signalfd");
+			}
+			return 0;
+		}
+		events.push_back(Event{ EVENT_SIGNAL, si.ssi_signo, 0, signalUdata[si.ssi_signo] });
+		return 1;
+	}
+
+	size_t reapProcess(const Watch& watch, std::vector<Event>& events)
+	{
+		Event ev = { EVENT_PROCESS_EXIT, watch.ident, 0, watch.udata };
+		pid_t pid = (pid_t) watch.ident;
+
+		pid_t rv = waitpid(pid, &ev.status, WNOHANG);
+		if (rv == 0) {
+			return 0;
+		}
+		if (rv < 0) {
+			log_errno("waitpid(2) of pid %d", pid);
+		}
+		unwatchProcess(pid);
+		if (rv < 0) {
+			return 0;
+		}
+		events.push_back(ev);
+		return 1;
+	}
+
+	size_t readTimer(const Watch& watch, std::vector<Event>& events)
+	{
+		uint64_t expirations;
+
+		if (read(watch.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+			/* The timer was rearmed or cancelled after it became readable */
+			return 0;
+		}
+		events.push_back(Event{ EVENT_TIMER, watch.ident, 0, watch.udata });
+		return 1;
+	}
+
+	/* Coalesce all pending changes into one event per directory */
+	size_t readDirectoryChanges(std::vector<Event>& events)
+	{
+		char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		std::map<int, bool> changed;
+		ssize_t len;
+
+		while ((len = read(directoryWatch.fd, buf, sizeof(buf))) > 0) {
+			for (char *p = buf; p < buf + len; ) {
+				const struct inotify_event *ie = (const struct inotify_event *) p;
+				if (ie->mask & IN_Q_OVERFLOW) {
+					log_warning("inotify queue overflow; rescanning every directory");
+					directoryOverflow = true;
+					for (auto& it : directoryUdata) {
+						changed[it.first] = true;
+					}
+				} else {
+					changed[ie->wd] = true;
+					if (ie->len > 0) {
+						changedPaths.insert(directoryPaths[ie->wd] + "/" + ie->name);
+					}
+				}
+				p += sizeof(struct inotify_event) + ie->len;
+			}
+		}
+		for (auto& it : changed) {
+			events.push_back(Event{ EVENT_DIRECTORY, (uintptr_t) it.first, 0, directoryUdata[it.first] });
+		}
+		return changed.size();
+	}
+};
+
+std::unique_ptr<EventBackend> create_epoll_backend()
+{
+	return std::unique_ptr<EventBackend>(new EpollEventBackend());
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <system_error>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include <libjob/logger.h>
+#include "event.h"
+
+/** An EventBackend that uses kqueue(2) */
+class KqueueEventBackend : public EventBackend {
+public:
+	KqueueEventBackend()
+	{
+		if ((kqfd = kqueue()) < 0) {
+			log_errno("kqueue(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	~KqueueEventBackend()
+	{
+		for (int fd : directories) {
+			(void) close(fd);
+		}
+		(void) close(kqfd);
+	}
+
+	void watchSignal(int signum, void *udata)
+	{
+		change(signum, EVFILT_SIGNAL, EV_ADD, 0, 0, udata);
+	}
+
+	void watchProcess(pid_t pid, void *udata)
+	{
+		change(pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, udata);
+	}
+
+	void unwatchProcess(pid_t pid)
+	{
+		remove(pid, EVFILT_PROC);
+	}
+
+	void watchRead(int fd, void *udata)
+	{
+		change(fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, udata);
+	}
+
+	void unwatchRead(int fd)
+	{
+		remove(fd, EVFILT_READ);
+	}
+
+	void watchWrite(int fd, void *udata)
+	{
+		change(fd, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, udata);
+	}
+
+	void unwatchWrite(int fd)
+	{
+		remove(fd, EVFILT_WRITE);
+	}
+
+	void watchDirectory(const std::string& path, void *udata)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			log_errno("open(2) of %s", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+		directories.push_back(fd);
+
+		change(fd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR,
+				NOTE_EXTEND | NOTE_WRITE | NOTE_ATTRIB, 0, udata);
+	}
+
+	void setTimer(uintptr_t ident, unsigned int msec, void *udata)
+	{
+		change(ident, EVFILT_TIMER, EV_ADD | EV_ENABLE | EV_ONESHOT, 0, msec, udata);
+	}
+
+	void cancelTimer(uintptr_t ident)
+	{
+		remove(ident, EVFILT_TIMER);
+	}
+
+	size_t wait(std::vector<Event>& events, size_t max)
+	{
+		size_t count = 0;
+
+		buffer.resize(max);
+		int rv = kevent(kqfd, NULL, 0, buffer.data(), buffer.size(), NULL);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				return 0;
+			}
+			log_errno("kevent(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+
+		for (int i = 0; i < rv; i++) {
+			const struct kevent& kev = buffer[i];
+			Event ev = { EVENT_READ, kev.ident, 0, kev.udata };
+
+			switch (kev.filter) {
+			case EVFILT_SIGNAL:
+				ev.type = EVENT_SIGNAL;
+				break;
+			case EVFILT_PROC:
+				/* NOTE_EXIT removes the knote, so only the zombie is left */
+				ev.type = EVENT_PROCESS_EXIT;
+				if (waitpid(kev.ident, &ev.status, WNOHANG) != (pid_t) kev.ident) {
+					log_errno("waitpid(2) of pid %d", (int) kev.ident);
+					continue;
+				}
+				break;
+			case EVFILT_TIMER:
+				ev.type = EVENT_TIMER;
+				break;
+			case EVFILT_READ:
+				ev.type = EVENT_READ;
+				break;
+			case EVFILT_WRITE:
+				ev.type = EVENT_WRITE;
+				break;
+			case EVFILT_VNODE:
+				ev.type = EVENT_DIRECTORY;
+				break;
+			default:
+				log_warning("unexpected filter %d", kev.filter);
+				continue;
+			}
+			events.push_back(ev);
+			count++;
+		}
+		return count;
+	}
+
+	void forkHandler()
+	{
+		/* kqueue descriptors are not inherited by the child */
+	}
+
+private:
+	int kqfd;
+
+	/** Directory descriptors being watched with EVFILT_VNODE */
+	std::vector<int> directories;
+
+	std::vector<struct kevent> buffer;
+
+	void change(uintptr_t ident, short filter, unsigned short flags,
+			unsigned int fflags, intptr_t data, void *udata)
+	{
+		struct kevent kev;
+
+		EV_SET(&kev, ident, filter, flags, fflags, data, udata);
+		if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0) {
+			log_errno("kevent(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	void remove(uintptr_t ident, short filter)
+	{
+		struct kevent kev;
+
+		EV_SET(&kev, ident, filter, EV_DELETE, 0, 0, NULL);
+		if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0 && errno != ENOENT) {
+			log_errno("kevent(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+};
+
+std::unique_ptr<EventBackend> create_kqueue_backend()
+{
+	return std::unique_ptr<EventBackend>(new KqueueEventBackend());
+}
@@ -14,9 +14,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <deque>
+#include <memory>
+#include <unordered_map>
+
 #include <sys/types.h>
-#include <sys/event.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "event.h"
 #include "manager.h"
 #include "ipc.h"
 #include "../libjob/ipc.h"
@@ -24,22 +30,53 @@
 
 using namespace libjob;
 
-static int main_kqfd;
 extern JobManager manager;
 static libjob::ipcServer* ipc_server;
+static EventBackend* ipc_events;
+
+/* Open connections, by descriptor */
+static std::unordered_map<int, std::unique_ptr<ipcSession>> ipc_sessions;
+
+/* Events are kept for a subscriber that is not reading them, up to this many */
+static const size_t subscription_queue_limit = 1024;
+
+/* A connection that has asked for job events with the "subscribe" method */
+struct Subscription {
+	/* Only jobs whose label starts with one of these; all jobs if empty */
+	std::vector<std::string> prefixes;
+
+	/* Events that have not been queued on the session yet */
+	std::deque<json> queue;
+
+	/* Events missed because the queue was full, since the subscriber was last told */
+	uint64_t dropped = 0;
+	uint64_t dropped_total = 0;
+
+	bool matches(const std::string& label) const
+	{
+		if (prefixes.empty())
+			return true;
+		for (const std::string& prefix : prefixes) {
+			if (label.compare(0, prefix.size(), prefix) == 0)
+				return true;
+		}
+		return false;
+	}
+};
 
-int ipc_init(int kqfd) {
-	struct kevent kev;
+/* Subscriptions, by the descriptor of their session */
+static std::unordered_map<int, Subscription> ipc_subscriptions;
 
-	main_kqfd = kqfd;
-	const char *socketpath = manager.jobd_config.getSocketPath().c_str();
-	log_debug("initializing IPC socket at %s", socketpath);
+int ipc_init(EventBackend& events) {
+	std::string socketpath = manager.jobd_config.getSocketPath();
+	log_debug("initializing IPC socket at %s", socketpath.c_str());
 	ipc_server = new libjob::ipcServer(socketpath);
+	ipc_events = &events;
 
 	log_debug("listening for connections on fd %d", ipc_server->get_sockfd());
-	EV_SET(&kev, ipc_server->get_sockfd(), EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, (void *)&ipc_request_handler);
-	if (kevent(main_kqfd, &kev, 1, NULL, 0, NULL) < 0) {
-		log_errno("kevent(2)");
+	try {
+		events.watchRead(ipc_server->get_sockfd(), (void *)&ipc_request_handler);
+	} catch (const std::system_error& e) {
 		return -1;
 	}
 
@@ -49,70 +86,284 @@ int ipc_init(int kqfd) {
 void ipc_shutdown()
 {
 	log_debug("shutting down the IPC server");
+	ipc_subscriptions.clear();
+	ipc_sessions.clear();
 	delete ipc_server;
+	ipc_server = nullptr;
 }
 
 void ipc_fork_handler()
 {
 	ipc_server->fork_handler();
 	delete ipc_server;
+	ipc_server = nullptr;
+	ipc_subscriptions.clear();
+	ipc_sessions.clear();
+}
+
+static void close_session(int fd)
+{
+	log_debug("closing session %d", fd);
+	ipc_events->unwatchRead(fd);
+	ipc_events->unwatchWrite(fd);
+
+	auto it = ipc_subscriptions.find(fd);
+	if (it != ipc_subscriptions.end()) {
+		if (it->second.dropped_total > 0) {
+			log_notice("subscriber on session %d missed %llu events", fd,
+					(unsigned long long) it->second.dropped_total);
+		}
+		ipc_subscriptions.erase(it);
+	}
+	ipc_sessions.erase(fd);
+}
+
+void ipc_publish_event(const char *event, const std::string& label, pid_t pid,
+		int exit_status, int term_signal, const char *message)
+{
+	json notification;
+
+	for (auto& it : ipc_subscriptions) {
+		Subscription& sub = it.second;
+		if (!sub.matches(label))
+			continue;
+
+		if (sub.queue.size() >= subscription_queue_limit) {
+			sub.dropped++;
+			sub.dropped_total++;
+			continue;
+		}
+
+		/* Only build the notification once someone wants it */
+		if (notification.is_null()) {
+			json& params = notification["params"];
+			notification["jsonrpc"] = "2.0";
+			notification["method"] = "jobEvent";
+			params["Event"] = event;
+			params["Label"] = label;
+			params["Time"] = (uint64_t) time(NULL);
+			if (pid > 0)
+				params["Pid"] = pid;
+			if (strcmp(event, "exited") == 0) {
+				params["ExitStatus"] = exit_status;
+				params["TermSignal"] = term_signal;
+			}
+			if (message)
+				params["Message"] = message;
+		}
+		sub.queue.push_back(notification);
+
+		try {
+			ipc_events->watchWrite(it.first, (void *)&ipc_session_handler);
+		} catch (const std::exception& e) {
+			log_error("unable to watch session %d: %s", it.first, e.what());
+		}
+	}
+}
+
+/* Move the queued events of a subscriber onto its session */
+static void deliver_events(int fd, ipcSession& session)
+{
+	auto it = ipc_subscriptions.find(fd);
+	if (it == ipc_subscriptions.end())
+		return;
+	Subscription& sub = it->second;
+
+	for (auto& event : sub.queue) {
+		session.queueMessage(event);
+	}
+	sub.queue.clear();
+
+	if (sub.dropped > 0) {
+		json notification;
+		notification["jsonrpc"] = "2.0";
+		notification["method"] = "jobEventsDropped";
+		notification["params"]["Count"] = sub.dropped;
+		session.queueMessage(notification);
+		sub.dropped = 0;
+	}
+}
+
+/*
+ * Handle one request. Loading a job only defines it; the caller starts the
+ * new jobs once the whole batch has been handled, if @run_pending is set.
+ */
+static void handle_request(ipcSession& session, jsonRpcRequest& request,
+		jsonRpcResponse& response, bool& run_pending)
+{
+	auto method = request.method();
+	if (method == "setEncoding") {
+		json result;
+		jsonRpcEncoding encoding;
+		try {
+			encoding = jsonrpc_encoding_from_string(request.getParam(0));
+		} catch (const std::exception& e) {
+			response.setError(JSONRPC_INVALID_PARAMS, e.what());
+			return;
+		}
+		session.setEncodingAfterResponse(encoding);
+		result["encoding"] = jsonrpc_encoding_name(encoding);
+		response.setResult(result);
+	} else if (method == "subscribe") {
+		json result;
+		Subscription& sub = ipc_subscriptions[session.get_sockfd()];
+		sub.prefixes.clear();
+		for (unsigned int i = 0; i < request.getParamCount(); i++) {
+			sub.prefixes.push_back(request.getParam(i));
+		}
+		result["Prefixes"] = sub.prefixes;
+		result["QueueLimit"] = subscription_queue_limit;
+		response.setResult(result);
+	} else if (method == "load") {
+		json result;
+		manager.defineJob(request.getParam(0));
+		run_pending = true;
+		result["FIXME"] = "TODO";
+		response.setResult(result);
+	} else if (method == "list") {
+		json result;
+		manager.listAllJobs(result);
+		response.setResult(result);
+	} else if (method == "hash") {
+		json result;
+		std::vector<std::string> labels;
+		for (unsigned int i = 0; i < request.getParamCount(); i++) {
+			labels.push_back(request.getParam(i));
+		}
+		manager.getManifestHashes(labels, result);
+		response.setResult(result);
+	} else if (method == "enable") {
+		json result;
+		manager.enableJob(request.getParam(0));
+		result["FIXME"] = "TODO";
+		response.setResult(result);
+	} else if (method == "disable") {
+		json result;
+		manager.disableJob(request.getParam(0));
+		result["FIXME"] = "TODO";
+		response.setResult(result);
+	} else if (method == "clear") {
+		json result;
+		manager.clearJob(request.getParam(0));
+		result["FIXME"] = "TODO";
+		response.setResult(result);
+	} else if (method == "unload") {
+		json result;
+		manager.unloadJob(request.getParam(0));
+		result["FIXME"] = "TODO";
+		response.setResult(result);
+	} else {
+		log_error("bad method: %s", method.c_str());
+		response.setError(JSONRPC_METHOD_NOT_FOUND, "method not found: " + method);
+	}
+}
+
+/*
+ * Handle every request in a batch as one unit: new jobs are started by a
+ * single pass of runPendingJobs(), and the changes to the state of the jobs
+ * are written out together by the main loop before it waits again.
+ */
+static void handle_batch(ipcSession& session, jsonRpcBatch& batch)
+{
+	bool run_pending = false;
+
+	if (batch.size() == 0) {
+		jsonRpcResponse response;
+		response.setError(JSONRPC_INVALID_REQUEST, "empty batch");
+		batch.addResponse(response);
+		return;
+	}
+
+	for (size_t i = 0; i < batch.size(); i++) {
+		jsonRpcRequest& request = batch.getRequest(i);
+		if (!request.isValid()) {
+			log_error("invalid request: %s", request.getJSON().dump().c_str());
+			jsonRpcResponse response;
+			response.setError(JSONRPC_INVALID_REQUEST, "invalid request");
+			batch.addResponse(response);
+			continue;
+		}
+
+		jsonRpcResponse response(request.hasId() ? request.id() : 0);
+		try {
+			handle_request(session, request, response, run_pending);
+		} catch (const std::exception& e) {
+			log_error("%s request failed: %s", request.method().c_str(), e.what());
+			response.setError(JSONRPC_INTERNAL_ERROR, e.what());
+		}
+		if (request.hasId()) {
+			batch.addResponse(response);
+		}
+	}
+
+	if (run_pending) {
+		try {
+			manager.runPendingJobs();
+		} catch (const std::exception& e) {
+			log_error("unable to start the new jobs: %s", e.what());
+		}
+	}
 }
 
 void ipc_request_handler(void) {
 	try {
-		log_debug("accepting connection");
-		ipcSession session = ipc_server->acceptConnection();
+		std::unique_ptr<ipcSession> session = ipc_server->acceptConnection();
+		if (!session)
+			return;
 
-		log_debug("parsing request");
-		session.readRequest();
+		int fd = session->get_sockfd();
+		ipc_events->watchRead(fd, (void *)&ipc_session_handler);
+		ipc_sessions[fd] = std::move(session);
+	} catch(const std::exception& e) {
+		log_error("unable to accept a connection: %s", e.what());
+	}
+}
 
-		jsonRpcRequest request = session.getRequest();
-		jsonRpcResponse response = session.getResponse();
+void ipc_session_handler(int fd, bool writable) {
+	auto it = ipc_sessions.find(fd);
+	if (it == ipc_sessions.end()) {
+		/* The session was closed by an earlier event in the same batch */
+		return;
+	}
+	ipcSession& session = *it->second;
 
-		auto method = request.method();
-		if (method == "load") {
-			json result;
-			manager.defineJob(request.getParam(0));
-			manager.runPendingJobs();
-			result["FIXME"] = "TODO";
-			response.setResult(result);
-		} else if (method == "list") {
-			json result;
-			manager.listAllJobs(result);
-			response.setResult(result);
-		} else if (method == "enable") {
-			json result;
-			manager.enableJob(request.getParam(0));
-			result["FIXME"] = "TODO";
-			response.setResult(result);
-		} else if (method == "disable") {
-			json result;
-			manager.disableJob(request.getParam(0));
-			result["FIXME"] = "TODO";
-			response.setResult(result);
-		} else if (method == "clear") {
-			json result;
-			manager.clearJob(request.getParam(0));
-			result["FIXME"] = "TODO";
-			response.setResult(result);
-		} else if (method == "unload") {
-			json result;
-			manager.unloadJob(request.getParam(0));
-			result["FIXME"] = "TODO";
-			response.setResult(result);
-		} else {
-			log_error("bad method");
-			// TODO: response.setError();
+	try {
+		if (!writable) {
+			if (!session.fill()) {
+				close_session(fd);
+				return;
+			}
+
+			jsonRpcBatch batch;
+			while (session.nextRequest(batch)) {
+				handle_batch(session, batch);
+				session.queueResponse(batch);
+			}
 		}
 
-		log_debug("sending response: %s", response.getResult().dump().c_str());
-		session.sendResponse(response);
-		//session.close();
-		log_debug("handler complete");
-	} catch(const std::runtime_error& e) {
-		log_error("caught exception: %s", e.what());
-	} catch(...) {
-		log_error("caught unknown exception");
+		/*
+		 * Events for a subscriber wait until everything before them has
+		 * been written, so that at most one queue of them is buffered.
+		 */
+		bool drained = session.flush();
+		if (drained) {
+			deliver_events(fd, session);
+			drained = session.flush();
+		}
+
+		/*
+		 * Stop reading from a client that is not reading what it was sent,
+		 * until it has been written out.
+		 */
+		if (drained) {
+			ipc_events->unwatchWrite(fd);
+			ipc_events->watchRead(fd, (void *)&ipc_session_handler);
+		} else {
+			ipc_events->unwatchRead(fd);
+			ipc_events->watchWrite(fd, (void *)&ipc_session_handler);
+		}
+	} catch(const std::exception& e) {
+		log_error("closing session %d: %s", fd, e.what());
+		close_session(fd);
 	}
-	return;
 }
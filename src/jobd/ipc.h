@@ -16,8 +16,16 @@
 
 #pragma once
 
+#include <string>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+class EventBackend;
+
 /** One-time initialization at program startup */
-int ipc_init(int kqfd);
+int ipc_init(EventBackend& events);
 
 /** Shutdown the IPC subsystem in the child after a fork(2) call */
 void ipc_fork_handler();
@@ -25,5 +33,18 @@ void ipc_fork_handler();
 /** Shutdown the IPC subsystem at program exit */
 void ipc_shutdown();
 
-/** Handle an incoming IPC request */
+/** Accept an incoming IPC connection */
 void ipc_request_handler(void);
+
+/** Handle an IPC connection that has become readable or writable */
+void ipc_session_handler(int fd, bool writable);
+
+/**
+ * Tell the clients that have subscribed to events for @label that the
+ * state of the job has changed. @event is one of "started", "exited",
+ * "faulted", "cleared", "enabled" or "disabled". The event is queued,
+ * and written out by the main loop; a subscriber whose queue is full
+ * misses it, and is told how many events it missed.
+ */
+void ipc_publish_event(const char *event, const std::string& label, pid_t pid = 0,
+		int exit_status = 0, int term_signal = 0, const char *message = NULL);
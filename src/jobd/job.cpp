@@ -35,6 +35,7 @@ extern "C" {
 #include "descriptor.h"
 #include "dataset.h"
 #include "job.h"
+#include <libjob/credentialCache.hpp>
 #include <libjob/logger.h>
 #include <libjob/namespaceImport.hpp>
 #include "manager.h"
@@ -44,50 +45,6 @@ extern "C" {
 
 int reset_signal_handlers();
 
-void Job::apply_resource_limits() {
-	//TODO - SoftResourceLimits, HardResourceLimits
-	//TODO - LowPriorityIO
-
-	int nice = this->manifest.json["Nice"];
-	if (nice != 0) {
-		log_debug("calling setpriority(2) to set nice value = %d", nice);
-		if (setpriority(PRIO_PROCESS, 0, nice) < 0) {
-			log_errno("setpriority(2)");
-			throw std::system_error(errno, std::system_category());
-		}
-	}
-}
-
-void Job::modify_credentials() {
-	if (getuid() != 0)
-		return;
-
-	const char* user_name = this->manifest.json["UserName"].get<string>().c_str();
-
-	log_debug("setting credentials: username=%s uid=%d gid=%d",
-			user_name, this->uid, this->gid);
-
-	if (initgroups(user_name, this->gid) < 0) {
-		log_errno("initgroups(3)");
-		throw std::system_error(errno, std::system_category());
-	}
-	if (setgid(this->gid) < 0) {
-		log_errno("setgid(2)");
-		throw std::system_error(errno, std::system_category());
-	}
-#ifndef __GLIBC__
-	if (setlogin(user_name) < 0) {
-		log_errno("setlogin(2)");
-		throw std::system_error(errno, std::system_category());
-	}
-#endif
-	if (setuid(this->uid) < 0) {
-		log_errno("setuid");
-		throw std::system_error(errno, std::system_category());
-	}
-}
-
-
 /* Add the standard set of environment variables that most programs expect.
  * See: http://pubs.opengroup.org/onlinepubs/009695399/basedefs/xbd_chap08.html
  * TODO: should cache these getenv() calls, so we don't do this dance for every
@@ -114,9 +71,9 @@ add_standard_environment_variables(vector<string>& env)
 	}
 }
 
-void Job::setup_environment()
+void Job::setup_environment(vector<string>& environment)
 {
-	nlohmann::json env = this->manifest.json["EnvironmentVariables"];
+	const map<string,string>& env = this->manifest.fields.environment_variables;
 	map<string,string> default_env;
 
 	/* KLUDGE: when running as root, assume we are a system daemon and avoid adding any
@@ -137,8 +94,8 @@ void Job::setup_environment()
 			{ "PATH", "/usr/bin:/bin:/usr/local/bin" },
 			{ "PWD", "/" },
 			/* Not present in root environment */
-			{ "LOGNAME", this->manifest.json["UserName"].get<string>() },
-			{ "USER", this->manifest.json["UserName"].get<string>() },
+			{ "LOGNAME", this->manifest.fields.user_name },
+			{ "USER", this->manifest.fields.user_name },
 			{ "SHELL", this->shell },
 			{ "TMPDIR", "/tmp" },
 		};
@@ -153,16 +110,15 @@ void Job::setup_environment()
 
 		if (env.find(key) == env.end()) {
 			log_debug("setting default value for %s", key.c_str());
-			this->environment.push_back(key + '=' + val);
+			environment.push_back(key + '=' + val);
 		}
 	}
 
-	for (nlohmann::json::iterator it = env.begin(); it != env.end(); ++it) {
-		string keyval = it.key() + '=' + it.value().get<string>();
-		this->environment.push_back(keyval);
+	for (auto& iter : env) {
+		environment.push_back(iter.first + '=' + iter.second);
 	}
 
-	add_standard_environment_variables(this->environment);
+	add_standard_environment_variables(environment);
 
 	//FIXME: port the socket code
 #if 0
@@ -197,20 +153,8 @@ void Job::exec()
 	}
 	envp[this->environment.size()] = nullptr;
 
-	vector<string> json_argv = this->manifest.json["Program"].get<vector<string>>();
-
-	char* argv[json_argv.size() + 1];
-	for (size_t i = 0; i < json_argv.size(); i++) {
-		argv[i] = (char*) json_argv[i].c_str();
-	}
-	argv[json_argv.size()] = nullptr;
-
-	if (this->manifest.json["EnableGlobbing"].get<bool>()) {
-		log_warning("Globbing is not implemented yet");
-		//TODO: globbing
-	}
-
-	const char* path = json_argv[0].c_str();
+	char* const* argv = this->launch_plan.getArgv();
+	const char* path = argv[0];
 
 #if 0
 	log_debug("path: %s", path);
@@ -224,13 +168,11 @@ void Job::exec()
 	}
 #endif
 
-	this->redirect_stdio();
-
 	int fd = open(path, O_RDONLY);
 	if (fd < 0) {
 		//FIXME: need to reopen stderr to something useful; by default it is /dev/null
 		std::cerr << "ERROR: open(2) failed for " << path << '\n';
-		exit(241);
+		_exit(241);
 	}
 
 #if HAVE_CAPSICUM
@@ -239,7 +181,7 @@ void Job::exec()
 	if (cap_rights_limit(fd, cap_rights_init(&rights, CAP_READ, CAP_FEXECVE)) < 0) {
 		//FIXME: need to reopen stderr to something useful; by default it is /dev/null
 		std::cerr << "Unable to limit capability rights";
-		exit(242);
+		_exit(242);
 	}
 
 	this->enterCapabilityMode();
@@ -250,70 +192,10 @@ void Job::exec()
 	if (rv < 0) {
 		//FIXME: need to reopen stderr to something useful; by default it is /dev/null
 		std::cerr << "ERROR: execve(2) failed for " << path << '\n';
-		exit(243);
+		_exit(243);
     	}
 }
 
-void Job::redirect_stdio() {
-	const char *path;
-	int fd;
-
-	string stdin_path = this->manifest.json["StandardInPath"];
-	string stdout_path = this->manifest.json["StandardOutPath"];
-	string stderr_path = this->manifest.json["StandardErrorPath"];
-
-	path = stdin_path.c_str();
-	log_debug("setting stdin path to %s", path);
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		log_errno("open(2) of %s", path);
-		throw std::system_error(errno, std::system_category());
-	}
-	if (dup2(fd, STDIN_FILENO) < 0) {
-		log_errno("dup2(2) of stdin");
-		int saved_errno = errno;
-		(void) close(fd);
-		throw std::system_error(saved_errno, std::system_category());
-	}
-	if (close(fd) < 0) {
-		throw std::system_error(errno, std::system_category());
-	}
-
-	path = stdout_path.c_str();
-	log_debug("setting stdout path to %s", path);
-	fd = open(path, O_CREAT | O_WRONLY, 0600);
-	if (fd < 0) {
-		log_errno("open(2) of %s", path);
-		throw std::system_error(errno, std::system_category());
-	}
-	if (dup2(fd, STDOUT_FILENO) < 0) {
-		log_errno("dup2(2) of stdout");
-		int saved_errno = errno;
-		(void) close(fd);
-		throw std::system_error(saved_errno, std::system_category());
-	}
-	if (close(fd) < 0) {
-		throw std::system_error(errno, std::system_category());
-	}
-
-	path = stderr_path.c_str();
-	log_debug("setting stderr path to %s", path);
-	fd = open(path, O_CREAT | O_WRONLY, 0600);
-	if (fd < 0) {
-		log_errno("open(2) of %s", path);
-		throw std::system_error(errno, std::system_category());
-	}
-	if (dup2(fd, STDERR_FILENO) < 0) {
-		log_errno("dup2(2) of stderr");
-		int saved_errno = errno;
-		(void) close(fd);
-		throw std::system_error(saved_errno, std::system_category());
-	}
-	if (close(fd) < 0) {
-		throw std::system_error(errno, std::system_category());
-	}
-}
-
 void Job::createCapsicumLoaderDescriptors()
 {
 	int fd;
@@ -388,55 +270,17 @@ void Job::start_child_process()
 #endif
 #endif
 
-	if (!this->manager->isNoFork() && setsid() < 0) {
-		log_errno("setsid");
-		throw std::system_error(errno, std::system_category());
-	}
+	std::vector<int> fds = this->createDescriptors();
 
-	if (reset_signal_handlers() < 0) {
-		log_error("unable to reset signal handlers");
-		throw std::system_error(errno, std::system_category());
+	if (!this->useCapsicum()) {
+		launch_descriptor_exec(this->launch_plan.getDescriptor(), fds.data());
 	}
 
-	this->apply_resource_limits();
-
-	string cwd = this->manifest.json["WorkingDirectory"];
-	log_debug("setting working directory to %s", cwd.c_str());
-	if (chdir(cwd.c_str()) < 0) {
-		log_error("chdir(2) to %s", cwd.c_str());
-		throw std::system_error(errno, std::system_category());
-	}
-
-	/* TODO: deprecate the root_directory logic in favor of chroot_jail */
-	const char *rootdir = this->manifest.json["RootDirectory"].get<string>().c_str();
-	if (rootdir != nullptr && getuid() == 0) {
-		if (chroot(rootdir) < 0) {
-			log_error("unable to chroot to %s", rootdir);
-			throw std::system_error(errno, std::system_category());
-		}
-	}
-
-#if 0
-	//TODO
-	if (job->jm->chroot_jail && getuid() == 0) {
-		if (chroot_jail_context_handler(job->jm->chroot_jail) < 0) {
-			log_error("unable to chroot to %s", job->jm->root_directory);
-			goto err_out;
-		}
-	}
-#endif
-
-	this->modify_credentials();
-
-	//FIXME: convert string to to mode_t
-	//(void) umask(job->jm->umask);
-
-	this->setup_environment();
-	this->createDescriptors();
-
-	if (this->useCapsicum()) {
-		this->createCapsicumLoaderDescriptors();
-		capsicum_resources_acquire(this->manifest.json, this->descriptors);
+	launch_descriptor_apply(this->launch_plan.getDescriptor(), fds.data());
+	this->environment = this->launch_plan.getDescriptor().envp;
+	this->createCapsicumLoaderDescriptors();
+	if (manifest.fields.has_capsicum_rights) {
+		capsicum_resources_acquire(this->manifest.getJSON(), this->descriptors);
 	}
 
 	this->exec();
@@ -470,9 +314,17 @@ void job_free(job_t job)
 
 void Job::load() {
 	//TODO: sockets
-	//TODO: schedule and timer
 
-	chroot_jail.parseManifest(manifest.json);
+	if (manifest.fields.has_chroot_jail) {
+		chroot_jail.parseManifest(manifest.getJSON());
+	}
+	launch_method = this->classifyLaunch();
+	this->lookup_credentials();
+	this->compileLaunchPlan();
+
+	if (manifest.fields.start_interval > 0) {
+		timer_register_job(*this);
+	}
 
 	this->setState(JOB_STATE_LOADED);
 	loaded = true;
@@ -556,14 +408,14 @@ void Job::unload()
 		this->setState(JOB_STATE_KILLED);
 		//TODO: start a timer to send a SIGKILL if it doesn't die gracefully
 	} else {
-		//TODO: update the timer interval in timer.c?
 		this->setState(JOB_STATE_DEFINED);
 	}
+	timer_unregister_job(*this);
 }
 
 void Job::acquire_resources() 
 {
-	if (manifest.json.find("ChrootJail") != manifest.json.end()) {
+	if (manifest.fields.has_chroot_jail) {
 		chroot_jail.acquireResources();
 	}
 
@@ -580,30 +432,130 @@ void Job::acquire_resources()
 }
 
 void Job::lookup_credentials() {
-	struct passwd *pwent;
-	struct group *grent;
+	libjob::CredentialCache& cache = libjob::CredentialCache::instance();
 
-	string user = this->manifest.json["UserName"];
-	if ((pwent = getpwnam(user.c_str())) == NULL) {
-		log_errno("getpwnam");
-		throw std::system_error(errno, std::system_category());
+	this->credentials_generation = cache.getGeneration();
+
+	libjob::UserCredentials user = cache.getUser(this->manifest.fields.user_name);
+	this->uid = user.uid;
+	this->home_directory = user.home_directory;
+	this->shell = user.shell;
+
+	libjob::GroupCredentials group = cache.getGroup(this->manifest.fields.group_name);
+	this->gid = group.gid;
+}
+
+void Job::compileLaunchPlan()
+{
+	LaunchDescriptor launch;
+
+	//TODO - SoftResourceLimits, HardResourceLimits
+	//TODO - LowPriorityIO
+
+	const libjob::ManifestFields& fields = this->manifest.fields;
+
+	launch.argv = fields.program;
+	if (fields.enable_globbing) {
+		log_warning("Globbing is not implemented yet");
+		//TODO: globbing
 	}
-	this->uid = pwent->pw_uid;
-	this->home_directory = std::string(pwent->pw_dir);
-	this->shell = std::string(pwent->pw_shell);
 
-	string group = this->manifest.json["GroupName"];
-	if ((grent = getgrnam(group.c_str())) == NULL) {
-		log_errno("getgrnam");
-		throw std::system_error(errno, std::system_category());
+	launch.user_name = fields.user_name;
+	launch.uid = this->uid;
+	launch.gid = this->gid;
+	launch.set_credentials = (getuid() == 0);
+	launch.new_session = !this->manager->isNoFork();
+	launch.nice = fields.nice;
+	launch.working_directory = fields.working_directory;
+	/* TODO: deprecate the root_directory logic in favor of chroot_jail */
+	if (getuid() == 0) {
+		launch.root_directory = fields.root_directory;
+	}
+	launch.stdin_path = fields.stdin_path;
+	launch.stdout_path = fields.stdout_path;
+	launch.stderr_path = fields.stderr_path;
+
+	this->setup_environment(launch.envp);
+
+	/*
+	 * The descriptors themselves are created each time the job is run.
+	 * They are numbered from 3 in the job, after stdin, stdout and stderr.
+	 */
+	for (auto& desc : fields.create_descriptors) {
+		int target = 3 + launch.descriptor_targets.size();
+		launch.descriptor_targets.push_back(target);
+
+		string kv = "JOB_DESCRIPTOR_" + desc.first + '=' + std::to_string(target);
+		launch.envp.push_back(kv);
+		log_debug("setting %s", kv.c_str());
 	}
-	this->gid = grent->gr_gid;
+
+	this->launch_plan.compile(launch);
 }
 
-void Job::run() {
+/*
+ * Everything that the fast path does in the child can be described by a
+ * LaunchDescriptor without any descriptors. A chroot jail, Capsicum, or
+ * descriptors created for the job all need the full fork(2) path.
+ */
+job_launch_t Job::classifyLaunch()
+{
+	if (manifest.fields.has_chroot_jail ||
+			!manifest.fields.create_descriptors.empty() ||
+			this->useCapsicum()) {
+		return JOB_LAUNCH_FORK;
+	}
+	return JOB_LAUNCH_SPAWN;
+}
+
+bool Job::canUseSpawnHelper()
+{
+	/* Capsicum sandboxes have to be built in the child process */
+	if (this->useCapsicum()) {
+		return false;
+	}
+
+	/* A kqueue is not inherited by a child, nor can it be passed over a socket */
+	for (auto& desc : manifest.fields.create_descriptors) {
+		if (desc.second[0] == "kqueue") {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+pid_t Job::spawnWithHelper(SpawnHelper& helper)
+{
+	std::vector<int> fds = this->createDescriptors();
+	pid_t pid;
+
+	try {
+		pid = helper.spawn(this->launch_plan, fds);
+	} catch (const std::system_error& e) {
+		log_error("the spawn helper was unable to start %s: %s",
+				this->label.c_str(), e.what());
+		pid = -1;
+	} catch (const std::runtime_error& e) {
+		this->manager->abandonSpawnHelper(e.what());
+		pid = -1;
+	} catch (...) {
+		for (int fd : fds) {
+			(void) close(fd);
+		}
+		throw;
+	}
+
+	/* The job has its own copy of the descriptors, or a forked job makes new ones */
+	for (int fd : fds) {
+		(void) close(fd);
+	}
+	return pid;
+}
+
+pid_t Job::forkChildProcess()
+{
 	pid_t pid;
-	this->acquire_resources();
-	this->lookup_credentials();
 
 	// This is useful for debugging errors that prevent exec()
 	if (this->manager->isNoFork()) {
@@ -622,23 +574,82 @@ void Job::run() {
 		} catch(const std::system_error& e) {
 			//FIXME: log_error("child caught exception: errno=%d (%s)", e.code(), e.what());
 			log_error("child caught system_error: errno=%s", e.what());
-			exit(124);
+			_exit(124);
 		} catch (const std::exception& e) {
 			log_error("child caught exception: %s", e.what());
-			exit(124);
+			_exit(124);
 		}
-	} else {
-		this->jobStatus.setPid(pid);
-		log_debug("job %s started with pid %d", this->label.c_str(), pid);
-		this->setState(JOB_STATE_RUNNING);
-		this->restart_after = 0;
-		manager->createProcessEventWatch(pid);
-		// FIXME: close descriptors that the master process no longer needs
-#if 0
-		SLIST_FOREACH(jms, &job->jm->sockets, entry) {
-			job_manifest_socket_close(jms);
+	}
+	return pid;
+}
+
+void Job::run() {
+	SpawnHelper* helper;
+	pid_t pid;
+
+	this->acquire_resources();
+
+	/* The user or group database has changed since the plan was compiled */
+	if (libjob::CredentialCache::instance().getGeneration() != this->credentials_generation) {
+		log_debug("recompiling the launch plan of %s", this->label.c_str());
+		this->lookup_credentials();
+		this->compileLaunchPlan();
+	}
+
+	/*
+	 * Simple jobs are started with vfork(2), which does not copy our page
+	 * tables. The rest are started by the spawn helper whenever possible.
+	 * The helper reports the exit of the jobs it starts, so there is no
+	 * process watch to create for them unless the helper goes away.
+	 */
+	helper = this->manager->getSpawnHelper();
+	try {
+		pid = -1;
+		if (this->launch_method == JOB_LAUNCH_SPAWN && !this->manager->isNoFork()) {
+			pid = launch_plan_vfork(this->launch_plan);
+			manager->createProcessEventWatch(pid);
+		} else if (helper != nullptr && this->canUseSpawnHelper()) {
+			pid = this->spawnWithHelper(*helper);
+			if (pid > 0) {
+				manager->trackHelperProcess(pid);
+			}
+		}
+		/* The helper may have failed, in which case the job is forked here */
+		if (pid < 0) {
+			pid = this->forkChildProcess();
+			manager->createProcessEventWatch(pid);
 		}
+	} catch (const std::system_error& e) {
+		/* Leave the job faulted rather than forgetting about it */
+		log_error("unable to start %s: %s", this->label.c_str(), e.what());
+		this->jobProperty.setFaulted(libjob::JobProperty::JOB_FAULT_STATE_OFFLINE,
+				"The process could not be started");
+		this->queueCommit();
+		ipc_publish_event("faulted", this->label, 0, 0, 0, "The process could not be started");
+		return;
+	}
+
+	this->jobStatus.setPid(pid);
+	this->started_at = time(NULL);
+	this->queueCommit();
+	log_debug("job %s started with pid %d", this->label.c_str(), pid);
+	this->setState(JOB_STATE_RUNNING);
+	manager->cancelKeepalive(this);
+	manager->indexPid(pid, this);
+	ipc_publish_event("started", this->label, pid);
+	// FIXME: close descriptors that the master process no longer needs
+#if 0
+	SLIST_FOREACH(jms, &job->jm->sockets, entry) {
+		job_manifest_socket_close(jms);
+	}
 #endif
+}
+
+void Job::queueCommit()
+{
+	if (!this->commit_queued && this->manager) {
+		this->commit_queued = true;
+		this->manager->queueCommit(this);
 	}
 }
 
@@ -647,6 +658,8 @@ void Job::clearFault()
 	if (this->isFaulted()) {
 		log_info("cleared faulted job: %s", this->getLabel().c_str());
 		this->jobProperty.setFaulted(libjob::JobProperty::JOB_FAULT_STATE_NONE, "");
+		this->queueCommit();
+		ipc_publish_event("cleared", this->label);
 		this->setState(JOB_STATE_LOADED);
 		if (this->isRunnable()) {
 			this->run();
@@ -656,35 +669,28 @@ void Job::clearFault()
 	}
 }
 
-void Job::createDescriptors()
+std::vector<int> Job::createDescriptors()
 {
-	if (manifest.json.find("CreateDescriptors") != manifest.json.end()) {
-		log_debug("creating descriptors");
-		nlohmann::json o = manifest.json["CreateDescriptors"];
-		for (nlohmann::json::iterator it = o.begin(); it != o.end(); ++it) {
-			int fd = create_descriptor_for(it.value());
-			descriptors[it.key()] = fd;
-
-			// Push this as an environment variable
-			string key = "JOB_DESCRIPTOR_" + it.key();
-			string kv = key + '=' + std::to_string(fd);
-			this->environment.push_back(kv);
-			log_debug("setting %s", kv.c_str());
+	std::vector<int> fds;
+
+	for (auto& desc : manifest.fields.create_descriptors) {
+		int fd = create_descriptor_for(desc.second);
+		if (fd < 0) {
+			int saved_errno = errno;
+			for (int created : fds) {
+				(void) close(created);
+			}
+			throw std::system_error(saved_errno, std::system_category());
 		}
-	}
-}
 
-void Job::enterCapabilityMode()
-{
-#if HAVE_CAPSICUM
-	if (manifest.json.find("CapsicumRights") != manifest.json.end()) {
-		cap_enter();
-		log_debug("entered capability mode");
+		/* This is the number it will have in the job; see compileLaunchPlan() */
+		descriptors[desc.first] = 3 + fds.size();
+		fds.push_back(fd);
 	}
-#endif
+	return fds;
 }
 
 bool Job::useCapsicum()
 {
-	return (manifest.json.find("CapsicumRights") != manifest.json.end());
+	return manifest.fields.has_capsicum_rights;
 }
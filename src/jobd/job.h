@@ -26,11 +26,16 @@
 #include <unistd.h>
 
 #include "chroot.h"
+#include "ipc.h"
+#include "keepalive.h"
+#include "timerwheel.h"
 #include "manifest.h"
+#include "spawn.h"
 #include <libjob/jobProperty.hpp>
 #include <libjob/jobStatus.hpp>
 #include "../libjob/namespaceImport.hpp"
 #include "../libjob/manifest.hpp"
+#include "../libjob/manifestCache.hpp"
 #include "../libjob/logger.h"
 
 class JobManager;
@@ -62,6 +67,15 @@ typedef enum e_job_state {
 	JOB_STATE_EXITED,
 } job_state_t;
 
+/** How the process of a job is started. This is decided by load(). */
+typedef enum {
+	/** vfork(2) and exec directly from jobd; for jobs with simple needs */
+	JOB_LAUNCH_SPAWN,
+
+	/** fork(2) and exec, via the spawn helper whenever possible */
+	JOB_LAUNCH_FORK,
+} job_launch_t;
+
 
 struct job {
 	LIST_ENTRY(job)	joblist_entry;
@@ -91,11 +105,15 @@ class Job {
 public:
 	Job() {
 		this->setState(JOB_STATE_INVALID);
+		this->keepalive.job = this;
+		this->start_interval_timer.job = this;
 	}
 
 	Job(const string label)
 	{
 		this->setLabel(label);
+		this->keepalive.job = this;
+		this->start_interval_timer.job = this;
 	}
 
 	~Job() {}
@@ -115,15 +133,32 @@ public:
 		this->label = label;
 	}
 
-	void parseManifest(const string path)
+	/** Use a manifest that has already been read */
+	void setManifest(libjob::Manifest&& manifest)
+	{
+		this->manifest = std::move(manifest);
+		this->setLabel(this->manifest.getLabel());
+		this->setState(JOB_STATE_DEFINED);
+	}
+
+	/**
+	 * Read the manifest at @path, or take it from @cache if the cache has
+	 * an up to date copy. Returns true if it came from the cache.
+	 */
+	bool parseManifest(const string path, libjob::ManifestCache* cache = nullptr)
 	{
 		try {
-			this->manifest.readFile(path);
+			bool cached = (cache && cache->lookup(path, this->manifest));
+			if (!cached) {
+				this->manifest.readFile(path);
+			}
 			this->setLabel(this->manifest.getLabel());
 			this->setState(JOB_STATE_DEFINED);
+			return cached;
 		} catch (...) {
 			log_error("readFile() failed");
 			this->setState(JOB_STATE_INVALID);
+			return false;
 		}
 	}
 
@@ -153,7 +188,10 @@ public:
 
 	void setState(enum e_job_state state)
 	{
-		this->state = state;
+		if (this->state != state) {
+			this->state = state;
+			this->queueCommit();
+		}
 	}
 
 	bool isRunnable() const
@@ -182,6 +220,8 @@ public:
 	void setEnabled(bool enabled)
 	{
 		this->jobProperty.setEnabled(enabled);
+		this->queueCommit();
+		ipc_publish_event(enabled ? "enabled" : "disabled", this->label);
 		if (enabled && this->isRunnable()) {
 			this->run();
 		} else if (!enabled && this->getState() == JOB_STATE_RUNNING) {
@@ -189,11 +229,32 @@ public:
 		}
 	}
 
+	/** StartInterval: seconds between the starts of the job, or 0 if it is not periodic */
+	unsigned long getStartInterval() const
+	{
+		return manifest.fields.start_interval;
+	}
+
+	TimerWheel::Entry& getStartIntervalTimer()
+	{
+		return start_interval_timer;
+	}
+
 	void setManager(JobManager* manager)
 	{
 		this->manager = manager;
 	}
 
+	/** Write out the status and properties of the job, if they have changed */
+	void commit()
+	{
+		this->jobStatus.commit();
+		this->jobProperty.commit();
+	}
+
+	/** Ask the manager to commit() the job before it next waits for events */
+	void queueCommit();
+
 	void clearFault();
 	void load();
 	void run();
@@ -205,7 +266,7 @@ public:
 	}
 
 private:
-	JobManager* manager;
+	JobManager* manager = nullptr;
 	struct job jm; // XXX-FIXME for build testing
 	char	*program;
 ///^^^kill the above
@@ -214,7 +275,7 @@ private:
 	libjob::Manifest manifest;
 	libjob::JobStatus jobStatus;
 	libjob::JobProperty jobProperty;
-	enum e_job_state state;
+	enum e_job_state state = JOB_STATE_INVALID;
 
 	bool loaded = false;
 
@@ -227,14 +288,36 @@ private:
 	std::string home_directory;
 	std::string shell;
 
-	/** KeepAlive=true ? After this walltime, the job should be restarted */
-	time_t restart_after = 0;
+	/** The CredentialCache generation that the credentials were looked up in */
+	uint64_t credentials_generation = 0;
+
+	/** True if the job is in the manager's list of jobs to commit() */
+	bool commit_queued = false;
+
+	/** Our slot in the status table, or -1 if we do not have one */
+	int status_slot = -1;
 
-	/** Environment variables, in the form of KEY=value */
+	/** The wall clock times when the job was last started, and last exited */
+	time_t started_at = 0;
+	time_t exited_at = 0;
+
+	/** KeepAlive=true ? Our place in the queue of jobs waiting to be restarted */
+	KeepaliveQueue::Entry keepalive;
+
+	/** How the process is started; see classifyLaunch() */
+	job_launch_t launch_method = JOB_LAUNCH_FORK;
+
+	/** StartInterval=N ? When the job should be started next */
+	TimerWheel::Entry start_interval_timer;
+
+	/** How to start the job, compiled by load() */
+	LaunchPlan launch_plan;
+
+	/** Environment variables, in the form of KEY=value. Only used by Capsicum jobs. */
 	vector<string> environment;
 
 	std::map<std::string, int> descriptors;
-	void createDescriptors();
+	std::vector<int> createDescriptors();
 
 	// Capsicum
 	void enterCapabilityMode();
@@ -242,13 +325,16 @@ private:
 	bool useCapsicum();
 
 	void acquire_resources();
-	void apply_resource_limits();
 	void lookup_credentials();
-	void modify_credentials();
 	void start_child_process();
-	void redirect_stdio();
-	void setup_environment();
+	void setup_environment(vector<string>& environment);
 	void exec();
+
+	job_launch_t classifyLaunch();
+	bool canUseSpawnHelper();
+	void compileLaunchPlan();
+	pid_t spawnWithHelper(SpawnHelper& helper);
+	pid_t forkChildProcess();
 };
 
 extern const int launchd_signals[];
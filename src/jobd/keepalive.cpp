@@ -14,74 +14,104 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#if 0
 
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/event.h>
-#include <limits.h>
-#include <unistd.h>
-
-#include "clock.h"
-#include <libjob/logger.h>
 #include "keepalive.h"
-#include "job.h"
 
-/* The main kqueue descriptor used by launchd */
-static int parent_kqfd;
+void KeepaliveQueue::schedule(Entry& entry, time_t restart_after)
+{
+	if (entry.isQueued()) {
+		time_t previous = entry.restart_after;
+		entry.restart_after = restart_after;
+		if (restart_after < previous) {
+			siftUp(entry.index);
+		} else {
+			siftDown(entry.index);
+		}
+	} else {
+		entry.restart_after = restart_after;
+		heap.push_back(&entry);
+		entry.index = heap.size() - 1;
+		siftUp(entry.index);
+	}
+}
 
-struct watchdog {
-	job_t job;
-	time_t restart_after; /* After this walltime, the job should be restarted */
-	SLIST_ENTRY(watchdog) watchdog_sle;
-};
-typedef struct watchdog * watchdog_t;
+void KeepaliveQueue::cancel(Entry& entry)
+{
+	if (entry.isQueued()) {
+		removeAt(entry.index);
+	}
+}
 
-static SLIST_HEAD(, watchdog) watchdog_list;
+KeepaliveQueue::Entry* KeepaliveQueue::popDue(time_t now)
+{
+	if (heap.empty() || heap.front()->restart_after > now) {
+		return nullptr;
+	}
 
-static struct watchdog *watchdog_new(job_t job);
-static void update_wake_interval();
+	Entry* entry = heap.front();
+	removeAt(0);
+	return entry;
+}
 
-//DEADWOOD
-int keepalive_init(int kqfd)
+void KeepaliveQueue::place(size_t index, Entry* entry)
 {
-	parent_kqfd = kqfd;
-	return 0;
+	heap[index] = entry;
+	entry->index = index;
 }
 
-int keepalive_add_job(Job& job)
+void KeepaliveQueue::siftUp(size_t index)
 {
-	if (job.manifest.json["KeepAlive"].get<bool>() == true) {
-//		log_debug("job `%s' will be automatically restarted in %d seconds",
-//				job.getLabel(), job.);
-		update_wake_interval();
+	Entry* entry = heap[index];
+
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (heap[parent]->restart_after <= entry->restart_after) {
+			break;
+		}
+		place(index, heap[parent]);
+		index = parent;
 	}
-	return 0;
+	place(index, entry);
 }
 
-void keepalive_remove_job(Job& job) {
-	job.setRestartAfter(0);
-	update_wake_interval();
+void KeepaliveQueue::siftDown(size_t index)
+{
+	Entry* entry = heap[index];
+	size_t count = heap.size();
+
+	for (;;) {
+		size_t child = (2 * index) + 1;
+		if (child >= count) {
+			break;
+		}
+		if (child + 1 < count &&
+				heap[child + 1]->restart_after < heap[child]->restart_after) {
+			child++;
+		}
+		if (entry->restart_after <= heap[child]->restart_after) {
+			break;
+		}
+		place(index, heap[child]);
+		index = child;
+	}
+	place(index, entry);
 }
 
-void keepalive_wake_handler(void)
+void KeepaliveQueue::removeAt(size_t index)
 {
-	watchdog_t cur, tmp;
-	time_t now = current_time();
+	Entry* removed = heap[index];
+	Entry* last = heap.back();
 
-	log_debug("watchdog handler running");
-	update_wake_interval();
+	heap.pop_back();
+	removed->index = npos;
+	if (removed == last) {
+		return;
+	}
 
-	SLIST_FOREACH_SAFE(cur, &watchdog_list, watchdog_sle, tmp) {
-		if (now >= cur->restart_after) {
-			if (cur->job->state != JOB_STATE_RUNNING) {
-				log_debug("job `%s' restarted due to KeepAlive mechanism", cur->job->jm->label);
-				job_run(cur->job);
-			}
-			SLIST_REMOVE(&watchdog_list, cur, watchdog, watchdog_sle);
-			free(cur);
-		}
+	place(index, last);
+	if (index > 0 && last->restart_after < heap[(index - 1) / 2]->restart_after) {
+		siftUp(index);
+	} else {
+		siftDown(index);
 	}
 }
-
-#endif
@@ -14,3 +14,69 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+
+#ifndef RELAUNCHD_KEEPALIVE_H_
+#define RELAUNCHD_KEEPALIVE_H_
+
+#include <cstddef>
+#include <vector>
+
+extern "C" {
+#include <time.h>
+}
+
+class Job;
+
+/**
+ * The set of jobs that are waiting to be restarted by the KeepAlive
+ * mechanism, ordered by the time they are due.
+ *
+ * This is an indexed binary min-heap: each job embeds an Entry that
+ * remembers its own position in the heap, so it can be removed or
+ * rescheduled in O(log N) without searching for it.
+ */
+class KeepaliveQueue {
+public:
+	static const size_t npos = static_cast<size_t>(-1);
+
+	/** A job's position in the queue */
+	struct Entry {
+		Job* job = nullptr;
+
+		/** After this walltime, the job should be restarted */
+		time_t restart_after = 0;
+
+		/** The position of this entry in the heap, or npos if not queued */
+		size_t index = npos;
+
+		bool isQueued() const { return index != npos; }
+	};
+
+	/** Insert an entry, or move it if it is already queued */
+	void schedule(Entry& entry, time_t restart_after);
+
+	/** Remove an entry from the queue. Does nothing if it is not queued. */
+	void cancel(Entry& entry);
+
+	/**
+	 * Remove and return the soonest entry that is due at or before the
+	 * given time, or nullptr if nothing is due yet.
+	 */
+	Entry* popDue(time_t now);
+
+	/** The time the soonest entry is due. Only valid if !empty() */
+	time_t nextWakeup() const { return heap.front()->restart_after; }
+
+	bool empty() const { return heap.empty(); }
+	size_t size() const { return heap.size(); }
+
+private:
+	std::vector<Entry*> heap;
+
+	void place(size_t index, Entry* entry);
+	void siftUp(size_t index);
+	void siftDown(size_t index);
+	void removeAt(size_t index);
+};
+
+#endif /* RELAUNCHD_KEEPALIVE_H_ */
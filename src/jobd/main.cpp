@@ -30,7 +30,6 @@
 #include <syslog.h>
 #include "../../vendor/FreeBSD/sys/queue.h"
 #include <sys/types.h>
-#include <sys/event.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -89,11 +88,27 @@ main(int argc, char *argv[])
 	options.daemon = true;
 	options.log_level = LOG_NOTICE;
 
-	while ((c = getopt(argc, argv, "fv")) != -1) {
+	while ((c = getopt(argc, argv, "b:fj:s:v")) != -1) {
 			switch (c) {
+			case 'b':
+					manager.setEventBatchSize(strtoul(optarg, NULL, 10));
+					break;
+			case 's':
+					{
+						libjob::journal_sync_t policy;
+						if (!libjob::Journal::parseSyncPolicy(optarg, policy)) {
+							fprintf(stderr, "Invalid sync policy: %s\n", optarg);
+							exit(EXIT_FAILURE);
+						}
+						manager.setSyncPolicy(policy);
+					}
+					break;
 			case 'f':
 					options.daemon = false;
 					break;
+			case 'j':
+					manager.setParseThreads(strtoul(optarg, NULL, 10));
+					break;
 			case 'v':
 					options.log_level = LOG_DEBUG;
 					break;
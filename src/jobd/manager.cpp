@@ -16,27 +16,38 @@
 
 #include "../../vendor/FreeBSD/sys/queue.h"
 
+#include <algorithm>
 #include <regex>
 #include <unordered_set>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 
 extern "C" {
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/event.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#elif defined(__FreeBSD__)
+#include <sys/procctl.h>
+#endif
 }
 
 #include "../config.h"
 
 #include "clock.h"
 #include "calendar.h"
+#include "event.h"
 #include "ipc.h"
+#include <libjob/contentHash.hpp>
+#include <libjob/manifestLoader.hpp>
 #include <libjob/logger.h>
 #include <libjob/jobProperty.hpp>
 #include "job.h"
@@ -61,6 +72,22 @@ static void *keepalive_wake_handler = NULL; //kludge
 static void setup_logging();
 void run_pending_jobs(void);
 
+/*
+ * Make jobd the subreaper of its descendants, so that orphaned processes
+ * are reparented to it instead of init. Returns -1 if this is not possible.
+ */
+static int become_subreaper()
+{
+#if defined(__linux__)
+	return prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+#elif defined(__FreeBSD__)
+	return procctl(P_PID, getpid(), PROC_REAP_ACQUIRE, NULL);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 launchd_options_t options;
 
 void JobManager::setup(struct pidfh *pfh)
@@ -69,33 +96,87 @@ void JobManager::setup(struct pidfh *pfh)
 
 	if (getenv("JOBD_DEBUG_NOFORK")) {
 		this->setNoFork(true);
+	} else {
+		/*
+		 * The jobs that the helper starts are its children. If it dies,
+		 * they are reparented to us, so we can keep watching them.
+		 */
+		if (become_subreaper() < 0) {
+			log_errno("unable to become a subreaper");
+		} else {
+			this->subreaper = true;
+		}
+
+		/* Start the helper before any jobs are loaded, while we are small */
+		this->spawnHelper.start();
 	}
 
-	if ((this->kqfd = kqueue()) < 0)
-		err(1, "kqueue(2)");
+	this->events = EventBackend::create();
+	if (this->spawnHelper.isRunning()) {
+		this->events->watchRead(this->spawnHelper.getExitDescriptor(), &this->spawnHelper);
+	}
+	/*
+	 * Jobs whose exit can't be watched directly, and orphans that are not
+	 * jobs, are reaped when this arrives. It must not be ignored.
+	 */
+	this->events->watchSignal(SIGCHLD, (void *)&launchd_signals);
 	setup_logging();
 	this->setupSignalHandlers();
-	setup_socket_activation(this->kqfd);
+	setup_socket_activation(*this->events);
 	this->setupDataDirectory();
-	if (setup_timers(this->kqfd) < 0)
+	if (setup_timers(*this->events) < 0)
 		errx(1, "setup_timers()");
 //FIXME	if (calendar_init(this->kqfd) < 0)
 		// errx(1, "calendar_init()");
-	if (ipc_init(this->kqfd) < 0)
+	if (ipc_init(*this->events) < 0)
 		errx(1, "ipc_init()");
 
+	this->monitorJobDirectory();
 	this->scanJobDirectory();
 }
 
+/* Returns true if the file at @path exists and has the given content_hash() */
+static bool file_has_content_hash(const std::string& path, uint64_t hash)
+{
+	std::ifstream ifs(path, std::ifstream::in);
+	if (!ifs) {
+		return false;
+	}
+
+	std::stringstream buf;
+	buf << ifs.rdbuf();
+	return libjob::content_hash(buf.str()) == hash;
+}
+
 void JobManager::defineJob(const string& path)
 {
 	unique_ptr<Job> job(new Job);
 
 	log_debug("parsing %s", path.c_str());
+	bool cached = job->parseManifest(path, &this->manifestCache);
+	if (job->getState() == JOB_STATE_INVALID) {
+		throw std::invalid_argument("invalid manifest: " + path);
+	}
+	this->insertJob(std::move(job), cached);
+}
+
+void JobManager::insertJob(unique_ptr<Job> job, bool cached)
+{
 	job->setManager(this);
-	job->parseManifest(path);
 	std::string label = job->getLabel();
 	if (jobs.find(label) != jobs.end()) {
+		/*
+		 * The old version is still exiting, as when the manifest of a
+		 * running job is renamed. Define this one once it is gone.
+		 */
+		if (this->retiringJobs.count(label) > 0) {
+			const libjob::Manifest& manifest = job->manifest;
+			log_notice("%s will be defined from %s when its old version exits",
+					label.c_str(), manifest.getPath().c_str());
+			this->pendingRedefinitions[label] = manifest.getPath();
+			this->trackManifestFile(manifest.getPath(), manifest.getSourceHash(), label);
+			return;
+		}
 		log_error("Duplicate label detected");
 		throw std::invalid_argument("Tried to add a job with a duplicate label");
 	}
@@ -103,28 +184,60 @@ void JobManager::defineJob(const string& path)
 	job->jobStatus.setLabel(label);
 	job->jobProperty.setLabel(label);
 
-	// Write the parsed, normalized JSON back out to a file
-	std::ofstream ofile;
-	ofile.open(jobd_config.getManifestDir() + '/' + label + ".json");
-	ofile << job->manifest.json.dump(4) << std::endl;
-	ofile.close();
+	// Write the parsed, normalized JSON back out to a file, unless it is already there
+	std::string manifest_path = jobd_config.getManifestDir() + '/' + label + ".json";
+	libjob::Manifest& manifest = job->manifest;
+	bool unchanged;
+	if (manifest.getPath() == manifest_path) {
+		unchanged = (manifest.getSourceHash() == manifest.getContentHash());
+	} else {
+		unchanged = file_has_content_hash(manifest_path, manifest.getContentHash());
+	}
+	if (unchanged) {
+		log_debug("%s is up to date", manifest_path.c_str());
+	} else {
+		std::ofstream ofile;
+		ofile.open(manifest_path);
+		ofile << manifest.serialize();
+		ofile.close();
+		if (manifest_path == manifest.getPath()) {
+			manifest.markSourceNormalized();
+			cached = false;
+		} else {
+			this->trackManifestFile(manifest_path, manifest.getContentHash(), label);
+		}
+	}
+	if (!cached && job->getState() != JOB_STATE_INVALID) {
+		this->manifestCache.store(manifest.getPath(), manifest);
+	}
+	this->trackManifestFile(manifest.getPath(), manifest.getSourceHash(), label);
 
+	Job* jobp = job.get();
 	if (!jobs.insert(std::make_pair(label, std::move(job))).second) {
 		// should not happen because we check earlier, but..
 		log_error("Duplicate label detected");
 		throw std::invalid_argument("Tried to add a job with a duplicate label");
 	}
+
+	if (this->statusTable.isOpen()) {
+		try {
+			jobp->status_slot = this->statusTable.allocate(label);
+			jobp->queueCommit();
+		} catch (const std::system_error& e) {
+			log_error("unable to add %s to the status table: %s", label.c_str(), e.what());
+		}
+	}
 }
 
 void JobManager::scanJobDirectory()
 {
 	DIR	*dirp;
 	struct dirent entry, *result;
-	size_t job_count = 0;
-	size_t pending_jobs = 0;
+	std::vector<std::string> paths;
 	std::string jobdir = jobd_config.getManifestDir();
 
 	log_debug("scanning %s for jobs", jobdir.c_str());
+	this->manifestCache.open(jobd_config.getManifestCachePath());
 	if ((dirp = opendir(jobdir.c_str())) == NULL)
 		err(1, "opendir(3)");
 
@@ -136,22 +249,229 @@ void JobManager::scanJobDirectory()
 			continue;
 		}
 
-		std::string d_name = std::string(entry.d_name);
-		std::string path = jobdir + "/" + d_name;
-		try {
-			defineJob(path);
-		} catch (std::system_error& e) {
-			log_error("error parsing %s: %s", path.c_str(), e.what());
-		}
+		paths.push_back(jobdir + "/" + entry.d_name);
 	}
 	if (closedir(dirp) < 0)
 		err(1, "closedir(3)");
 
-	log_debug("finished scanning jobs: total=%zu new=%zu", job_count, pending_jobs);
+	/*
+	 * Parse the manifests in parallel, then define the jobs one at a time,
+	 * in order of their path, so that the same one wins every time two
+	 * manifests have the same label.
+	 */
+	std::sort(paths.begin(), paths.end());
+	std::vector<libjob::ManifestLoadResult> manifests =
+			libjob::load_manifests(paths, &this->manifestCache, this->parseThreads);
+	log_debug("manifest cache: %zu hits, %zu misses",
+			this->manifestCache.getHitCount(), this->manifestCache.getMissCount());
+
+	for (libjob::ManifestLoadResult& it : manifests) {
+		this->defineLoadedManifest(it);
+	}
+	this->manifestCache.save();
+
+	log_debug("finished scanning jobs: total=%zu defined=%zu", paths.size(), this->jobs.size());
 
 	runPendingJobs();
 }
 
+/* Fill in the identity of the file at @path, or return false if it does not exist */
+static bool stat_manifest_file(const std::string& path, dev_t& dev, ino_t& ino, off_t& size,
+		time_t& mtime_sec, long& mtime_nsec)
+{
+	struct stat sb;
+
+	if (stat(path.c_str(), &sb) < 0) {
+		return false;
+	}
+	dev = sb.st_dev;
+	ino = sb.st_ino;
+	size = sb.st_size;
+	mtime_sec = sb.st_mtim.tv_sec;
+	mtime_nsec = sb.st_mtim.tv_nsec;
+	return true;
+}
+
+void JobManager::trackManifestFile(const std::string& path, uint64_t hash, const std::string& label)
+{
+	ManifestFile file;
+
+	if (!stat_manifest_file(path, file.dev, file.ino, file.size, file.mtime_sec, file.mtime_nsec)) {
+		this->manifestFiles.erase(path);
+		return;
+	}
+	file.hash = hash;
+	file.label = label;
+	this->manifestFiles[path] = file;
+}
+
+void JobManager::defineLoadedManifest(libjob::ManifestLoadResult& result)
+{
+	if (!result.error.empty()) {
+		log_error("error parsing %s: %s", result.path.c_str(), result.error.c_str());
+		this->trackManifestFile(result.path, 0, "");
+		return;
+	}
+
+	uint64_t hash = result.manifest.getSourceHash();
+	try {
+		unique_ptr<Job> job(new Job);
+		job->setManifest(std::move(result.manifest));
+		this->insertJob(std::move(job), result.cached);
+	} catch (std::system_error& e) {
+		log_error("error defining %s: %s", result.path.c_str(), e.what());
+		this->trackManifestFile(result.path, hash, "");
+	} catch (std::invalid_argument& e) {
+		log_error("invalid manifest %s: %s", result.path.c_str(), e.what());
+		this->trackManifestFile(result.path, hash, "");
+	}
+}
+
+bool JobManager::retireJob(Job& job, const std::string& replacement)
+{
+	std::string label = job.getLabel();
+
+	this->retiringJobs.insert(label);
+	if (job.isLoaded()) {
+		job.unload();
+	}
+	if (job.getState() == JOB_STATE_DEFINED) {
+		this->deleteJob(job);
+		return true;
+	}
+
+	log_debug("%s will be removed when it exits", label.c_str());
+	if (!replacement.empty()) {
+		this->pendingRedefinitions[label] = replacement;
+	}
+	return false;
+}
+
+void JobManager::runPendingRedefinitions()
+{
+	std::vector<std::string> paths;
+
+	for (auto it = this->pendingRedefinitions.begin(); it != this->pendingRedefinitions.end(); ) {
+		if (this->jobs.count(it->first) == 0) {
+			paths.push_back(it->second);
+			it = this->pendingRedefinitions.erase(it);
+		} else {
+			++it;
+		}
+	}
+	if (paths.empty()) {
+		return;
+	}
+
+	for (libjob::ManifestLoadResult& it : libjob::load_manifests(paths, nullptr, 1)) {
+		this->defineLoadedManifest(it);
+	}
+	this->runPendingJobs();
+}
+
+void JobManager::reloadJobDirectory(bool rescan_all)
+{
+	std::string jobdir = jobd_config.getManifestDir();
+	std::vector<std::string> candidates;
+
+	if (rescan_all || !this->events->takeDirectoryChanges(candidates)) {
+		DIR *dirp;
+		struct dirent *ent;
+
+		candidates.clear();
+		if ((dirp = opendir(jobdir.c_str())) == NULL) {
+			log_errno("opendir(3) of %s", jobdir.c_str());
+			return;
+		}
+		while ((ent = readdir(dirp)) != NULL) {
+			if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+				candidates.push_back(jobdir + "/" + ent->d_name);
+			}
+		}
+		(void) closedir(dirp);
+
+		/* Files outside of the directory, such as those given to jobadm load */
+		for (auto& it : this->manifestFiles) {
+			candidates.push_back(it.first);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+	/* Compare each file with what it looked like when it was last read */
+	std::vector<std::string> changed, removed;
+	for (const std::string& path : candidates) {
+		auto tracked = this->manifestFiles.find(path);
+		ManifestFile current;
+		if (!stat_manifest_file(path, current.dev, current.ino, current.size,
+				current.mtime_sec, current.mtime_nsec)) {
+			if (tracked != this->manifestFiles.end()) {
+				removed.push_back(path);
+			}
+		} else if (tracked == this->manifestFiles.end()) {
+			/* Editors leave hidden temporary files behind */
+			if (path.compare(0, jobdir.size() + 2, jobdir + "/.") != 0) {
+				changed.push_back(path);
+			}
+		} else {
+			const ManifestFile& last = tracked->second;
+			if (last.dev != current.dev || last.ino != current.ino || last.size != current.size
+					|| last.mtime_sec != current.mtime_sec || last.mtime_nsec != current.mtime_nsec) {
+				changed.push_back(path);
+			}
+		}
+	}
+	log_debug("reloading %s: %zu entries checked, %zu changed, %zu removed",
+			jobdir.c_str(), candidates.size(), changed.size(), removed.size());
+
+	for (const std::string& path : removed) {
+		std::string label = this->manifestFiles[path].label;
+		this->manifestFiles.erase(path);
+
+		auto it = this->jobs.find(label);
+		if (it != this->jobs.end() && it->second->manifest.getPath() == path) {
+			log_notice("unloading %s because %s was removed", label.c_str(), path.c_str());
+			this->retireJob(*it->second, "");
+		}
+	}
+
+	for (libjob::ManifestLoadResult& result : libjob::load_manifests(changed, nullptr, this->parseThreads)) {
+		auto tracked = this->manifestFiles.find(result.path);
+		std::string label = (tracked != this->manifestFiles.end()) ? tracked->second.label : "";
+
+		if (!result.error.empty()) {
+			/* Keep the job from the last good version of the manifest */
+			log_error("error parsing %s: %s", result.path.c_str(), result.error.c_str());
+			this->trackManifestFile(result.path, 0, label);
+			continue;
+		}
+		if (tracked != this->manifestFiles.end() && tracked->second.hash == result.manifest.getSourceHash()) {
+			/* Touched, or replaced with an identical copy */
+			this->trackManifestFile(result.path, tracked->second.hash, label);
+			continue;
+		}
+
+		auto it = this->jobs.find(label);
+		if (it != this->jobs.end() && it->second->manifest.getPath() == result.path) {
+			Job& job = *it->second;
+			if (job.manifest.getContentHash() == result.manifest.getContentHash()) {
+				this->trackManifestFile(result.path, result.manifest.getSourceHash(), label);
+				continue;
+			}
+
+			log_notice("reloading %s from %s", label.c_str(), result.path.c_str());
+			bool same_label = (result.manifest.getLabel() == label);
+			if (!this->retireJob(job, same_label ? result.path : "") && same_label) {
+				this->trackManifestFile(result.path, result.manifest.getSourceHash(), label);
+				continue;
+			}
+		}
+		this->defineLoadedManifest(result);
+	}
+
+	this->runPendingJobs();
+}
+
 void JobManager::runPendingJobs()
 {
 	/* Pass #1: load all jobs */
@@ -164,9 +484,9 @@ void JobManager::runPendingJobs()
 			job->load();
 		}
 
-		bool auto_enable = job->manifest.json["Enable"];
-		if (auto_enable) {
+		if (job->manifest.fields.enable) {
 			job->jobProperty.setEnabled(true);
+			job->queueCommit();
 		}
 	}
 
@@ -199,16 +519,18 @@ void JobManager::wakeJob(const string& label)
 }
 
 void JobManager::removeJob(Job& job) {
+	this->forgetPendingCommit(job);
+	this->releaseStatusSlot(job);
 	this->jobs.erase(job.getLabel());
 }
 
 void JobManager::clearJob(const string& label) {
-	unique_ptr<Job>& job = this->jobs.find(label)->second;
+	unique_ptr<Job>& job = this->getJobByLabel(label);
 	job->clearFault();
 }
 
 void JobManager::enableJob(const string& label) {
-	unique_ptr<Job>& job = this->jobs.find(label)->second;
+	unique_ptr<Job>& job = this->getJobByLabel(label);
 	if (job->isEnabled()) {
 		log_warning("tried to enable a job that was already enabled");
 	} else {
@@ -235,7 +557,7 @@ void JobManager::unloadJob(unique_ptr<Job>& job) {
 	log_debug("job %s unloaded", label.c_str());
 
 	if (job->getState() == JOB_STATE_DEFINED) {
-		deleteJob(job);
+		deleteJob(*job);
 	} else {
 		log_debug("job deletion deferred; state=%s", job->getStateString().c_str());
 	}
@@ -260,110 +582,172 @@ void JobManager::unloadAllJobs()
 
 void JobManager::createProcessEventWatch(pid_t pid)
 {
-	struct kevent kev;
-
-	EV_SET(&kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
-	if (kevent(this->kqfd, &kev, 1, NULL, 0, NULL) < 0) {
-		log_errno("kevent");
-		//TODO: probably want to crash, or kill the job, or do something
-		// more useful here.
+	try {
+		this->events->watchProcess(pid, NULL);
+	} catch (const std::system_error& e) {
+		log_error("unable to watch process %d: %s; it will be polled for instead",
+				pid, e.what());
+		this->unwatchedPids.insert(pid);
+		return;
 	}
 	log_debug("will be notified if process %d exits", pid);
 }
 
-void JobManager::deleteProcessEventWatch(pid_t pid)
+void JobManager::monitorJobDirectory()
+{
+	try {
+		this->events->watchDirectory(jobd_config.getManifestDir(), &this->manifestFiles);
+	} catch (const std::system_error& e) {
+		log_warning("changes to the manifest directory will only be noticed on SIGHUP");
+	}
+}
+
+unique_ptr<Job>& JobManager::getJobByLabel(const string& label)
 {
-	struct kevent kev;
+	auto it = this->jobs.find(label);
+	if (it == this->jobs.end())
+	{
+		throw std::out_of_range("job not found with label: " + label);
+	}
+
+	unique_ptr<Job>& job = it->second;
+	return job;
+}
 
-	/* This isn't necessary, I think, but just to be on the safe side.. */
-	EV_SET(&kev, pid, EVFILT_PROC, EV_DELETE, NOTE_EXIT, 0, NULL);
-	if (kevent(this->kqfd, &kev, 1, NULL, 0, NULL) < 0) {
-		if (errno != ENOENT)
-			err(1, "kevent");
+Job& JobManager::getJobByPid(pid_t pid)
+{
+	auto it = this->pidIndex.find(pid);
+	if (it == this->pidIndex.end()) {
+		throw std::out_of_range("job not found");
 	}
+	return *it->second;
 }
 
-//DEADWOOD
-#if 0
-void JobManager::monitorJobDirectory()
+void JobManager::trackHelperProcess(pid_t pid)
+{
+	this->helperPids.insert(pid);
+}
+
+void JobManager::indexPid(pid_t pid, Job* job)
+{
+	this->pidIndex[pid] = job;
+}
+
+void JobManager::unindexPid(pid_t pid)
 {
-	struct kevent kev;
-	int fd;
+	this->pidIndex.erase(pid);
+	this->helperPids.erase(pid);
+}
 
-	fd = open(jobd_config.getManifestDir().c_str(), O_RDONLY);
-	if (fd < 0) {
-		log_errno("open(2)");
-		throw std::system_error(errno, std::system_category());
+void JobManager::cancelKeepalive(Job* job)
+{
+	if (job->keepalive.isQueued()) {
+		this->keepaliveQueue.cancel(job->keepalive);
+		this->updateKeepaliveWakeInterval();
 	}
+}
 
-	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+void JobManager::queueCommit(Job* job)
+{
+	this->pendingCommits.push_back(job);
+}
 
-	EV_SET(&kev, fd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR,
-			NOTE_EXTEND | NOTE_WRITE | NOTE_ATTRIB, 0, 0);
-	if (kevent(this->kqfd, &kev, 1, NULL, 0, NULL) < 0) {
-		log_errno("kevent(2)");
-		throw std::system_error(errno, std::system_category());
+void JobManager::forgetPendingCommit(Job& job)
+{
+	if (job.commit_queued) {
+		auto it = std::find(pendingCommits.begin(), pendingCommits.end(), &job);
+		if (it != pendingCommits.end()) {
+			pendingCommits.erase(it);
+		}
+		job.commit_queued = false;
 	}
 }
-#endif
 
-unique_ptr<Job>& JobManager::getJobByLabel(const string& label)
+static_assert(JOB_STATE_EXITED == static_cast<int>(libjob::JOB_STATUS_EXITED),
+		"job_state_t and job_status_state_t are out of sync");
+
+void JobManager::publishStatus(Job& job)
 {
-	auto it = this->jobs.find(label);
-	if (it == this->jobs.end())
-	{
-		throw std::out_of_range("job not found with label: %s" + label);
+	if (job.status_slot < 0) {
+		return;
 	}
 
-	unique_ptr<Job>& job = it->second;
-	return job;
+	libjob::JobStatusRecord status;
+	status.pid = job.getPid();
+	status.state = static_cast<uint32_t>(job.state);
+	status.enabled = job.isEnabled();
+	status.fault_state = job.jobProperty.getFaultState();
+	status.last_exit_status = job.jobStatus.getLastExitStatus();
+	status.term_signal = job.jobStatus.getTermSignal();
+	status.started_at = job.started_at;
+	status.exited_at = job.exited_at;
+	status.updated_at = time(NULL);
+	this->statusTable.update(job.status_slot, status);
 }
 
-unique_ptr<Job>& JobManager::getJobByPid(pid_t pid)
+void JobManager::releaseStatusSlot(Job& job)
 {
-	for (auto& it : this->jobs) {
-		unique_ptr<Job>& job = it.second;
-		if (job->jobStatus.getPid() == pid) {
-			return job;
-		}
+	if (job.status_slot >= 0) {
+		this->statusTable.release(job.status_slot);
+		job.status_slot = -1;
 	}
-	throw std::out_of_range("job not found");
 }
 
-void JobManager::reapChildProcess(pid_t pid, int status)
+void JobManager::commitPendingJobs()
 {
-	int status2;
+	for (Job* job : this->pendingCommits) {
+		job->commit_queued = false;
+		try {
+			job->commit();
+			this->publishStatus(*job);
+		} catch (const std::exception& e) {
+			log_error("unable to save the state of %s: %s",
+					job->getLabel().c_str(), e.what());
+		}
+	}
+	this->pendingCommits.clear();
 
-	if (waitpid(pid, &status2, WNOHANG) != pid) {
-		log_errno("waitpid(2)");
+	try {
+		libjob::JobStatus::flushJournal();
+		libjob::JobProperty::flushJournal();
+	} catch (const std::exception& e) {
+		log_error("unable to write to the journal: %s", e.what());
 	}
+}
 
-	deleteProcessEventWatch(pid);
+void JobManager::reapChildProcess(pid_t pid, int status)
+{
+	int last_exit_status, term_signal;
+
+	if (WIFEXITED(status)) {
+		last_exit_status = WEXITSTATUS(status);
+		term_signal = 0;
+	} else if (WIFSIGNALED(status)) {
+		last_exit_status = -1;
+		term_signal = WTERMSIG(status);
+	} else {
+		term_signal = -1;
+		last_exit_status = -1;
+		log_error("unhandled exit status");
+	}
+	this->handleJobExit(pid, last_exit_status, term_signal);
+}
 
+void JobManager::handleJobExit(pid_t pid, int last_exit_status, int term_signal)
+{
 	try {
-		unique_ptr<Job>& job = this->getJobByPid(pid);
-
-		int last_exit_status, term_signal;
-		if (WIFEXITED(status)) {
-			last_exit_status = WEXITSTATUS(status);
-			term_signal = 0;
-		} else if (WIFSIGNALED(status)) {
-			last_exit_status = -1;
-			term_signal = WTERMSIG(status);
-		} else {
-			term_signal = -1;
-			last_exit_status = -1;
-			log_error("unhandled exit status");
-		}
+		Job& job = this->getJobByPid(pid);
+
 		log_debug("job %d exited with status=%d term_signal=%d",
-				job->jobStatus.getPid(), last_exit_status, term_signal);
+				job.jobStatus.getPid(), last_exit_status, term_signal);
 
-		//TODO: these three calls cause sync() to run three times.
-		// would like one function that sets all three,
-		// such as a Job::reap(last_exit_status, term_signal) function
-		job->jobStatus.setLastExitStatus(last_exit_status);
-		job->jobStatus.setTermSignal(term_signal);
-		job->jobStatus.setPid(0);
+		job.jobStatus.setLastExitStatus(last_exit_status);
+		job.jobStatus.setTermSignal(term_signal);
+		job.jobStatus.setPid(0);
+		job.exited_at = time(NULL);
+		job.queueCommit();
+		this->unindexPid(pid);
+		ipc_publish_event("exited", job.getLabel(), pid, last_exit_status, term_signal);
 
 		this->rescheduleJob(job);
 	} catch (std::out_of_range& e) {
@@ -372,53 +756,140 @@ void JobManager::reapChildProcess(pid_t pid, int status)
 	}
 }
 
-void JobManager::deleteJob(unique_ptr<Job>& job)
+void JobManager::reapUnwatchedProcesses()
+{
+	std::vector<pid_t> pids(this->unwatchedPids.begin(), this->unwatchedPids.end());
+	int status;
+
+	for (pid_t pid : pids) {
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			this->unwatchedPids.erase(pid);
+			this->reapChildProcess(pid, status);
+		}
+	}
+}
+
+void JobManager::reapOrphans()
+{
+	siginfo_t info;
+	int status;
+
+	for (;;) {
+		/* Look at the next zombie without reaping it */
+		memset(&info, 0, sizeof(info));
+		if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) {
+			return;
+		}
+
+		/*
+		 * Jobs and the spawn helper are reaped by their own handlers.
+		 * Any zombies behind this one are seen after it has been reaped.
+		 */
+		pid_t pid = info.si_pid;
+		if (this->pidIndex.count(pid) > 0 || pid == this->spawnHelper.getPid()) {
+			return;
+		}
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			log_debug("reaped orphaned process %d", pid);
+		} else {
+			return;
+		}
+	}
+}
+
+void JobManager::adoptHelperProcesses()
+{
+	std::vector<pid_t> pids(this->helperPids.begin(), this->helperPids.end());
+	int status;
+
+	/* Reaping a job removes it from helperPids, so work from a copy */
+	this->helperPids.clear();
+	for (pid_t pid : pids) {
+		if (this->subreaper) {
+			try {
+				this->events->watchProcess(pid, NULL);
+				log_debug("watching pid %d, which was started by the spawn helper", pid);
+				continue;
+			} catch (const std::system_error& e) {
+				/* It may have exited already */
+				pid_t rv = waitpid(pid, &status, WNOHANG);
+				if (rv == pid) {
+					this->reapChildProcess(pid, status);
+					continue;
+				} else if (rv == 0) {
+					this->unwatchedPids.insert(pid);
+					continue;
+				}
+			}
+		}
+		log_error("lost track of pid %d, which was started by the spawn helper", pid);
+		this->handleJobExit(pid, -1, -1);
+	}
+
+	/* Anything that exited while the helper was the oldest zombie */
+	if (this->subreaper) {
+		this->reapOrphans();
+	}
+}
+
+void JobManager::deleteJob(Job& job)
 {
-	string manifest_path = jobd_config.getManifestDir() + '/' + job->getLabel() + ".json";
+	string manifest_path = jobd_config.getManifestDir() + '/' + job.getLabel() + ".json";
 
-	if (unlink(manifest_path.c_str()) < 0) {
+	/* A job that is retired because of its manifest keeps the manifest */
+	if (this->retiringJobs.erase(job.getLabel()) == 0 && unlink(manifest_path.c_str()) < 0) {
 		log_error("unlink(2) of %s", manifest_path.c_str());
 	}
 
-	job->releaseAllResources();
+	job.releaseAllResources();
+
+	pid_t pid = job.getPid();
+	if (pid > 0) {
+		this->unindexPid(pid);
+	}
+	this->cancelKeepalive(&job);
+	this->forgetPendingCommit(job);
+	this->releaseStatusSlot(job);
 
-	jobs.erase(job->getLabel());
+	jobs.erase(job.getLabel());
 	//XXX-will probably leak memory here, need to ::delete job
 }
 
-void JobManager::rescheduleJob(unique_ptr<Job>& job) {
-	if (!job->isLoaded()) {
+void JobManager::rescheduleJob(Job& job) {
+	if (!job.isLoaded()) {
 		log_debug("deleting job");
 		deleteJob(job);
 		return;
 	}
 
-	if (job->state == JOB_STATE_KILLED && !job->isEnabled()) {
-		log_debug("job `%s' is disabled and will not be rescheduled", job->getLabel().c_str());
-		job->state = JOB_STATE_LOADED;
+	if (job.state == JOB_STATE_KILLED && !job.isEnabled()) {
+		log_debug("job `%s' is disabled and will not be rescheduled", job.getLabel().c_str());
+		job.state = JOB_STATE_LOADED;
 		return;
 	}
 
-	if (job->manifest.json["StartInterval"].get<unsigned long>() > 0) {
-		job->state = JOB_STATE_WAITING;
+	if (job.manifest.fields.start_interval > 0) {
+		job.state = JOB_STATE_WAITING;
 	} else {
-		job->state = JOB_STATE_EXITED;
+		job.state = JOB_STATE_EXITED;
 	}
 
-	if (job->manifest.json["KeepAlive"].get<bool>()) {
-		unsigned int interval = job->manifest.json["ThrottleInterval"].get<unsigned int>();
+	if (job.manifest.fields.keep_alive) {
+		unsigned int interval = job.manifest.fields.throttle_interval;
 
 		log_debug("will restart job %s after %u seconds",
-				job->getLabel().c_str(), interval);
+				job.getLabel().c_str(), interval);
 
-		job->restart_after = current_time() +
-			job->manifest.json["ThrottleInterval"].get<unsigned int>();
+		this->keepaliveQueue.schedule(job.keepalive, current_time() + interval);
+		this->updateKeepaliveWakeInterval();
 	} else {
 		log_debug("marking job as faulted");
 		// Assume that non-KeepAlive jobs are supposed to run forever
 		// FIXME: For on-demand jobs, this should not be a fault.
-		job->jobProperty.setFaulted(libjob::JobProperty::JOB_FAULT_STATE_OFFLINE,
+		job.jobProperty.setFaulted(libjob::JobProperty::JOB_FAULT_STATE_OFFLINE,
 				"The process exited unexpectedly");
+		job.queueCommit();
+		ipc_publish_event("faulted", job.getLabel(), 0, 0, 0, "The process exited unexpectedly");
 	}
 
 	return;
@@ -463,7 +934,14 @@ void JobManager::setupDataDirectory()
 	libjob::JobStatus::setRuntimeDirectory(jobStatusRuntimeDir);
 
 	std::string jobPropertyDataDir = jobd_config.getDataDir() + std::string("/property");
+	libjob::JobProperty::setSyncPolicy(this->syncPolicy);
 	libjob::JobProperty::setDataDirectory(jobPropertyDataDir);
+
+	try {
+		this->statusTable.create(jobd_config.getStatusTablePath());
+	} catch (const std::system_error& e) {
+		log_error("unable to create the status table: %s", e.what());
+	}
 #if 0
 	char buf[PATH_MAX];
 
@@ -478,77 +956,96 @@ void JobManager::setupDataDirectory()
 
 void JobManager::setupSignalHandlers()
 {
-	struct kevent kev;
-
 	for (int i = 0; launchd_signals[i] != 0; i++) {
 		if (signal(launchd_signals[i], SIG_IGN) == SIG_ERR)
 			err(1, "signal(2): %d", launchd_signals[i]);
-		EV_SET(&kev, launchd_signals[i], EVFILT_SIGNAL, EV_ADD, 0, 0,
-				(void *)&launchd_signals);
-		if (kevent(this->kqfd, &kev, 1, NULL, 0, NULL) < 0)
-			err(1, "kevent(2)");
+		this->events->watchSignal(launchd_signals[i], (void *)&launchd_signals);
 	}
 }
 
 void JobManager::handleKeepaliveWakeup()
 {
 	time_t now = current_time();
+	KeepaliveQueue::Entry* entry;
 
 	log_debug("watchdog handler running");
 
-	/* Determine the soonest absolute time we should wake up */
-	for (auto& it : this->jobs)
+	/* The timer is one-shot, so it is no longer armed */
+	this->next_keepalive_wakeup = 0;
+
+	/* Only the jobs that are actually due need to be visited */
+	while ((entry = this->keepaliveQueue.popDue(now)) != nullptr)
 	{
-		const string& label = it.first;
-		unique_ptr<Job>& job = it.second;
+		Job* job = entry->job;
 
-		if (job->state == JOB_STATE_EXITED && job->restart_after <= now)
+		if (job->state == JOB_STATE_EXITED)
 		{
-			log_debug("job `%s' restarted via KeepAlive", label.c_str());
+			log_debug("job `%s' restarted via KeepAlive", job->getLabel().c_str());
 			job->run();
 		}
 	}
 	this->updateKeepaliveWakeInterval();
 }
 
-void JobManager::updateKeepaliveWakeInterval()
+void JobManager::handleSpawnHelperExits()
 {
-	struct kevent kev;
-	time_t new_wakeup_time = std::numeric_limits<time_t>::max();
-
-	/* Determine the soonest absolute time we should wake up */
-	for (auto& it : this->jobs)
-	{
-		unique_ptr<Job>& job = it.second;
+	pid_t pid;
+	int status;
 
-		if (job->state == JOB_STATE_EXITED && job->restart_after > 0)
-		{
-			if (job->restart_after < new_wakeup_time) {
-				new_wakeup_time = job->restart_after;
-			}
+	try {
+		while (this->spawnHelper.readExit(pid, status)) {
+			this->reapChildProcess(pid, status);
 		}
+	} catch (const std::runtime_error& e) {
+		this->abandonSpawnHelper(e.what());
+	}
+}
+
+void JobManager::abandonSpawnHelper(const char *reason)
+{
+	pid_t pid;
+	int status;
+
+	if (!this->spawnHelper.isRunning()) {
+		return;
+	}
+	log_error("spawn helper failed: %s; jobd will fork jobs itself", reason);
 
+	/* Exits that the helper reported before it went away */
+	try {
+		while (this->spawnHelper.readExit(pid, status)) {
+			this->reapChildProcess(pid, status);
+		}
+	} catch (const std::runtime_error& e) {
+		/* This is how the end of the channel is reported */
 	}
 
+	this->events->unwatchRead(this->spawnHelper.getExitDescriptor());
+	this->spawnHelper.stop();
+	this->adoptHelperProcesses();
+}
+
+void JobManager::updateKeepaliveWakeInterval()
+{
 	/* Stop waking up if there are no more jobs to be restarted. */
-	if (new_wakeup_time == std::numeric_limits<time_t>::max() &&
-			this->next_keepalive_wakeup > 0) {
-		EV_SET(&kev, JOB_SCHEDULE_KEEPALIVE, EVFILT_TIMER, EV_ADD | EV_DISABLE, 0, 0, (void *)&keepalive_wake_handler);
-		if (kevent(this->kqfd, &kev, 1, NULL, 0, NULL) < 0) {
-			err(1, "kevent(2)");
-		}
-		log_debug("disabling keepalive wakeups");
-	} else if (new_wakeup_time != this->next_keepalive_wakeup) {
+	if (this->keepaliveQueue.empty()) {
+		if (this->next_keepalive_wakeup > 0) {
+			this->events->cancelTimer(JOB_SCHEDULE_KEEPALIVE);
+			this->next_keepalive_wakeup = 0;
+			log_debug("disabling keepalive wakeups");
+		}
+		return;
+	}
+
+	time_t new_wakeup_time = this->keepaliveQueue.nextWakeup();
+	if (new_wakeup_time != this->next_keepalive_wakeup) {
+		/* A job that is already due is restarted as soon as possible */
 		int time_delta = (new_wakeup_time - current_time()) * 1000;
 		if (time_delta <= 0) {
-			log_warning("the system clock appears to have gone backwards");
-			time_delta = DEFAULT_THROTTLE_INTERVAL * 1000;
-		}
-		EV_SET(&kev, JOB_SCHEDULE_KEEPALIVE, EVFILT_TIMER,
-			EV_ADD | EV_ENABLE, 0, time_delta, (void *)&keepalive_wake_handler);
-		if (kevent(this->kqfd, &kev, 1, NULL, 0, NULL) < 0) {
-			err(1, "kevent(2)");
+			time_delta = 1;
 		}
+		this->events->setTimer(JOB_SCHEDULE_KEEPALIVE, time_delta, (void *)&keepalive_wake_handler);
+		this->next_keepalive_wakeup = new_wakeup_time;
 
 		log_debug("scheduled next wakeup event in %d ms at t=%ld",
 				time_delta, (long)this->next_keepalive_wakeup);
@@ -568,80 +1065,168 @@ void JobManager::listAllJobs(nlohmann::json& result)
 			{ "State", job->getStateString() },
 			{ "Enabled", job->isEnabled() },
 			{ "FaultState", job->getFaultStateString(), },
+			{ "ManifestHash", libjob::content_hash_string(job->manifest.getContentHash()) },
 		};
 	}
 }
 
-void JobManager::mainLoop()
+void JobManager::getManifestHashes(const std::vector<std::string>& labels, nlohmann::json& result)
 {
-	int rv;
-	struct kevent kev;
+	result = nlohmann::json::object();
 
-	for (;;) {
-		rv = kevent(this->kqfd, NULL, 0, &kev, 1, NULL);
-		if (rv == 0) {
-			log_debug("spurious wakeup; no events pending");
-			continue;
+	if (labels.empty()) {
+		for (auto& it : this->jobs) {
+			result[it.first] = libjob::content_hash_string(it.second->manifest.getContentHash());
 		}
-		if (rv < 0) {
-			if (errno == EINTR) {
-				log_warning("spurious wakeup; got signal"); // should not happen..
-				continue;
+	} else {
+		for (const std::string& label : labels) {
+			auto it = this->jobs.find(label);
+			if (it == this->jobs.end()) {
+				result[label] = nullptr;
 			} else {
-				err(1, "kevent(2)");
+				result[label] = libjob::content_hash_string(it->second->manifest.getContentHash());
 			}
 		}
-		/* TODO: refactor this to eliminate the use of switch() and just jump directly to the handler function */
-		if ((void *)kev.udata == &launchd_signals) {
-			switch (kev.ident) {
-			case SIGHUP:
-				this->scanJobDirectory();
-				break;
-			case SIGUSR1:
-				//DEADWOOD: manager_write_status_file();
-				break;
-			case SIGCHLD:
-				/* NOTE: undocumented use of kev.data to obtain
-				 * the status of the child. This should be reported to
-				 * FreeBSD as a bug in the manpage.
-				 */
-				this->reapChildProcess(kev.ident, kev.data);
-				break;
-			case SIGINT:
-				log_notice("caught SIGINT, exiting");
-				this->unloadAllJobs();
-				exit(1);
-				break;
-			case SIGTERM:
-				log_notice("caught SIGTERM, exiting");
-				exit(0);
-				break;
-			default:
-				log_error("caught unexpected signal");
+	}
+}
+
+JobManager::event_lane_t JobManager::getEventLane(const Event& ev) const
+{
+	switch (ev.type) {
+	case EVENT_SIGNAL:
+	case EVENT_PROCESS_EXIT:
+		return EVENT_LANE_PROCESS;
+	case EVENT_TIMER:
+		return EVENT_LANE_TIMER;
+	case EVENT_WRITE:
+		return EVENT_LANE_IPC;
+	case EVENT_READ:
+		if (ev.udata == (void *)&ipc_request_handler || ev.udata == (void *)&ipc_session_handler) {
+			return EVENT_LANE_IPC;
+		} else if (ev.udata == (const void *)&this->spawnHelper) {
+			return EVENT_LANE_PROCESS;
+		}
+		return EVENT_LANE_SOCKET;
+	case EVENT_DIRECTORY:
+		return EVENT_LANE_SOCKET;
+	}
+	return EVENT_LANE_SOCKET;
+}
+
+void JobManager::dispatchEvent(const Event& ev)
+{
+	switch (ev.type) {
+	case EVENT_SIGNAL:
+		switch (ev.ident) {
+		case SIGHUP:
+			this->reloadJobDirectory(true);
+			break;
+		case SIGUSR1:
+			//DEADWOOD: manager_write_status_file();
+			break;
+		case SIGINT:
+			log_notice("caught SIGINT, exiting");
+			this->unloadAllJobs();
+			exit(1);
+			break;
+		case SIGTERM:
+			log_notice("caught SIGTERM, exiting");
+			exit(0);
+			break;
+		case SIGCHLD:
+			this->reapUnwatchedProcesses();
+			if (this->subreaper) {
+				this->reapOrphans();
 			}
-		} else if (kev.filter == EVFILT_PROC) {
-			this->reapChildProcess(kev.ident, kev.data);
-		} else if (kev.filter == EVFILT_VNODE) {
-			this->scanJobDirectory();
-		} else if ((void *)kev.udata == &setup_socket_activation) {
-			if (socket_activation_handler() < 0)
-				errx(1, "socket_activation_handler()");
-		} else if ((void *)kev.udata == &setup_timers) {
+			break;
+		default:
+			log_error("caught unexpected signal");
+		}
+		break;
+
+	case EVENT_PROCESS_EXIT:
+		this->reapChildProcess(ev.ident, ev.status);
+		if (this->subreaper) {
+			this->reapOrphans();
+		}
+		break;
+
+	case EVENT_DIRECTORY:
+		this->reloadJobDirectory(false);
+		break;
+
+	case EVENT_TIMER:
+		if (ev.udata == (void *)&setup_timers) {
 			if (timer_handler() < 0)
 				errx(1, "timer_handler()");
 #if 0
 			//FIXME
-		} else if ((void *)kev.udata == &calendar_init) {
+		} else if (ev.udata == (void *)&calendar_init) {
 			if (calendar_handler() < 0)
 				errx(1, "calendar_handler()");
 #endif
-		} else if ((void *)kev.udata == &keepalive_wake_handler) {
+		} else if (ev.udata == (void *)&keepalive_wake_handler) {
 			this->handleKeepaliveWakeup();
-		} else if ((void *)kev.udata == &ipc_request_handler) {
+		} else {
+			log_warning("spurious wakeup, no known timer handler");
+		}
+		break;
+
+	case EVENT_READ:
+		if (ev.udata == (void *)&setup_socket_activation) {
+			if (socket_activation_handler(ev.ident) < 0)
+				errx(1, "socket_activation_handler()");
+		} else if (ev.udata == (void *)&ipc_request_handler) {
 			ipc_request_handler();
+		} else if (ev.udata == (void *)&ipc_session_handler) {
+			ipc_session_handler(ev.ident, false);
+		} else if (ev.udata == (void *)&this->spawnHelper) {
+			this->handleSpawnHelperExits();
+		} else {
+			log_warning("spurious wakeup, no known handlers");
+		}
+		break;
+
+	case EVENT_WRITE:
+		if (ev.udata == (void *)&ipc_session_handler) {
+			ipc_session_handler(ev.ident, true);
 		} else {
 			log_warning("spurious wakeup, no known handlers");
 		}
+		break;
+	}
+}
+
+void JobManager::mainLoop()
+{
+	this->eventBuffer.reserve(this->eventBatchSize);
+	for (auto& lane : this->eventLanes) {
+		lane.reserve(this->eventBatchSize);
+	}
+
+	for (;;) {
+		this->runPendingRedefinitions();
+		this->commitPendingJobs();
+
+		this->eventBuffer.clear();
+		if (this->events->wait(this->eventBuffer, this->eventBatchSize) == 0) {
+			log_debug("spurious wakeup; no events pending");
+			continue;
+		}
+
+		/*
+		 * Sort the batch into lanes, so that children are reaped and
+		 * restarted before we spend time on timers, sockets, or IPC.
+		 */
+		for (const Event& ev : this->eventBuffer) {
+			this->eventLanes[this->getEventLane(ev)].push_back(&ev);
+		}
+		for (auto& lane : this->eventLanes) {
+			for (const Event* ev : lane) {
+				this->dispatchEvent(*ev);
+			}
+			lane.clear();
+		}
 	}
 }
 
@@ -654,6 +1239,9 @@ static void setup_logging()
 
 void JobManager::forkHandler()
 {
+	/* Only the parent should write out the state of jobs */
+	this->pendingCommits.clear();
+	this->events->forkHandler();
 	ipc_fork_handler();
 #ifndef UNIT_TEST
 	closelog();
@@ -662,6 +1250,10 @@ void JobManager::forkHandler()
 
 JobManager::~JobManager()
 {
+	this->commitPendingJobs();
+	libjob::JobStatus::closeJournal();
+	libjob::JobProperty::closeJournal();
+	this->statusTable.destroy();
 	if (this->pidfile_handle)
 		pidfile_remove(pidfile_handle);
 	ipc_shutdown();
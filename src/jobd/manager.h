@@ -18,11 +18,24 @@
 #define MANAGER_H_
 
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+extern "C" {
+#include <sys/types.h>
+}
+
+#include "event.h"
 #include "job.h"
+#include "keepalive.h"
 #include "pidfile.h"
+#include "spawn.h"
 
 #include "../libjob/job.h"
+#include "../libjob/journal.hpp"
+#include "../libjob/manifestLoader.hpp"
+#include "../libjob/statusTable.hpp"
 
 class JobManager {
 public:
@@ -35,6 +48,12 @@ public:
 	void defineJob(const string& path);
 	void unloadAllJobs();
 	void listAllJobs(nlohmann::json& result);
+
+	/**
+	 * Map each of @labels to the content hash of its normalized manifest, or
+	 * null if there is no such job. An empty list means every job.
+	 */
+	void getManifestHashes(const std::vector<std::string>& labels, nlohmann::json& result);
 	void runPendingJobs();
 
 	/** Cleanup things in the child process after fork(2) is called */
@@ -47,6 +66,36 @@ public:
 
 	void createProcessEventWatch(pid_t pid);
 
+	/**
+	 * Remember that the process with the given pid was started by the spawn
+	 * helper, so it can be watched directly if the helper goes away.
+	 */
+	void trackHelperProcess(pid_t pid);
+
+	/**
+	 * Stop using a spawn helper that has failed, and watch the jobs that it
+	 * started directly. Jobs are forked by jobd from then on.
+	 */
+	void abandonSpawnHelper(const char *reason);
+
+	/** Remember that the process with the given pid belongs to the given job */
+	void indexPid(pid_t pid, Job* job);
+
+	/** Start a job that is waiting for its StartInterval to elapse */
+	void wakeJob(const string& label);
+
+	/** Forget about any pending KeepAlive restart of the given job */
+	void cancelKeepalive(Job* job);
+
+	/** Commit the status and properties of the job before the next wait for events */
+	void queueCommit(Job* job);
+
+	/** The process that starts jobs on our behalf, or nullptr if it is not running */
+	SpawnHelper* getSpawnHelper()
+	{
+		return spawnHelper.isRunning() ? &spawnHelper : nullptr;
+	}
+
 	bool isNoFork() const
 	{
 		return noFork;
@@ -57,37 +106,205 @@ public:
 		this->noFork = noFork;
 	}
 
+	/** How many threads parse manifests at startup; 0 means one per CPU */
+	void setParseThreads(unsigned int parseThreads)
+	{
+		this->parseThreads = parseThreads;
+	}
+
+	/** How often the properties of jobs are synced to disk; see Journal */
+	void setSyncPolicy(libjob::journal_sync_t policy)
+	{
+		this->syncPolicy = policy;
+	}
+
+	size_t getEventBatchSize() const
+	{
+		return eventBatchSize;
+	}
+
+	void setEventBatchSize(size_t eventBatchSize)
+	{
+		this->eventBatchSize = eventBatchSize > 0 ? eventBatchSize : 1;
+	}
+
 private:
-	/** kqueue(2) descriptor for the main event loop */
-	int kqfd;
+	/** The source of events for the main loop */
+	std::unique_ptr<EventBackend> events;
+
+	/**
+	 * Events harvested by a single wakeup are dispatched in
+	 * priority order, one lane at a time. Lower lanes run first.
+	 */
+	typedef enum {
+		/** Signals and child process exits */
+		EVENT_LANE_PROCESS = 0,
+		/** KeepAlive and StartInterval timers */
+		EVENT_LANE_TIMER,
+		/** Socket activation and manifest directory changes */
+		EVENT_LANE_SOCKET,
+		/** Requests from jobctl(1) and friends */
+		EVENT_LANE_IPC,
+		EVENT_LANE_COUNT
+	} event_lane_t;
+
+	libjob::journal_sync_t syncPolicy = libjob::JOURNAL_SYNC_BATCH;
+
+	unsigned int parseThreads = 0;
+
+	/** The maximum number of events to harvest per wakeup */
+	size_t eventBatchSize = 64;
+
+	/** Scratch space for the main loop, to avoid allocating on each wakeup */
+	std::vector<Event> eventBuffer;
+	std::vector<const Event *> eventLanes[EVENT_LANE_COUNT];
 
 	struct pidfh *pidfile_handle;
 
 	map<string,unique_ptr<Job>> jobs;
 
-	/** The walltime when we should wake up and scan for KeepAlive=true jobs to restart */
+	/** Maps the pid of each running child process to its job */
+	std::unordered_map<pid_t, Job*> pidIndex;
+
+	/** Jobs waiting to be restarted via KeepAlive, soonest first */
+	KeepaliveQueue keepaliveQueue;
+
+	/** The walltime when the keepalive timer will fire next, or 0 if it is disabled */
 	time_t next_keepalive_wakeup = 0;
 
+	/**
+	 * Jobs whose status or properties have changed since the last time
+	 * they were written out. These are committed once per iteration of
+	 * the main loop, so that a burst of changes costs one write per file.
+	 */
+	std::vector<Job*> pendingCommits;
+
+	/** The status of every job, published for jobadm(1) and other readers */
+	libjob::StatusTable statusTable;
+
+	/** Compiled copies of the manifests, so they are not parsed again at every startup */
+	libjob::ManifestCache manifestCache;
+
+	/** What a manifest file looked like when it was last read */
+	struct ManifestFile {
+		dev_t dev;
+		ino_t ino;
+		off_t size;
+		time_t mtime_sec;
+		long mtime_nsec;
+
+		/** The content_hash() of the file, or 0 if it could not be read */
+		uint64_t hash;
+
+		/** The label of the job it defines, or empty if it does not define one */
+		std::string label;
+	};
+
+	/**
+	 * Every manifest that has been read, by path. A reload only reads the
+	 * files whose identity no longer matches what is recorded here.
+	 */
+	std::unordered_map<std::string, ManifestFile> manifestFiles;
+
+	/**
+	 * Jobs that are being removed because their manifest changed or went
+	 * away. Their manifest is left in place when they are deleted.
+	 */
+	std::unordered_set<std::string> retiringJobs;
+
+	/**
+	 * The new manifest of each job that is waiting for its old version to
+	 * exit before it can be defined again, by label.
+	 */
+	std::unordered_map<std::string, std::string> pendingRedefinitions;
+
+	/** Starts jobs without copying the address space of jobd */
+	SpawnHelper spawnHelper;
+
+	/** The pids of the running jobs that were started by the spawn helper */
+	std::unordered_set<pid_t> helperPids;
+
+	/**
+	 * If true, jobd is the subreaper of its descendants, so the jobs of a
+	 * spawn helper that dies are reparented to jobd instead of init.
+	 */
+	bool subreaper = false;
+
+	/**
+	 * The pids of jobs whose exit could not be watched by the event
+	 * backend. They are polled with waitpid(2) when SIGCHLD arrives.
+	 */
+	std::unordered_set<pid_t> unwatchedPids;
+
 	/** If true, fork() will not be called prior to launching a job.
 	 * This is useful for debugging, but should never be done in production.
 	 */
 	bool noFork = false;
 
 	void scanJobDirectory();
+
+	/**
+	 * Add a job whose manifest has been read. @cached is true if the
+	 * manifest came from the manifest cache. If a job with the same label
+	 * is being retired, the new one is defined when the old one is gone.
+	 */
+	void insertJob(unique_ptr<Job> job, bool cached);
+
+	/** Define the job in a manifest from load_manifests(), or log why it cannot be */
+	void defineLoadedManifest(libjob::ManifestLoadResult& result);
+
+	/**
+	 * Define, redefine or remove the jobs whose manifests changed. Only the
+	 * files that the event backend reports as changed are checked, unless
+	 * @rescan_all is true or the backend does not know which ones changed.
+	 */
+	void reloadJobDirectory(bool rescan_all);
+
+	/**
+	 * Unload a job whose manifest changed or was removed. If it is still
+	 * running, it is deleted when it exits, and if @replacement is not
+	 * empty, the manifest at that path is defined then. Returns true if the
+	 * job was deleted right away.
+	 */
+	bool retireJob(Job& job, const std::string& replacement);
+
+	/** Define the replacements of retired jobs that have finished exiting */
+	void runPendingRedefinitions();
+
+	/** Record the identity of the manifest at @path */
+	void trackManifestFile(const std::string& path, uint64_t hash, const std::string& label);
 	void reapChildProcess(pid_t pid, int status);
-	void deleteProcessEventWatch(pid_t pid);
-	unique_ptr<Job>& getJobByPid(pid_t pid);
+
+	/** Record that the process of a job has exited, and decide what happens next */
+	void handleJobExit(pid_t pid, int last_exit_status, int term_signal);
+
+	/** Reap the jobs in unwatchedPids that have exited */
+	void reapUnwatchedProcesses();
+
+	/** Reap any children that are not the process of a job */
+	void reapOrphans();
+
+	/** Watch the jobs of a spawn helper that has gone away */
+	void adoptHelperProcesses();
+	Job& getJobByPid(pid_t pid);
+	void unindexPid(pid_t pid);
 	unique_ptr<Job>& getJobByLabel(const string& label);
 	void removeJob(Job& job);
-	void rescheduleJob(unique_ptr<Job>& job);
-	void deleteJob(unique_ptr<Job>& job);
+	void rescheduleJob(Job& job);
+	void deleteJob(Job& job);
 	void updateKeepaliveWakeInterval();
 	void handleKeepaliveWakeup();
-	void wakeJob(const string& label);
+	void handleSpawnHelperExits();
+	void commitPendingJobs();
+	void forgetPendingCommit(Job& job);
+	void publishStatus(Job& job);
+	void releaseStatusSlot(Job& job);
 	void unloadJob(unique_ptr<Job>& job);
 	void setupSignalHandlers();
 	void setupDataDirectory();
 	void monitorJobDirectory();
+	event_lane_t getEventLane(const Event& ev) const;
+	void dispatchEvent(const Event& ev);
 };
 
 #endif /* MANAGER_H_ */
@@ -19,18 +19,20 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/event.h>
+
+#include <map>
 
 #include <libjob/logger.h>
+#include "event.h"
 #include "job.h"
 #include "manager.h"
 #include "socket.h"
 
-/* The main kqueue descriptor used by launchd */
-static int parent_kqfd;
+/* The event backend used by the main loop */
+static EventBackend *parent_events;
 
-/* The kqueue descriptor dedicated to socket activation */
-static int socket_kqfd;
+/* The job that owns each socket that is being watched */
+static std::map<int, job_t> socket_owners;
 
 struct job_manifest_socket *
 job_manifest_socket_new()
@@ -63,7 +65,6 @@ void job_manifest_socket_free(struct job_manifest_socket *jms)
 
 int job_manifest_socket_open(job_t job, struct job_manifest_socket *jms)
 {
-	struct kevent kev;
 	struct sockaddr_in sa;
 	int enable = 1;
 	int sd = -1;
@@ -115,11 +116,12 @@ int job_manifest_socket_open(job_t job, struct job_manifest_socket *jms)
 		goto err_out;
 	}
 
-	EV_SET(&kev, sd, EVFILT_READ, EV_ADD, 0, 0, job);
-	if (kevent(socket_kqfd, &kev, 1, NULL, 0, NULL) < 0) {
-		log_errno("kevent(2)");
+	try {
+		parent_events->watchRead(sd, (void *)&setup_socket_activation);
+	} catch (const std::system_error& e) {
 		goto err_out;
 	}
+	socket_owners[sd] = job;
 
 	jms->sd = sd;
 
@@ -134,6 +136,8 @@ int job_manifest_socket_close(struct job_manifest_socket *jms)
 {
 	int rv;
 
+	parent_events->unwatchRead(jms->sd);
+	socket_owners.erase(jms->sd);
 	rv = close(jms->sd);
 	jms->sd = 0;
 	if (rv < 0) {
@@ -189,38 +193,22 @@ int job_manifest_socket_export(struct job_manifest_socket *jms, cvec_t env, size
 }
 #endif
 
-void setup_socket_activation(int kqfd)
+void setup_socket_activation(EventBackend& events)
 {
-	struct kevent kev;
-
-	parent_kqfd = kqfd;
-	socket_kqfd = kqueue();
-	if (socket_kqfd < 0)
-		err(1, "kqueue(2)");
-
-	EV_SET(&kev, socket_kqfd, EVFILT_READ, EV_ADD, 0, 0, (void *)&setup_socket_activation);
-	if (kevent(parent_kqfd, &kev, 1, NULL, 0, NULL) < 0)
-		err(1, "kevent(2)");
+	parent_events = &events;
 }
 
-int socket_activation_handler()
+int socket_activation_handler(int sd)
 {
 	job_t job;
-	struct kevent kev;
-
-	for (;;) {
-		if (kevent(socket_kqfd, NULL, 0, &kev, 1, NULL) < 1) {
-			if (errno == EINTR) {
-				continue;
-			} else {
-				log_errno("kevent");
-				return -1;
-			}
-		}
-		break;
+
+	auto it = socket_owners.find(sd);
+	if (it == socket_owners.end()) {
+		log_error("no job is listening on descriptor %d", sd);
+		return -1;
 	}
 
-	job = (job_t) (kev.udata);
+	job = it->second;
 	log_debug("job %s starting due to socket activation", job->jm->label);
 
 	//FIXME: need to refactor to fit with C++
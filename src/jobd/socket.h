@@ -44,8 +44,12 @@ struct job_manifest_socket {
 	char *	multicast_group;	/* optional */
 };
 
-void setup_socket_activation(int);
-int socket_activation_handler();
+class EventBackend;
+
+void setup_socket_activation(EventBackend&);
+
+/** Handle a connection to the socket with the given descriptor */
+int socket_activation_handler(int sd);
 
 struct job_manifest_socket * job_manifest_socket_new();
 void job_manifest_socket_free(struct job_manifest_socket *);
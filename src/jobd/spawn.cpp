@@ -0,0 +1,815 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include <libjob/logger.h>
+#include "spawn.h"
+
+/* The fixed-size part of an encoded LaunchDescriptor */
+struct launch_header {
+	uint32_t flags;
+	int32_t nice;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t descriptor_count;
+};
+
+#define LAUNCH_SET_CREDENTIALS	0x1
+#define LAUNCH_NEW_SESSION	0x2
+
+/* The reply to a launch request */
+struct spawn_reply {
+	int32_t pid;
+	int32_t error;
+};
+
+/* Sent by the helper each time it reaps a job */
+struct spawn_exit {
+	int32_t pid;
+	int32_t status;
+};
+
+static void append_string(std::vector<char>& buf, const std::string& s)
+{
+	buf.insert(buf.end(), s.c_str(), s.c_str() + s.size() + 1);
+}
+
+void LaunchDescriptor::serialize(std::vector<char>& buf) const
+{
+	struct launch_header hdr;
+
+	hdr.flags = (set_credentials ? LAUNCH_SET_CREDENTIALS : 0) |
+			(new_session ? LAUNCH_NEW_SESSION : 0);
+	hdr.nice = nice;
+	hdr.uid = uid;
+	hdr.gid = gid;
+	hdr.argc = argv.size();
+	hdr.envc = envp.size();
+	hdr.descriptor_count = descriptor_targets.size();
+
+	buf.clear();
+	buf.insert(buf.end(), (const char *) &hdr, (const char *) &hdr + sizeof(hdr));
+	for (int target : descriptor_targets) {
+		int32_t val = target;
+		buf.insert(buf.end(), (const char *) &val, (const char *) &val + sizeof(val));
+	}
+	append_string(buf, user_name);
+	append_string(buf, working_directory);
+	append_string(buf, root_directory);
+	append_string(buf, stdin_path);
+	append_string(buf, stdout_path);
+	append_string(buf, stderr_path);
+	for (const std::string& arg : argv) {
+		append_string(buf, arg);
+	}
+	for (const std::string& env : envp) {
+		append_string(buf, env);
+	}
+}
+
+static std::string parse_string(const char *& p, const char *end)
+{
+	const char *nul = (const char *) memchr(p, '\0', end - p);
+	if (nul == NULL) {
+		throw std::invalid_argument("unterminated string in launch descriptor");
+	}
+	std::string result(p, nul - p);
+	p = nul + 1;
+	return result;
+}
+
+void LaunchDescriptor::parse(const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len;
+	struct launch_header hdr;
+
+	if (len < sizeof(hdr)) {
+		throw std::invalid_argument("truncated launch descriptor");
+	}
+	memcpy(&hdr, p, sizeof(hdr));
+	p += sizeof(hdr);
+
+	if (hdr.descriptor_count > SPAWN_MAX_DESCRIPTORS ||
+			(size_t)(end - p) < hdr.descriptor_count * sizeof(int32_t)) {
+		throw std::invalid_argument("bad descriptor count in launch descriptor");
+	}
+	descriptor_targets.clear();
+	for (uint32_t i = 0; i < hdr.descriptor_count; i++) {
+		int32_t val;
+		memcpy(&val, p, sizeof(val));
+		p += sizeof(val);
+		descriptor_targets.push_back(val);
+	}
+
+	set_credentials = (hdr.flags & LAUNCH_SET_CREDENTIALS) != 0;
+	new_session = (hdr.flags & LAUNCH_NEW_SESSION) != 0;
+	nice = hdr.nice;
+	uid = hdr.uid;
+	gid = hdr.gid;
+	user_name = parse_string(p, end);
+	working_directory = parse_string(p, end);
+	root_directory = parse_string(p, end);
+	stdin_path = parse_string(p, end);
+	stdout_path = parse_string(p, end);
+	stderr_path = parse_string(p, end);
+
+	/* Each string takes at least one byte, which bounds the counts */
+	if (hdr.argc == 0 || hdr.argc > len || hdr.envc > len) {
+		throw std::invalid_argument("bad argument count in launch descriptor");
+	}
+	argv.clear();
+	for (uint32_t i = 0; i < hdr.argc; i++) {
+		argv.push_back(parse_string(p, end));
+	}
+	envp.clear();
+	for (uint32_t i = 0; i < hdr.envc; i++) {
+		envp.push_back(parse_string(p, end));
+	}
+}
+
+static void redirect_fd(const std::string& path, int flags, int target)
+{
+	int fd = open(path.c_str(), flags, 0600);
+	if (fd < 0) {
+		log_errno("open(2) of %s", path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	if (fd != target) {
+		if (dup2(fd, target) < 0) {
+			log_errno("dup2(2) of %s", path.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		(void) close(fd);
+	}
+}
+
+/* Move each passed descriptor to its target number in the job */
+static void install_descriptors(const std::vector<int>& targets, const int *fds)
+{
+	int floor = 0;
+	std::vector<int> tmp(targets.size());
+
+	for (int target : targets) {
+		floor = std::max(floor, target + 1);
+	}
+
+	/* First move everything out of the way, so the targets can't collide */
+	for (size_t i = 0; i < targets.size(); i++) {
+		if ((tmp[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, floor)) < 0) {
+			log_errno("fcntl(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+	for (size_t i = 0; i < targets.size(); i++) {
+		if (dup2(tmp[i], targets[i]) < 0) {
+			log_errno("dup2(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+}
+
+void launch_descriptor_apply(const LaunchDescriptor& launch, const int *fds)
+{
+	struct sigaction sa;
+	sigset_t mask;
+
+	if (launch.new_session && setsid() < 0) {
+		log_errno("setsid");
+		throw std::system_error(errno, std::system_category());
+	}
+
+	/* Start the job with a clean slate, whatever the helper was doing */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigemptyset(&sa.sa_mask);
+	for (int i = 1; i < NSIG; i++) {
+		(void) sigaction(i, &sa, NULL);
+	}
+	sigemptyset(&mask);
+	if (sigprocmask(SIG_SETMASK, &mask, NULL) < 0) {
+		log_errno("sigprocmask(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+
+	if (launch.nice != 0 && setpriority(PRIO_PROCESS, 0, launch.nice) < 0) {
+		log_errno("setpriority(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+
+	if (chdir(launch.working_directory.c_str()) < 0) {
+		log_errno("chdir(2) to %s", launch.working_directory.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+
+	if (!launch.root_directory.empty() && chroot(launch.root_directory.c_str()) < 0) {
+		log_errno("unable to chroot to %s", launch.root_directory.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+
+	if (launch.set_credentials) {
+		if (initgroups(launch.user_name.c_str(), launch.gid) < 0) {
+			log_errno("initgroups(3)");
+			throw std::system_error(errno, std::system_category());
+		}
+		if (setgid(launch.gid) < 0) {
+			log_errno("setgid(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+#ifndef __GLIBC__
+		if (setlogin(launch.user_name.c_str()) < 0) {
+			log_errno("setlogin(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+#endif
+		if (setuid(launch.uid) < 0) {
+			log_errno("setuid");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	redirect_fd(launch.stdin_path, O_RDONLY, STDIN_FILENO);
+	redirect_fd(launch.stdout_path, O_CREAT | O_WRONLY, STDOUT_FILENO);
+	redirect_fd(launch.stderr_path, O_CREAT | O_WRONLY, STDERR_FILENO);
+
+	install_descriptors(launch.descriptor_targets, fds);
+}
+
+void launch_descriptor_exec(const LaunchDescriptor& launch, const int *fds)
+{
+	try {
+		launch_descriptor_apply(launch, fds);
+	} catch (const std::exception& e) {
+		log_error("unable to start %s: %s", launch.argv[0].c_str(), e.what());
+		_exit(124);
+	}
+
+	char *argv[launch.argv.size() + 1];
+	for (size_t i = 0; i < launch.argv.size(); i++) {
+		argv[i] = (char *) launch.argv[i].c_str();
+	}
+	argv[launch.argv.size()] = nullptr;
+
+	char *envp[launch.envp.size() + 1];
+	for (size_t i = 0; i < launch.envp.size(); i++) {
+		envp[i] = (char *) launch.envp[i].c_str();
+	}
+	envp[launch.envp.size()] = nullptr;
+
+	(void) execve(argv[0], argv, envp);
+	_exit(errno == ENOENT || errno == EACCES ? 241 : 243);
+}
+
+static void pack_strings(std::vector<char>& block, const std::vector<std::string>& strings)
+{
+	for (const std::string& str : strings) {
+		block.insert(block.end(), str.c_str(), str.c_str() + str.size() + 1);
+	}
+}
+
+static void point_into(std::vector<char *>& ptrs, char *& p, size_t count)
+{
+	ptrs.clear();
+	for (size_t i = 0; i < count; i++) {
+		ptrs.push_back(p);
+		p += strlen(p) + 1;
+	}
+	ptrs.push_back(nullptr);
+}
+
+void LaunchPlan::compile(const LaunchDescriptor& launch)
+{
+	this->launch = launch;
+
+	if (launch.argv.empty()) {
+		throw std::invalid_argument("no program to launch");
+	}
+	if (launch.descriptor_targets.size() > SPAWN_MAX_DESCRIPTORS) {
+		throw std::length_error("too many descriptors");
+	}
+
+	this->string_block.clear();
+	pack_strings(this->string_block, launch.argv);
+	pack_strings(this->string_block, launch.envp);
+	char *p = this->string_block.data();
+	point_into(this->argv_ptrs, p, launch.argv.size());
+	point_into(this->envp_ptrs, p, launch.envp.size());
+
+	/* initgroups(3) consults the group database, which is not safe after vfork(2) */
+	this->groups.clear();
+	if (launch.set_credentials) {
+		int ngroups = 16;
+		for (;;) {
+			this->groups.resize(ngroups);
+#ifdef __APPLE__
+			int rv = getgrouplist(launch.user_name.c_str(), launch.gid,
+					(int *) this->groups.data(), &ngroups);
+#else
+			int rv = getgrouplist(launch.user_name.c_str(), launch.gid,
+					this->groups.data(), &ngroups);
+#endif
+			if (rv >= 0) {
+				this->groups.resize(ngroups);
+				break;
+			}
+			if (ngroups <= (int) this->groups.size()) {
+				ngroups = this->groups.size() * 2;
+			}
+		}
+	}
+
+	launch.serialize(this->encoded);
+	if (this->encoded.size() > SPAWN_MAX_REQUEST) {
+		throw std::length_error("launch descriptor is too large");
+	}
+}
+
+/*
+ * The C library on Linux makes every thread of the process change its
+ * credentials along with the caller, by signalling them and waiting for
+ * them to finish. That is not safe in a vfork(2) child, which shares its
+ * memory with the threads of jobd. The system calls themselves only change
+ * the credentials of the calling thread, which is all a new process has.
+ */
+#ifdef __linux__
+#ifdef SYS_setgroups32
+#define vfork_setgroups(size, list)	syscall(SYS_setgroups32, (size), (list))
+#define vfork_setgid(gid)		syscall(SYS_setgid32, (gid))
+#define vfork_setuid(uid)		syscall(SYS_setuid32, (uid))
+#else
+#define vfork_setgroups(size, list)	syscall(SYS_setgroups, (size), (list))
+#define vfork_setgid(gid)		syscall(SYS_setgid, (gid))
+#define vfork_setuid(uid)		syscall(SYS_setuid, (uid))
+#endif
+#else
+#define vfork_setgroups(size, list)	setgroups((size), (list))
+#define vfork_setgid(gid)		setgid(gid)
+#define vfork_setuid(uid)		setuid(uid)
+#endif
+
+pid_t launch_plan_vfork(const LaunchPlan& plan)
+{
+	const LaunchDescriptor& launch = plan.getDescriptor();
+	char *const *argv = plan.getArgv();
+	char *const *envp = plan.getEnvp();
+	const std::vector<gid_t>& groups = plan.getGroups();
+	volatile int child_errno = 0;
+	const char * volatile child_failed = NULL;
+	sigset_t mask;
+	pid_t pid;
+
+	if (!launch.descriptor_targets.empty()) {
+		throw std::invalid_argument("descriptors can't be passed to a vfork'd job");
+	}
+
+	sigemptyset(&mask);
+
+	pid = vfork();
+	if (pid < 0) {
+		log_errno("vfork(2)");
+		throw std::system_error(errno, std::system_category());
+	} else if (pid == 0) {
+		struct sigaction sa;
+		int fd;
+
+#define CHILD_CHECK(expr, what) do {		\
+		if ((expr) < 0) {			\
+			child_errno = errno;		\
+			child_failed = what;		\
+			_exit(124);			\
+		}					\
+	} while (0)
+
+		if (launch.new_session) {
+			CHILD_CHECK(setsid(), "setsid(2)");
+		}
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_DFL;
+		for (int i = 1; i < NSIG; i++) {
+			(void) sigaction(i, &sa, NULL);
+		}
+		CHILD_CHECK(sigprocmask(SIG_SETMASK, &mask, NULL), "sigprocmask(2)");
+
+		if (launch.nice != 0) {
+			CHILD_CHECK(setpriority(PRIO_PROCESS, 0, launch.nice), "setpriority(2)");
+		}
+		CHILD_CHECK(chdir(launch.working_directory.c_str()), "chdir(2)");
+		if (!launch.root_directory.empty()) {
+			CHILD_CHECK(chroot(launch.root_directory.c_str()), "chroot(2)");
+		}
+		if (launch.set_credentials) {
+			CHILD_CHECK(vfork_setgroups(groups.size(), groups.data()), "setgroups(2)");
+			CHILD_CHECK(vfork_setgid(launch.gid), "setgid(2)");
+#ifndef __GLIBC__
+			CHILD_CHECK(setlogin(launch.user_name.c_str()), "setlogin(2)");
+#endif
+			CHILD_CHECK(vfork_setuid(launch.uid), "setuid(2)");
+		}
+
+		CHILD_CHECK(fd = open(launch.stdin_path.c_str(), O_RDONLY), "open(2) of stdin");
+		CHILD_CHECK(dup2(fd, STDIN_FILENO), "dup2(2) of stdin");
+		if (fd != STDIN_FILENO)
+			(void) close(fd);
+		CHILD_CHECK(fd = open(launch.stdout_path.c_str(), O_CREAT | O_WRONLY, 0600), "open(2) of stdout");
+		CHILD_CHECK(dup2(fd, STDOUT_FILENO), "dup2(2) of stdout");
+		if (fd != STDOUT_FILENO)
+			(void) close(fd);
+		CHILD_CHECK(fd = open(launch.stderr_path.c_str(), O_CREAT | O_WRONLY, 0600), "open(2) of stderr");
+		CHILD_CHECK(dup2(fd, STDERR_FILENO), "dup2(2) of stderr");
+		if (fd != STDERR_FILENO)
+			(void) close(fd);
+
+#undef CHILD_CHECK
+
+		(void) execve(argv[0], argv, envp);
+		child_errno = errno;
+		child_failed = "execve(2)";
+		_exit(child_errno == ENOENT || child_errno == EACCES ? 241 : 243);
+	}
+
+	/* The child has either called execve(2) or exited by now */
+	if (child_failed != NULL) {
+		errno = child_errno;
+		log_errno("unable to start %s: %s", launch.argv[0].c_str(), child_failed);
+	}
+	return pid;
+}
+
+/*
+ * The helper process
+ */
+
+static int sigchld_pipe[2];
+
+static void helper_sigchld_handler(int signum)
+{
+	int saved_errno = errno;
+	(void) signum;
+	(void) write(sigchld_pipe[1], "", 1);
+	errno = saved_errno;
+}
+
+static void set_descriptor_flags(int fd, bool nonblocking)
+{
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		log_errno("fcntl(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (nonblocking && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		log_errno("fcntl(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+}
+
+/* Read one launch request and start the job. Returns false if jobd has gone away. */
+static bool helper_handle_request(int sockfd, std::vector<char>& buf)
+{
+	char control[CMSG_SPACE(sizeof(int) * SPAWN_MAX_DESCRIPTORS)];
+	int fds[SPAWN_MAX_DESCRIPTORS];
+	size_t nfds = 0;
+	struct spawn_reply reply = { -1, 0 };
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+	int flags = 0;
+
+	iov.iov_base = buf.data();
+	iov.iov_len = buf.size();
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+	do {
+		len = recvmsg(sockfd, &msg, flags);
+	} while (len < 0 && errno == EINTR);
+	if (len <= 0) {
+		return false;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i = 0; i < count && nfds < SPAWN_MAX_DESCRIPTORS; i++) {
+				memcpy(&fds[nfds], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+				(void) fcntl(fds[nfds], F_SETFD, FD_CLOEXEC);
+#endif
+				nfds++;
+			}
+		}
+	}
+
+	LaunchDescriptor launch;
+	if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		reply.error = EMSGSIZE;
+	} else {
+		try {
+			launch.parse(buf.data(), len);
+			if (launch.descriptor_targets.size() != nfds) {
+				throw std::invalid_argument("descriptor count mismatch");
+			}
+		} catch (const std::invalid_argument& e) {
+			log_error("bad launch request: %s", e.what());
+			reply.error = EINVAL;
+		}
+	}
+
+	if (reply.error == 0) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			launch_descriptor_exec(launch, fds);
+		} else if (pid < 0) {
+			reply.error = errno;
+		} else {
+			reply.pid = pid;
+		}
+	}
+
+	for (size_t i = 0; i < nfds; i++) {
+		(void) close(fds[i]);
+	}
+
+	if (send(sockfd, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+		return false;
+	}
+	return true;
+}
+
+static void helper_main(int sockfd, int exitfd) __attribute__((noreturn));
+
+static void helper_main(int sockfd, int exitfd)
+{
+	std::vector<char> buf(SPAWN_MAX_REQUEST);
+	std::deque<struct spawn_exit> pending;
+	struct sigaction sa;
+
+	/* jobd decides when jobs are stopped, so leave its signals to it */
+	for (int signum : { SIGHUP, SIGINT, SIGTERM, SIGUSR1 }) {
+		(void) signal(signum, SIG_IGN);
+	}
+
+	if (pipe(sigchld_pipe) < 0) {
+		log_errno("pipe(2)");
+		_exit(1);
+	}
+	set_descriptor_flags(sigchld_pipe[0], true);
+	set_descriptor_flags(sigchld_pipe[1], true);
+	set_descriptor_flags(exitfd, true);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = helper_sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+		log_errno("sigaction(2)");
+		_exit(1);
+	}
+
+	for (;;) {
+		struct pollfd pfd[3];
+
+		pfd[0].fd = sockfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = sigchld_pipe[0];
+		pfd[1].events = POLLIN;
+		pfd[2].fd = exitfd;
+		pfd[2].events = pending.empty() ? 0 : POLLOUT;
+
+		if (poll(pfd, 3, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			log_errno("poll(2)");
+			_exit(1);
+		}
+
+		if (pfd[1].revents) {
+			char c[64];
+			struct spawn_exit ex;
+			int status;
+			pid_t pid;
+
+			while (read(sigchld_pipe[0], &c, sizeof(c)) > 0) {}
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				ex.pid = pid;
+				ex.status = status;
+				pending.push_back(ex);
+			}
+		}
+
+		if (pfd[0].revents && !helper_handle_request(sockfd, buf)) {
+			/* jobd has exited */
+			_exit(0);
+		}
+
+		while (!pending.empty()) {
+			if (send(exitfd, &pending.front(), sizeof(struct spawn_exit), MSG_NOSIGNAL) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+					break;
+				_exit(0);
+			}
+			pending.pop_front();
+		}
+	}
+}
+
+/*
+ * The jobd side
+ */
+
+static void create_channel(int sv[2])
+{
+	int bufsize = SPAWN_MAX_REQUEST + 1024;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		log_errno("socketpair(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	for (int i = 0; i < 2; i++) {
+		set_descriptor_flags(sv[i], false);
+		if (setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) < 0 ||
+				setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize)) < 0) {
+			log_errno("setsockopt(2)");
+		}
+	}
+}
+
+SpawnHelper::~SpawnHelper()
+{
+	if (this->isRunning()) {
+		(void) close(this->sockfd);
+		(void) close(this->exitfd);
+	}
+}
+
+void SpawnHelper::start()
+{
+	int request[2], notify[2];
+
+	create_channel(request);
+	create_channel(notify);
+
+	/* Don't let the helper inherit anything that is waiting to be written */
+	(void) fflush(NULL);
+
+	this->pid = fork();
+	if (this->pid < 0) {
+		log_errno("fork(2)");
+		throw std::system_error(errno, std::system_category());
+	} else if (this->pid == 0) {
+		(void) close(request[0]);
+		(void) close(notify[0]);
+		try {
+			helper_main(request[1], notify[1]);
+		} catch (...) {
+			_exit(1);
+		}
+	}
+
+	(void) close(request[1]);
+	(void) close(notify[1]);
+	this->sockfd = request[0];
+	this->exitfd = notify[0];
+	set_descriptor_flags(this->exitfd, true);
+	log_debug("spawn helper started with pid %d", this->pid);
+}
+
+void SpawnHelper::stop()
+{
+	int status;
+
+	if (!this->isRunning())
+		return;
+
+	/* The helper exits when it sees that the request channel is closed */
+	(void) close(this->sockfd);
+	(void) close(this->exitfd);
+	this->sockfd = -1;
+	this->exitfd = -1;
+	if (waitpid(this->pid, &status, 0) < 0) {
+		log_errno("waitpid(2)");
+	}
+	log_debug("spawn helper with pid %d stopped", this->pid);
+	this->pid = -1;
+}
+
+pid_t SpawnHelper::spawn(const LaunchPlan& plan, const std::vector<int>& fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * SPAWN_MAX_DESCRIPTORS)];
+	struct spawn_reply reply;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t len;
+
+	if (fds.size() != plan.getDescriptor().descriptor_targets.size()) {
+		throw std::invalid_argument("descriptor count mismatch");
+	}
+
+	iov.iov_base = (void *) plan.getEncoded().data();
+	iov.iov_len = plan.getEncoded().size();
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (!fds.empty()) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+		memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+	}
+
+	/* Once the channel fails, the request and reply can't be matched up */
+	do {
+		len = sendmsg(this->sockfd, &msg, MSG_NOSIGNAL);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		log_errno("sendmsg(2)");
+		throw std::runtime_error("spawn helper went away");
+	}
+
+	do {
+		len = recv(this->sockfd, &reply, sizeof(reply), 0);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		log_errno("recv(2)");
+		throw std::runtime_error("spawn helper went away");
+	} else if (len != sizeof(reply)) {
+		throw std::runtime_error("spawn helper went away");
+	}
+
+	if (reply.error != 0) {
+		errno = reply.error;
+		log_errno("spawn helper was unable to start %s", plan.getArgv()[0]);
+		throw std::system_error(errno, std::system_category());
+	}
+	return reply.pid;
+}
+
+bool SpawnHelper::readExit(pid_t& pid, int& status)
+{
+	struct spawn_exit ex;
+	ssize_t len;
+
+	do {
+		len = recv(this->exitfd, &ex, sizeof(ex), 0);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return false;
+		log_errno("recv(2)");
+		throw std::system_error(errno, std::system_category());
+	} else if (len != sizeof(ex)) {
+		throw std::runtime_error("spawn helper went away");
+	}
+
+	pid = ex.pid;
+	status = ex.status;
+	return true;
+}
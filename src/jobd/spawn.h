@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef RELAUNCHD_SPAWN_H_
+#define RELAUNCHD_SPAWN_H_
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+/** The largest launch descriptor that can be sent to the spawn helper */
+#define SPAWN_MAX_REQUEST	65536
+
+/** The most descriptors that can be passed to a single job */
+#define SPAWN_MAX_DESCRIPTORS	64
+
+/**
+ * Everything that is needed to start a job, in a form that can be sent
+ * to the spawn helper over a socket.
+ */
+struct LaunchDescriptor {
+	std::vector<std::string> argv;
+
+	/** Environment variables, in the form of KEY=value */
+	std::vector<std::string> envp;
+
+	std::string user_name;
+	std::string working_directory;
+
+	/** If not empty, chroot(2) here after changing the working directory */
+	std::string root_directory;
+
+	std::string stdin_path;
+	std::string stdout_path;
+	std::string stderr_path;
+
+	uid_t uid = 0;
+	gid_t gid = 0;
+	int nice = 0;
+
+	/** If true, switch to uid/gid before exec. This requires root privileges. */
+	bool set_credentials = false;
+
+	/** If true, make the job the leader of a new session */
+	bool new_session = true;
+
+	/**
+	 * The descriptor number that each descriptor passed alongside the
+	 * launch descriptor will have in the job.
+	 */
+	std::vector<int> descriptor_targets;
+
+	/** Encode into a compact binary form, replacing the contents of @buf */
+	void serialize(std::vector<char>& buf) const;
+
+	/** Decode from the binary form. Throws std::invalid_argument if malformed. */
+	void parse(const char *buf, size_t len);
+};
+
+/**
+ * A LaunchDescriptor compiled into the form that is needed to start the job,
+ * so that the parent does not have to allocate memory each time it does.
+ * The argv and envp arrays point into a single block of strings, so a plan
+ * can't be copied, and is immutable once compiled.
+ */
+class LaunchPlan {
+public:
+	LaunchPlan() {}
+	LaunchPlan(const LaunchPlan&) = delete;
+	LaunchPlan& operator=(const LaunchPlan&) = delete;
+
+	/** Replace the plan with one compiled from @launch */
+	void compile(const LaunchDescriptor& launch);
+
+	bool isCompiled() const { return !argv_ptrs.empty(); }
+
+	const LaunchDescriptor& getDescriptor() const { return launch; }
+
+	/** NULL-terminated arrays, suitable for execve(2) */
+	char *const *getArgv() const { return argv_ptrs.data(); }
+	char *const *getEnvp() const { return envp_ptrs.data(); }
+
+	/** The supplementary groups of the user, if the credentials are to be set */
+	const std::vector<gid_t>& getGroups() const { return groups; }
+
+	/** The descriptor in the binary form that is sent to the spawn helper */
+	const std::vector<char>& getEncoded() const { return encoded; }
+
+private:
+	LaunchDescriptor launch;
+
+	/** The argv and envp strings, back to back */
+	std::vector<char> string_block;
+
+	std::vector<char *> argv_ptrs;
+	std::vector<char *> envp_ptrs;
+	std::vector<gid_t> groups;
+	std::vector<char> encoded;
+};
+
+/**
+ * Called in a freshly forked child process. Changes the credentials, working
+ * directory and standard I/O of the process as described by @launch, and
+ * moves the passed descriptors @fds into place. Throws std::system_error.
+ */
+void launch_descriptor_apply(const LaunchDescriptor& launch, const int *fds);
+
+/**
+ * Like launch_descriptor_apply(), and then execute the program. If anything
+ * fails, the process exits with a non-zero status.
+ */
+void launch_descriptor_exec(const LaunchDescriptor& launch, const int *fds)
+	__attribute__((noreturn));
+
+/**
+ * Start a job with vfork(2), so that the page tables of the caller are
+ * shared with the child instead of copied. This is only suitable for jobs
+ * that pass no descriptors. The child makes nothing but async-signal-safe
+ * system calls on data from the plan, and exits with status 124 if any of
+ * them fail. On Linux, the credentials are changed with the raw system
+ * calls, since the C library wrappers involve every thread of jobd.
+ * Returns the pid of the job.
+ */
+pid_t launch_plan_vfork(const LaunchPlan& plan);
+
+/**
+ * A small process that starts jobs on behalf of jobd.
+ *
+ * fork(2) has to copy the page tables of the calling process, so the cost of
+ * starting a job from jobd grows with the number of jobs it has loaded. The
+ * helper is forked once, before any jobs are loaded, and does the fork/exec of
+ * each job from its own tiny address space instead.
+ *
+ * Most jobs are started with launch_plan_vfork(), which is cheaper still. The
+ * helper is only used for the jobs that vfork(2) cannot start: those with
+ * CreateDescriptors or a chroot jail, except for Capsicum jobs and jobs with a
+ * kqueue descriptor, which jobd has to fork itself.
+ *
+ * jobd sends a LaunchDescriptor and any descriptors the job needs over a
+ * socketpair, and the helper replies with the pid of the job. Jobs are children
+ * of the helper, so it reaps them and reports their exit status over a second
+ * socketpair, which jobd watches from the main loop.
+ */
+class SpawnHelper {
+public:
+	~SpawnHelper();
+
+	/** Fork the helper process. This should be done while jobd is still small. */
+	void start();
+
+	/**
+	 * Stop the helper. Jobs that it started keep running, but they are
+	 * reparented, and their exits are no longer reported by the helper.
+	 */
+	void stop();
+
+	bool isRunning() const { return pid > 0; }
+
+	/** The pid of the helper process, or -1 if it is not running */
+	pid_t getPid() const { return pid; }
+
+	/** The descriptor that becomes readable when the helper has reaped a job */
+	int getExitDescriptor() const { return exitfd; }
+
+	/**
+	 * Start a job, passing it a copy of each descriptor in @fds.
+	 * Returns the pid of the job. Throws std::system_error if the helper
+	 * was unable to fork the job, and std::runtime_error if the helper has
+	 * gone away, in which case it should be stopped.
+	 */
+	pid_t spawn(const LaunchPlan& plan, const std::vector<int>& fds);
+
+	/**
+	 * Read the exit status of one job that the helper has reaped.
+	 * Returns false if there are no more, and throws std::runtime_error if
+	 * the helper has gone away.
+	 */
+	bool readExit(pid_t& pid, int& status);
+
+private:
+	/** The pid of the helper process, or -1 if it is not running */
+	pid_t pid = -1;
+
+	/** Launch requests and their replies */
+	int sockfd = -1;
+
+	/** Exit notifications from the helper */
+	int exitfd = -1;
+};
+
+#endif /* RELAUNCHD_SPAWN_H_ */
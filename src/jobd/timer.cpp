@@ -14,108 +14,117 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include "../../vendor/FreeBSD/sys/queue.h"
-#if HAVE_SYS_LIMITS_H
-#include <sys/limits.h>
-#else
-#include <limits.h>
-#endif
+
+#include <vector>
+
+extern "C" {
 #include <sys/types.h>
-#include <sys/event.h>
 #include <sys/time.h>
 #include <time.h>
+}
 
 #include "clock.h"
+#include "event.h"
 #include <libjob/logger.h>
 #include "manager.h"
 #include "timer.h"
+#include "timerwheel.h"
 #include "job.h"
 
-/* The main kqueue descriptor used by launchd */
-static int parent_kqfd;
+extern JobManager manager;
 
-static SLIST_HEAD(, job) start_interval_list;
+/* The event backend used by the main loop */
+static EventBackend *parent_events;
 
-static uint32_t min_interval = UINT_MAX;
+/* All jobs with a StartInterval, keyed by the next time they should start */
+static TimerWheel start_interval_wheel;
 
-/* Find the smallest interval that we can wait before waking up at least one job */
-static void update_min_interval()
-{
-	struct kevent kev;
-	job_t job;
-	int saved_interval = min_interval;
+/* Scratch space for the timers that expire on each wakeup */
+static std::vector<TimerWheel::Entry *> expired_timers;
+
+/* The time when the kernel timer will fire next, or 0 if it is disabled */
+static time_t next_wakeup = 0;
 
-	if (SLIST_EMPTY(&start_interval_list)) {
-		if (min_interval == 0) {
+/* Arm a single kernel timer for the next time the wheel needs to advance */
+static void update_wakeup()
+{
+	if (start_interval_wheel.empty()) {
+		if (next_wakeup == 0) {
 			return;
 		}
-		EV_SET(&kev, JOB_SCHEDULE_PERIODIC, EVFILT_TIMER, EV_ADD | EV_DISABLE, 0, 0, (void *)&setup_timers);
-		if (kevent(parent_kqfd, &kev, 1, NULL, 0, NULL) < 0) {
-			err(1, "kevent(2)");
-		}
-		min_interval = 0;
-	} else {
-		SLIST_FOREACH(job, &start_interval_list, start_interval_sle) {
-			if (job->jm->start_interval < min_interval)
-				min_interval = job->jm->start_interval;
-		}
-		if (min_interval > 0 && saved_interval == 0) {
-			EV_SET(&kev, JOB_SCHEDULE_PERIODIC, EVFILT_TIMER,
-					EV_ADD | EV_ENABLE, 0, (1000 * min_interval), (void *)&setup_timers);
-			if (kevent(parent_kqfd, &kev, 1, NULL, 0, NULL) < 0) {
-				err(1, "kevent(2)");
-			}
-		}
+		parent_events->cancelTimer(JOB_SCHEDULE_PERIODIC);
+		next_wakeup = 0;
+		return;
 	}
+
+	time_t wakeup = start_interval_wheel.nextWakeup();
+	if (wakeup == next_wakeup) {
+		return;
+	}
+
+	int time_delta = (wakeup - current_time()) * 1000;
+	if (time_delta <= 0) {
+		time_delta = 1;
+	}
+	parent_events->setTimer(JOB_SCHEDULE_PERIODIC, time_delta, (void *)&setup_timers);
+	next_wakeup = wakeup;
 }
 
-static inline void update_job_interval(job_t job)
+static inline void update_job_interval(Job& job, time_t now)
 {
-	job->next_scheduled_start = current_time() + job->jm->start_interval;
-	log_debug("job %s will start after T=%lu", job->jm->label, (unsigned long)job->next_scheduled_start);
+	start_interval_wheel.schedule(job.getStartIntervalTimer(), now + job.getStartInterval());
+	log_debug("job %s will start after T=%lu", job.getLabel().c_str(),
+			(unsigned long)job.getStartIntervalTimer().expires);
 }
 
-int setup_timers(int kqfd)
+int setup_timers(EventBackend& events)
 {
-	parent_kqfd = kqfd;
-	SLIST_INIT(&start_interval_list);
+	parent_events = &events;
+	start_interval_wheel = TimerWheel(current_time());
 	return 0;
 }
 
-int timer_register_job(struct job *job)
+int timer_register_job(Job& job)
 {
-	//TODO: keep the list sorted
-	SLIST_INSERT_HEAD(&start_interval_list, job, start_interval_sle);
-	update_job_interval(job);
-	update_min_interval();
+	if (job.getStartInterval() == 0)
+		return -1;
+
+	update_job_interval(job, current_time());
+	update_wakeup();
 	return 0;
 }
 
-int timer_unregister_job(struct job *job)
+int timer_unregister_job(Job& job)
 {
-	if (job->schedule == JOB_SCHEDULE_NONE)
+	if (!job.getStartIntervalTimer().isScheduled())
 		return -1;
 
-	SLIST_REMOVE(&start_interval_list, job, job, start_interval_sle);
-	update_min_interval();
+	start_interval_wheel.cancel(job.getStartIntervalTimer());
+	update_wakeup();
 	return 0;
 }
 
 int timer_handler()
 {
-	job_t job;
 	time_t now = current_time();
 
-	log_debug("waking up after %u seconds", min_interval);
-	SLIST_FOREACH(job, &start_interval_list, start_interval_sle) {
-		if (now >= job->next_scheduled_start) {
-			log_debug("job %s starting due to timer interval", job->jm->label);
-			update_job_interval(job);
-//FIXME: need to refactor for C++
-#if 0
-			(void) manager_wake_job(job); //FIXME: error handling
-#endif
+	/* The kernel timer is one-shot, so it is no longer armed */
+	next_wakeup = 0;
+
+	expired_timers.clear();
+	start_interval_wheel.advance(now, expired_timers);
+	for (TimerWheel::Entry *entry : expired_timers) {
+		Job& job = *entry->job;
+
+		update_job_interval(job, now);
+		if (job.getState() == JOB_STATE_WAITING) {
+			log_debug("job %s starting due to timer interval", job.getLabel().c_str());
+			manager.wakeJob(job.getLabel());
+		} else {
+			log_debug("job %s is not waiting; skipping this interval (state=%s)",
+					job.getLabel().c_str(), job.getStateString().c_str());
 		}
 	}
+	update_wakeup();
 	return 0;
 }
@@ -14,14 +14,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+
 #ifndef RELAUNCHD_TIMER_H_
 #define RELAUNCHD_TIMER_H_
 
-struct job;
+class EventBackend;
+class Job;
 
-int setup_timers(int kqfd);
+int setup_timers(EventBackend& events);
 int timer_handler();
-int timer_register_job(struct job *);
-int timer_unregister_job(struct job *);
+int timer_register_job(Job& job);
+int timer_unregister_job(Job& job);
 
 #endif /* RELAUNCHD_TIMER_H_ */
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <limits>
+
+#include "timerwheel.h"
+
+/* Bits of the time that select a slot in the given level */
+static inline unsigned int level_shift(unsigned int level)
+{
+	return level * TimerWheel::SLOT_BITS;
+}
+
+/*
+ * Return the distance (1..SLOTS) from the given slot to the next occupied
+ * slot after it, wrapping around to the slot itself. The bitmap must not
+ * be empty.
+ */
+static inline unsigned int next_occupied(uint64_t bitmap, unsigned int from)
+{
+	unsigned int start = (from + 1) % TimerWheel::SLOTS;
+	uint64_t rotated = start ? (bitmap >> start) | (bitmap << (TimerWheel::SLOTS - start)) : bitmap;
+
+	return __builtin_ctzll(rotated) + 1;
+}
+
+TimerWheel::TimerWheel(time_t now) : current(now)
+{
+	std::fill(&slots[0][0], &slots[0][0] + (LEVELS * SLOTS), nullptr);
+	std::fill(occupied, occupied + LEVELS, 0);
+}
+
+void TimerWheel::schedule(Entry& entry, time_t expires)
+{
+	if (entry.scheduled) {
+		unlink(entry);
+	} else {
+		count++;
+	}
+	entry.expires = expires;
+	entry.scheduled = true;
+
+	/* Anything that is already due will expire on the next tick */
+	insert(entry, current + 1);
+}
+
+void TimerWheel::cancel(Entry& entry)
+{
+	if (entry.scheduled) {
+		unlink(entry);
+		entry.scheduled = false;
+		count--;
+	}
+}
+
+void TimerWheel::insert(Entry& entry, time_t earliest)
+{
+	const time_t max_delta = (static_cast<time_t>(1) << level_shift(LEVELS)) - 1;
+	time_t expires = std::max(entry.expires, earliest);
+	time_t delta = expires - current;
+	unsigned int level;
+
+	if (delta > max_delta) {
+		/* Park it in the farthest slot; it will be cascaded again later */
+		expires = current + max_delta;
+		delta = max_delta;
+	}
+	for (level = 0; level < LEVELS - 1; level++) {
+		if (delta < (static_cast<time_t>(1) << level_shift(level + 1))) {
+			break;
+		}
+	}
+
+	unsigned int slot = (expires >> level_shift(level)) & (SLOTS - 1);
+	Entry*& head = slots[level][slot];
+
+	entry.level = level;
+	entry.slot = slot;
+	entry.prev = nullptr;
+	entry.next = head;
+	if (head) {
+		head->prev = &entry;
+	}
+	head = &entry;
+	occupied[level] |= (uint64_t)1 << slot;
+}
+
+void TimerWheel::unlink(Entry& entry)
+{
+	if (entry.prev) {
+		entry.prev->next = entry.next;
+	} else {
+		slots[entry.level][entry.slot] = entry.next;
+		if (!entry.next) {
+			occupied[entry.level] &= ~((uint64_t)1 << entry.slot);
+		}
+	}
+	if (entry.next) {
+		entry.next->prev = entry.prev;
+	}
+	entry.prev = entry.next = nullptr;
+}
+
+void TimerWheel::cascade(unsigned int level)
+{
+	unsigned int slot = (current >> level_shift(level)) & (SLOTS - 1);
+	Entry* entry = slots[level][slot];
+
+	slots[level][slot] = nullptr;
+	occupied[level] &= ~((uint64_t)1 << slot);
+	while (entry) {
+		Entry* next = entry->next;
+		insert(*entry, current);
+		entry = next;
+	}
+}
+
+void TimerWheel::tick(std::vector<Entry*>& expired)
+{
+	current++;
+
+	/*
+	 * At the start of a higher-level slot, move its timers down. Some
+	 * of them may land in the level 0 slot that expires right now.
+	 */
+	for (unsigned int level = 1; level < LEVELS; level++) {
+		if ((current & ((static_cast<time_t>(1) << level_shift(level)) - 1)) != 0) {
+			break;
+		}
+		cascade(level);
+	}
+
+	unsigned int slot = current & (SLOTS - 1);
+	Entry* entry = slots[0][slot];
+
+	slots[0][slot] = nullptr;
+	occupied[0] &= ~((uint64_t)1 << slot);
+	while (entry) {
+		Entry* next = entry->next;
+		entry->prev = entry->next = nullptr;
+		entry->scheduled = false;
+		count--;
+		expired.push_back(entry);
+		entry = next;
+	}
+}
+
+time_t TimerWheel::nextWakeup() const
+{
+	time_t result = std::numeric_limits<time_t>::max();
+
+	for (unsigned int level = 0; level < LEVELS; level++) {
+		if (!occupied[level]) {
+			continue;
+		}
+		time_t block = current >> level_shift(level);
+		time_t distance = next_occupied(occupied[level], block & (SLOTS - 1));
+		result = std::min(result, (block + distance) << level_shift(level));
+	}
+	return result;
+}
+
+void TimerWheel::advance(time_t now, std::vector<Entry*>& expired)
+{
+	while (current < now) {
+		if (count == 0) {
+			current = now;
+			break;
+		}
+
+		/* Nothing happens between here and the next wakeup */
+		time_t wakeup = nextWakeup();
+		if (wakeup > now) {
+			current = now;
+			break;
+		}
+		current = wakeup - 1;
+		tick(expired);
+	}
+}
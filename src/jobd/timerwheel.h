@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef RELAUNCHD_TIMERWHEEL_H_
+#define RELAUNCHD_TIMERWHEEL_H_
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <time.h>
+}
+
+class Job;
+
+/**
+ * A hierarchical timing wheel with a resolution of one second.
+ *
+ * There are four levels of 64 slots each. Level 0 holds the timers due in
+ * the next 64 seconds, one slot per second; each higher level covers 64
+ * times the span of the level below it, for a total range of about 194
+ * days. When the wheel reaches the start of a higher-level slot, the
+ * timers in it are moved down to a finer level ("cascaded").
+ *
+ * Inserting and cancelling a timer is O(1). Advancing the wheel skips
+ * over empty slots, so its cost depends on the number of timers that
+ * expire or cascade, not on the number of timers or seconds elapsed.
+ */
+class TimerWheel {
+public:
+	static const unsigned int LEVELS = 4;
+	static const unsigned int SLOT_BITS = 6;
+	static const unsigned int SLOTS = 1 << SLOT_BITS;
+
+	/** A timer. Each Job embeds one of these for StartInterval. */
+	struct Entry {
+		Job* job = nullptr;
+
+		/** The time when the timer expires */
+		time_t expires = 0;
+
+		Entry* prev = nullptr;
+		Entry* next = nullptr;
+		bool scheduled = false;
+		unsigned int level = 0;
+		unsigned int slot = 0;
+
+		bool isScheduled() const { return scheduled; }
+	};
+
+	/** Create an empty wheel whose clock starts at the given time */
+	TimerWheel(time_t now = 0);
+
+	/** Start a timer, or move it if it is already scheduled */
+	void schedule(Entry& entry, time_t expires);
+
+	/** Stop a timer. Does nothing if it is not scheduled. */
+	void cancel(Entry& entry);
+
+	/**
+	 * Move the wheel forward to the given time, and append every timer
+	 * that expired along the way to the list. Expired timers are no
+	 * longer scheduled.
+	 */
+	void advance(time_t now, std::vector<Entry*>& expired);
+
+	/**
+	 * The next time the wheel needs to be advanced, either to expire a
+	 * timer or to cascade a slot. Only valid if !empty()
+	 */
+	time_t nextWakeup() const;
+
+	bool empty() const { return count == 0; }
+	size_t size() const { return count; }
+
+private:
+	/** The last second that the wheel has processed */
+	time_t current;
+	size_t count = 0;
+
+	Entry* slots[LEVELS][SLOTS];
+
+	/** For each level, a bitmap of the slots that hold any timers */
+	uint64_t occupied[LEVELS];
+
+	/** Link an entry into its slot. Times before @earliest are rounded up. */
+	void insert(Entry& entry, time_t earliest);
+	void unlink(Entry& entry);
+	void tick(std::vector<Entry*>& expired);
+	void cascade(unsigned int level);
+};
+
+#endif /* RELAUNCHD_TIMERWHEEL_H_ */
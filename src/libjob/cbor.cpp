@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include "cbor.hpp"
+
+using json = nlohmann::json;
+
+namespace libjob {
+
+/* Major types */
+enum {
+	CBOR_UINT = 0,
+	CBOR_NEGINT = 1,
+	CBOR_BYTES = 2,
+	CBOR_TEXT = 3,
+	CBOR_ARRAY = 4,
+	CBOR_MAP = 5,
+	CBOR_TAG = 6,
+	CBOR_SIMPLE = 7,
+};
+
+/* Values of the additional information for major type 7 */
+enum {
+	CBOR_FALSE = 20,
+	CBOR_TRUE = 21,
+	CBOR_NULL = 22,
+	CBOR_UNDEFINED = 23,
+	CBOR_HALF = 25,
+	CBOR_FLOAT = 26,
+	CBOR_DOUBLE = 27,
+};
+
+/* Deeper documents than this are rejected, instead of overflowing the stack */
+static const unsigned int max_depth = 256;
+
+static void put_uint(std::string& out, uint64_t value, size_t bytes)
+{
+	for (size_t i = bytes; i > 0; i--) {
+		out.push_back((char) (value >> (8 * (i - 1))));
+	}
+}
+
+/* The initial byte of a data item, followed by its argument in the shortest form */
+static void put_head(std::string& out, unsigned int major, uint64_t value)
+{
+	unsigned char type = major << 5;
+
+	if (value < 24) {
+		out.push_back((char) (type | value));
+	} else if (value <= 0xff) {
+		out.push_back((char) (type | 24));
+		put_uint(out, value, 1);
+	} else if (value <= 0xffff) {
+		out.push_back((char) (type | 25));
+		put_uint(out, value, 2);
+	} else if (value <= 0xffffffff) {
+		out.push_back((char) (type | 26));
+		put_uint(out, value, 4);
+	} else {
+		out.push_back((char) (type | 27));
+		put_uint(out, value, 8);
+	}
+}
+
+static void put_text(std::string& out, const std::string& s)
+{
+	put_head(out, CBOR_TEXT, s.size());
+	out.append(s);
+}
+
+void cbor_encode(const json& j, std::string& out)
+{
+	switch (j.type()) {
+	case json::value_t::object:
+		put_head(out, CBOR_MAP, j.size());
+		for (auto it = j.begin(); it != j.end(); ++it) {
+			put_text(out, it.key());
+			cbor_encode(it.value(), out);
+		}
+		break;
+
+	case json::value_t::array:
+		put_head(out, CBOR_ARRAY, j.size());
+		for (auto& it : j) {
+			cbor_encode(it, out);
+		}
+		break;
+
+	case json::value_t::string:
+		put_text(out, *j.get_ptr<const json::string_t *>());
+		break;
+
+	case json::value_t::boolean:
+		out.push_back((char) ((CBOR_SIMPLE << 5) | (j.get<bool>() ? CBOR_TRUE : CBOR_FALSE)));
+		break;
+
+	case json::value_t::number_integer: {
+		int64_t value = j.get<int64_t>();
+		if (value >= 0) {
+			put_head(out, CBOR_UINT, value);
+		} else {
+			put_head(out, CBOR_NEGINT, (uint64_t) (-1 - value));
+		}
+		break;
+	}
+
+	case json::value_t::number_unsigned:
+		put_head(out, CBOR_UINT, j.get<uint64_t>());
+		break;
+
+	case json::value_t::number_float: {
+		double value = j.get<double>();
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		out.push_back((char) ((CBOR_SIMPLE << 5) | CBOR_DOUBLE));
+		put_uint(out, bits, 8);
+		break;
+	}
+
+	case json::value_t::null:
+	case json::value_t::discarded:
+		out.push_back((char) ((CBOR_SIMPLE << 5) | CBOR_NULL));
+		break;
+	}
+}
+
+namespace {
+
+class Decoder {
+public:
+	Decoder(const char *data, size_t len)
+		: p((const unsigned char *) data), end((const unsigned char *) data + len) {}
+
+	json decodeDocument()
+	{
+		json result = decode(0);
+		if (p != end)
+			fail("trailing data after the end of the document");
+		return result;
+	}
+
+private:
+	const unsigned char *p;
+	const unsigned char *end;
+
+	[[noreturn]] void fail(const char *reason)
+	{
+		throw std::invalid_argument(std::string("invalid CBOR: ") + reason);
+	}
+
+	uint64_t getUint(size_t bytes)
+	{
+		uint64_t value = 0;
+
+		if ((size_t) (end - p) < bytes)
+			fail("unexpected end of data");
+		for (size_t i = 0; i < bytes; i++) {
+			value = (value << 8) | *p++;
+		}
+		return value;
+	}
+
+	/* The argument of a data item whose initial byte has this additional information */
+	uint64_t getArgument(unsigned int info)
+	{
+		if (info < 24)
+			return info;
+		switch (info) {
+		case 24: return getUint(1);
+		case 25: return getUint(2);
+		case 26: return getUint(4);
+		case 27: return getUint(8);
+		case 31: fail("indefinite-length items are not supported");
+		default: fail("reserved additional information");
+		}
+	}
+
+	/* A length, which cannot be more than the number of bytes that are left */
+	size_t getLength(unsigned int info)
+	{
+		uint64_t len = getArgument(info);
+		if (len > (uint64_t) (end - p))
+			fail("length exceeds the size of the data");
+		return len;
+	}
+
+	std::string getText(unsigned int info)
+	{
+		size_t len = getLength(info);
+		std::string s((const char *) p, len);
+		p += len;
+		return s;
+	}
+
+	static double halfToDouble(uint16_t half)
+	{
+		int exponent = (half >> 10) & 0x1f;
+		int mantissa = half & 0x3ff;
+		double value;
+
+		if (exponent == 0)
+			value = std::ldexp(mantissa, -24);
+		else if (exponent != 31)
+			value = std::ldexp(mantissa + 1024, exponent - 25);
+		else
+			value = (mantissa == 0) ? std::numeric_limits<double>::infinity() : NAN;
+		return (half & 0x8000) ? -value : value;
+	}
+
+	json decode(unsigned int depth)
+	{
+		if (depth > max_depth)
+			fail("document is nested too deeply");
+		if (p == end)
+			fail("unexpected end of data");
+
+		unsigned int major = *p >> 5;
+		unsigned int info = *p & 0x1f;
+		p++;
+
+		switch (major) {
+		case CBOR_UINT:
+			return json((json::number_unsigned_t) getArgument(info));
+
+		case CBOR_NEGINT: {
+			uint64_t value = getArgument(info);
+			if (value > (uint64_t) std::numeric_limits<int64_t>::max())
+				fail("negative integer out of range");
+			return json((json::number_integer_t) (-1 - (int64_t) value));
+		}
+
+		case CBOR_BYTES:
+			fail("byte strings are not supported");
+
+		case CBOR_TEXT:
+			return json(getText(info));
+
+		case CBOR_ARRAY: {
+			/* Every element takes at least one byte, so getLength() bounds the count */
+			size_t count = getLength(info);
+			json result(json::value_t::array);
+			json::array_t *array = result.get_ptr<json::array_t *>();
+			array->reserve(count);
+			for (size_t i = 0; i < count; i++) {
+				array->push_back(decode(depth + 1));
+			}
+			return result;
+		}
+
+		case CBOR_MAP: {
+			size_t count = getLength(info);
+			json result(json::value_t::object);
+			json::object_t *object = result.get_ptr<json::object_t *>();
+			for (size_t i = 0; i < count; i++) {
+				if (p == end)
+					fail("unexpected end of data");
+				if ((*p >> 5) != CBOR_TEXT)
+					fail("map keys must be text strings");
+				unsigned int key_info = *p++ & 0x1f;
+				std::string key = getText(key_info);
+				/* cbor_encode() writes the keys in order, so this is an append */
+				object->emplace_hint(object->end(), std::move(key), decode(depth + 1));
+			}
+			return result;
+		}
+
+		case CBOR_TAG:
+			/* Tags only add meaning to the item that follows */
+			(void) getArgument(info);
+			return decode(depth + 1);
+
+		case CBOR_SIMPLE:
+			switch (info) {
+			case CBOR_FALSE:
+				return json(false);
+			case CBOR_TRUE:
+				return json(true);
+			case CBOR_NULL:
+			case CBOR_UNDEFINED:
+				return json(nullptr);
+			case CBOR_HALF:
+				return json(halfToDouble(getUint(2)));
+			case CBOR_FLOAT: {
+				uint32_t bits = getUint(4);
+				float value;
+				memcpy(&value, &bits, sizeof(value));
+				return json((double) value);
+			}
+			case CBOR_DOUBLE: {
+				uint64_t bits = getUint(8);
+				double value;
+				memcpy(&value, &bits, sizeof(value));
+				return json(value);
+			}
+			default:
+				fail("unsupported simple value");
+			}
+		}
+		fail("unknown major type");
+	}
+};
+
+}
+
+json cbor_decode(const char *data, size_t len)
+{
+	return Decoder(data, len).decodeDocument();
+}
+
+}
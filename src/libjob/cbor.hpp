@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * A CBOR (RFC 7049) encoder and decoder for JSON documents, used as a
+ * compact binary encoding of IPC messages. This version of nlohmann::json
+ * does not have one of its own.
+ */
+
+#pragma once
+
+#include <string>
+
+#include "parser.hpp"
+
+namespace libjob {
+
+/** Append the CBOR encoding of a JSON document to @out */
+void cbor_encode(const nlohmann::json& j, std::string& out);
+
+static inline std::string cbor_encode(const nlohmann::json& j)
+{
+	std::string out;
+	cbor_encode(j, out);
+	return out;
+}
+
+/**
+ * Decode a CBOR data item into a JSON document. Byte strings and
+ * indefinite-length items have no equivalent in the documents that
+ * cbor_encode() produces, and are rejected.
+ *
+ * Throws std::invalid_argument if the data is malformed or truncated,
+ * like nlohmann::json::parse() does.
+ */
+nlohmann::json cbor_decode(const char *data, size_t len);
+
+static inline nlohmann::json cbor_decode(const std::string& data)
+{
+	return cbor_decode(data.data(), data.size());
+}
+
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <system_error>
+
+extern "C" {
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/stat.h>
+}
+
+#include "credentialCache.hpp"
+#include "logger.h"
+
+namespace libjob
+{
+
+static const char *passwd_path = "/etc/passwd";
+static const char *group_path = "/etc/group";
+
+/* getpwnam(3) and friends return NULL without setting errno if there is no match */
+static void throw_lookup_error(int saved_errno)
+{
+	throw std::system_error(saved_errno != 0 ? saved_errno : ENOENT, std::system_category());
+}
+
+static UserCredentials to_user(const struct passwd *pwent)
+{
+	UserCredentials user;
+
+	user.name = pwent->pw_name;
+	user.uid = pwent->pw_uid;
+	user.gid = pwent->pw_gid;
+	user.home_directory = pwent->pw_dir;
+	user.shell = pwent->pw_shell;
+	return user;
+}
+
+static GroupCredentials to_group(const struct group *grent)
+{
+	GroupCredentials group;
+
+	group.name = grent->gr_name;
+	group.gid = grent->gr_gid;
+	return group;
+}
+
+CredentialCache& CredentialCache::instance()
+{
+	static CredentialCache cache;
+	return cache;
+}
+
+CredentialCache::FileStamp CredentialCache::stampOf(const char *path)
+{
+	struct stat sb;
+	FileStamp stamp;
+
+	/* A missing file has the empty stamp, so its reappearance is noticed */
+	if (stat(path, &sb) == 0) {
+		stamp.dev = sb.st_dev;
+		stamp.ino = sb.st_ino;
+		stamp.size = sb.st_size;
+		stamp.mtime = sb.st_mtime;
+		stamp.ctime = sb.st_ctime;
+	}
+	return stamp;
+}
+
+void CredentialCache::revalidate()
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+		log_errno("clock_gettime(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+	if (now.tv_sec == this->lastCheck) {
+		return;
+	}
+	this->lastCheck = now.tv_sec;
+
+	FileStamp passwd = stampOf(passwd_path);
+	FileStamp group = stampOf(group_path);
+	if (passwd != this->passwdStamp || group != this->groupStamp) {
+		if (this->generation > 0) {
+			log_debug("user or group database has changed");
+		}
+		this->reset();
+		this->passwdStamp = passwd;
+		this->groupStamp = group;
+	}
+}
+
+void CredentialCache::clear()
+{
+	std::lock_guard<std::mutex> guard(this->mutex);
+	this->reset();
+}
+
+void CredentialCache::reset()
+{
+	this->usersByName.clear();
+	this->usersById.clear();
+	this->groupsByName.clear();
+	this->groupsById.clear();
+	this->generation++;
+}
+
+uint64_t CredentialCache::getGeneration()
+{
+	std::lock_guard<std::mutex> guard(this->mutex);
+	this->revalidate();
+	return this->generation;
+}
+
+UserCredentials CredentialCache::getUser(const std::string& name)
+{
+	std::lock_guard<std::mutex> guard(this->mutex);
+	this->revalidate();
+
+	auto it = this->usersByName.find(name);
+	if (it != this->usersByName.end()) {
+		return it->second;
+	}
+
+	errno = 0;
+	struct passwd *pwent = getpwnam(name.c_str());
+	if (pwent == NULL) {
+		int saved_errno = errno;
+		log_error("unable to find user %s", name.c_str());
+		throw_lookup_error(saved_errno);
+	}
+	UserCredentials user = to_user(pwent);
+	this->usersByName[name] = user;
+	return user;
+}
+
+UserCredentials CredentialCache::getUser(uid_t uid)
+{
+	std::lock_guard<std::mutex> guard(this->mutex);
+	this->revalidate();
+
+	auto it = this->usersById.find(uid);
+	if (it != this->usersById.end()) {
+		return it->second;
+	}
+
+	errno = 0;
+	struct passwd *pwent = getpwuid(uid);
+	if (pwent == NULL) {
+		int saved_errno = errno;
+		log_error("unable to find user with uid %u", (unsigned int) uid);
+		throw_lookup_error(saved_errno);
+	}
+	UserCredentials user = to_user(pwent);
+	this->usersById[uid] = user;
+	return user;
+}
+
+GroupCredentials CredentialCache::getGroup(const std::string& name)
+{
+	std::lock_guard<std::mutex> guard(this->mutex);
+	this->revalidate();
+
+	auto it = this->groupsByName.find(name);
+	if (it != this->groupsByName.end()) {
+		return it->second;
+	}
+
+	errno = 0;
+	struct group *grent = getgrnam(name.c_str());
+	if (grent == NULL) {
+		int saved_errno = errno;
+		log_error("unable to find group %s", name.c_str());
+		throw_lookup_error(saved_errno);
+	}
+	GroupCredentials group = to_group(grent);
+	this->groupsByName[name] = group;
+	return group;
+}
+
+GroupCredentials CredentialCache::getGroup(gid_t gid)
+{
+	std::lock_guard<std::mutex> guard(this->mutex);
+	this->revalidate();
+
+	auto it = this->groupsById.find(gid);
+	if (it != this->groupsById.end()) {
+		return it->second;
+	}
+
+	errno = 0;
+	struct group *grent = getgrgid(gid);
+	if (grent == NULL) {
+		int saved_errno = errno;
+		log_error("unable to find group with gid %u", (unsigned int) gid);
+		throw_lookup_error(saved_errno);
+	}
+	GroupCredentials group = to_group(grent);
+	this->groupsById[gid] = group;
+	return group;
+}
+
+}
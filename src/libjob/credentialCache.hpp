@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+extern "C" {
+#include <sys/types.h>
+#include <time.h>
+}
+
+namespace libjob
+{
+
+/** The parts of a passwd(5) entry that jobd cares about */
+struct UserCredentials
+{
+	std::string name;
+	uid_t uid;
+	gid_t gid;
+	std::string home_directory;
+	std::string shell;
+};
+
+/** The parts of a group(5) entry that jobd cares about */
+struct GroupCredentials
+{
+	std::string name;
+	gid_t gid;
+};
+
+/**
+ * A cache of user and group lookups, shared by manifest normalization and
+ * the launching of jobs, so that a large /etc/passwd or a slow NSS backend
+ * is only consulted once for each user or group.
+ *
+ * The whole cache is discarded when /etc/passwd or /etc/group is modified
+ * or replaced. The files are checked with stat(2) at most once per second.
+ */
+class CredentialCache
+{
+public:
+	/** The cache that is shared by everything in this process */
+	static CredentialCache& instance();
+
+	/** Look up a user. Throws std::system_error if there is no such user. */
+	UserCredentials getUser(const std::string& name);
+	UserCredentials getUser(uid_t uid);
+
+	/** Look up a group. Throws std::system_error if there is no such group. */
+	GroupCredentials getGroup(const std::string& name);
+	GroupCredentials getGroup(gid_t gid);
+
+	/**
+	 * A counter that is incremented each time the cache is discarded.
+	 * Anything derived from a lookup is stale once this changes.
+	 */
+	uint64_t getGeneration();
+
+	/** Discard everything that has been looked up so far */
+	void clear();
+
+private:
+	/** Identifies a version of a file, to detect when it has changed */
+	struct FileStamp
+	{
+		dev_t dev = 0;
+		ino_t ino = 0;
+		off_t size = 0;
+		time_t mtime = 0;
+		time_t ctime = 0;
+
+		bool operator!=(const FileStamp& other) const
+		{
+			return dev != other.dev || ino != other.ino || size != other.size
+					|| mtime != other.mtime || ctime != other.ctime;
+		}
+	};
+
+	std::unordered_map<std::string, UserCredentials> usersByName;
+	std::unordered_map<uid_t, UserCredentials> usersById;
+	std::unordered_map<std::string, GroupCredentials> groupsByName;
+	std::unordered_map<gid_t, GroupCredentials> groupsById;
+
+	FileStamp passwdStamp;
+	FileStamp groupStamp;
+
+	/** The monotonic time, in seconds, when the files were last checked */
+	time_t lastCheck = -1;
+
+	uint64_t generation = 0;
+
+	/** Held by every public method, so manifests can be parsed on several threads */
+	std::mutex mutex;
+
+	void revalidate();
+	void reset();
+	static FileStamp stampOf(const char *path);
+};
+}
@@ -16,6 +16,7 @@
 
 #include <iostream>
 #include <system_error>
+#include <utility>
 
 extern "C" {
 	#include <sys/types.h>
@@ -25,7 +26,6 @@ extern "C" {
 #include <sys/file.h>
 #endif
 	#include <sys/un.h>
-	#include <sys/event.h>
 	#include <sys/socket.h>
 #include <unistd.h>
 }
@@ -174,96 +174,156 @@ void ipcServer::create_socket()
         	log_errno("listen(2)");
         	throw std::system_error(errno, std::system_category());
     }
-}
 
-void ipcSession::readRequest() {
-	sa_len = sizeof(server_sa);
-	ssize_t bytes = read(sockfd, &buf, sizeof(buf));
-	if (bytes < 0) {
-		bufsz = 0;
-		log_errno("read(2)");
+	/* Connections are accepted from the event loop, which must never block */
+	int flags = fcntl(sockfd, F_GETFL);
+	if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		log_errno("fcntl(2)");
 		throw std::system_error(errno, std::system_category());
 	}
-	bufsz = bytes;
-	try {
-		request.parse(std::string(buf));
-	} catch (...) {
-		log_error("request parsing failed; buf=%s", buf);
-		throw;
+}
+
+std::unique_ptr<ipcSession> ipcServer::acceptConnection() {
+	struct sockaddr_un client_sa;
+	socklen_t sa_len = sizeof(client_sa);
+
+	int fd = accept(sockfd, (struct sockaddr *)&client_sa, &sa_len);
+	if (fd < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR)
+			return nullptr;
+		log_errno("accept(2)");
+		throw std::system_error(errno, std::system_category());
 	}
+	log_debug("accepted incoming connection on server fd %d, client fd %d",
+		sockfd, fd);
+	return std::unique_ptr<ipcSession>(new ipcSession(fd));
 }
 
-ipcSession ipcServer::acceptConnection() {
-	return ipcSession(sockfd, sa);
+void ipcClient::dispatch(jsonRpcRequest request, jsonRpcResponse& response) {
+	send(request);
+	receive(request.id(), response);
+	if (response.isError())
+		throw std::runtime_error(response.getErrorMessage());
 }
 
-void ipcSession::sendResponse(jsonRpcResponse response) {
-	auto buf = response.dump();
+void ipcClient::send(jsonRpcRequest& request) {
+	request.validate();
+	ipc_write_frame(sockfd, jsonrpc_encode(request.getJSON(), encoding));
+}
 
-	log_debug("sending `%s' to %d", buf.c_str(), sockfd);
-	if (send(sockfd, buf.c_str(), buf.length(), MSG_NOSIGNAL) < 0) {
-		log_errno("sendto(2)");
-		throw std::system_error(errno, std::system_category());
+void ipcClient::receive(unsigned int id, jsonRpcResponse& response) {
+	auto it = early_responses.find(id);
+	if (it != early_responses.end()) {
+		response = std::move(it->second);
+		early_responses.erase(it);
+		return;
+	}
+
+	/* Keep the responses to other requests until they are asked for */
+	std::string buf;
+	for (;;) {
+		frames.read(sockfd, buf);
+		json j = jsonrpc_decode(buf, encoding);
+		if (j.count("method") > 0) {
+			early_events.push_back(std::move(j));
+			continue;
+		}
+
+		jsonRpcResponse candidate(std::move(j));
+		if (!candidate.hasId()) {
+			log_error("response without an id: %s", candidate.dump().c_str());
+			throw std::runtime_error(candidate.isError() ? candidate.getErrorMessage() : "invalid response");
+		}
+		if (candidate.id() == id) {
+			response = std::move(candidate);
+			return;
+		}
+		early_responses[candidate.id()] = std::move(candidate);
 	}
 }
 
-void ipcSession::close() {
-	if (sockfd >= 0) {
-		log_debug("closing socket %d", sockfd);
-		(void) ::close(sockfd);
-		sockfd = -1;
-	} else {
-		log_warning("unnecessary call - socket is already closed");
+void ipcClient::dispatch(jsonRpcBatch& batch) {
+	ipc_write_frame(sockfd, batch.dump(encoding));
+	if (!batch.expectsResponse())
+		return;
+
+	/* The batch is answered with an array; anything else is an earlier response */
+	std::string buf;
+	for (;;) {
+		frames.read(sockfd, buf);
+		json j = jsonrpc_decode(buf, encoding);
+		if (j.is_array()) {
+			batch.setResponses(std::move(j));
+			return;
+		}
+		if (j.count("method") > 0) {
+			early_events.push_back(std::move(j));
+			continue;
+		}
+
+		jsonRpcResponse response(std::move(j));
+		if (!response.hasId()) {
+			log_error("response without an id: %s", response.dump().c_str());
+			throw std::runtime_error(response.isError() ? response.getErrorMessage() : "invalid response");
+		}
+		early_responses[response.id()] = std::move(response);
 	}
 }
 
-void ipcClient::dispatch(jsonRpcRequest request, jsonRpcResponse& response) {
-	request.validate();
-	std::string bufstr = request.dump();
-	if (send(sockfd, bufstr.c_str(), bufstr.length() + 1, MSG_NOSIGNAL) < 0)
-		throw std::system_error(errno, std::system_category());
+void ipcClient::subscribe(const std::vector<std::string>& prefixes) {
+	jsonRpcRequest request;
+	jsonRpcResponse response;
 
-	char cbuf[9999]; // XXX-HORRIBLE HARDCODED BUFFER SIZE
-	ssize_t bytes = read(sockfd, &cbuf, sizeof(cbuf));
-	if (bytes <= 0 || bytes >= (ssize_t)sizeof(cbuf))
-		throw std::system_error(errno, std::system_category());
-	cbuf[bytes] = '\0';
-	json j = json::parse(string(cbuf));
-	//TODO: look at the validity of the response
-	response.setResult(j["result"]);
+	request.setId(next_id++);
+	request.setMethod("subscribe");
+	for (auto& prefix : prefixes) {
+		request.addParam(prefix);
+	}
+	dispatch(request, response);
 }
 
-ipcSession::ipcSession(int server_fd, struct sockaddr_un sa) {
-	socklen_t sa_len = sizeof(sa);
-        server_sa = sa;
-        sockfd = accept(server_fd, (struct sockaddr *)&client_sa, &sa_len);
-        if (sockfd < 0) {
-        	log_errno("accept(2)");
-                throw std::system_error(errno, std::system_category());
-        }
-
-#ifdef SO_NOSIGPIPE
-	int flags = 1;
-	if (setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &flags, sizeof(flags)) < 0) {
-        	log_errno("setsockopt(2)");
-                throw std::system_error(errno, std::system_category());
-        }
-#endif
+void ipcClient::readEvent(json& notification) {
+	if (!early_events.empty()) {
+		notification = std::move(early_events.front());
+		early_events.pop_front();
+		return;
+	}
+
+	/* A response that arrives first is kept for receive() */
+	std::string buf;
+	for (;;) {
+		frames.read(sockfd, buf);
+		json j = jsonrpc_decode(buf, encoding);
+		if (j.count("method") > 0) {
+			notification = std::move(j);
+			return;
+		}
 
-        log_debug("accepted incoming connection on server fd %d, client fd %d",
-        	server_fd, sockfd);
+		jsonRpcResponse response(std::move(j));
+		if (response.hasId()) {
+			early_responses[response.id()] = std::move(response);
+		} else {
+			log_error("unexpected message: %s", response.dump().c_str());
+		}
+	}
 }
 
-ipcSession::~ipcSession() {
-	log_debug("closing session");
-	if (sockfd >= 0)
-		(void) ::close(sockfd);
+void ipcClient::setEncoding(jsonRpcEncoding next) {
+	jsonRpcRequest request;
+	jsonRpcResponse response;
+
+	request.setId(next_id++);
+	request.setMethod("setEncoding");
+	request.addParam(jsonrpc_encoding_name(next));
+	dispatch(request, response);
+	encoding = next;
 }
 
 void ipcServer::fork_handler()
 {
 	if (sockfd >= 0)
 		(void) close(sockfd);
+	sockfd = -1;
 	socket_path = "";
 }
 
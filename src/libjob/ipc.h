@@ -16,6 +16,9 @@
 
 #pragma once
 
+#include <deque>
+#include <map>
+#include <memory>
 #include <string>
 #include "parser.hpp"
 
@@ -25,6 +28,8 @@ extern "C" {
 #include <sys/un.h>
 }
 
+#include "ipcFrame.hpp"
+#include "ipcSession.hpp"
 #include "jsonRPC.hpp"
 #include "job.h"
 
@@ -32,29 +37,10 @@ namespace libjob {
 
 	using json = nlohmann::json;
 
-	class ipcSession {
-	public:
-		void readRequest();
-		void sendResponse(jsonRpcResponse response);
-		void close();
-		jsonRpcRequest getRequest() { return this->request; }
-		jsonRpcResponse getResponse() { return this->response; }
-		ipcSession(int server_fd, struct sockaddr_un sa);
-		~ipcSession();
-
-	private:
-		char buf[9999]; // FIXME: hardcoded
-		size_t bufsz = 0;
-		jsonRpcRequest request;
-		jsonRpcResponse response;
-	        struct sockaddr_un server_sa, client_sa;
-	        socklen_t sa_len;
-		int sockfd = -1;
-	};
-
 	class ipcServer {
 	public:
-		ipcSession acceptConnection();
+		/** Accept a pending connection, or return nullptr if there is none */
+		std::unique_ptr<ipcSession> acceptConnection();
 		ipcServer(std::string path);
 		~ipcServer();
 		int get_sockfd() { return this->sockfd; }
@@ -72,7 +58,44 @@ namespace libjob {
 
 	class ipcClient {
 	public:
+		/** Send a request and wait for its response */
 		void dispatch(jsonRpcRequest request, jsonRpcResponse& response);
+
+		/**
+		 * Send a request without waiting for the response, so that
+		 * several requests can be in flight on the same connection.
+		 */
+		void send(jsonRpcRequest& request);
+
+		/** Wait for the response to the request with the given id */
+		void receive(unsigned int id, jsonRpcResponse& response);
+
+		/**
+		 * Send a batch of requests and wait for the responses, which are
+		 * stored in the batch. Unlike dispatch(), a failed request does
+		 * not throw an exception; check each response instead.
+		 */
+		void dispatch(jsonRpcBatch& batch);
+
+		/**
+		 * Ask jobd to send an event whenever the state of a job changes,
+		 * for the jobs whose label starts with one of @prefixes, or for
+		 * every job if there are none.
+		 */
+		void subscribe(const std::vector<std::string>& prefixes);
+
+		/**
+		 * Wait for the next notification from jobd, such as a "jobEvent"
+		 * after subscribe() has been called.
+		 */
+		void readEvent(json& notification);
+
+		/**
+		 * Ask jobd to use another encoding for the rest of the connection.
+		 * Throws an exception if jobd does not support it.
+		 */
+		void setEncoding(jsonRpcEncoding encoding);
+
 		int get_sockfd() { return this->sockfd; }
 		ipcClient();
 		~ipcClient();
@@ -81,6 +104,12 @@ namespace libjob {
 		libjob::jobdConfig jobd_config;
 		void create_socket();
 		int sockfd = -1;
+		ipcFrameBuffer frames;
+		std::map<unsigned int, jsonRpcResponse> early_responses;
+		std::deque<json> early_events;
+		jsonRpcEncoding encoding = JSONRPC_ENCODING_JSON;
+		/* Ids for the requests the client makes itself, out of the way of the caller's */
+		unsigned int next_id = 0x80000000;
 		void bootstrapJobDaemon();
 	};
 }
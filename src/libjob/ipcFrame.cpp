@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
+#include "ipcFrame.hpp"
+#include "logger.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace libjob {
+
+static const size_t header_size = sizeof(uint32_t);
+
+/* The smallest read(2) we ask for, so small frames are read in one call */
+static const size_t min_read_size = 64 * 1024;
+
+/* An empty buffer larger than this is released rather than kept for reuse */
+static const size_t max_idle_capacity = 4 * 1024 * 1024;
+
+static uint32_t frame_length(const char *header)
+{
+	uint32_t len;
+
+	memcpy(&len, header, sizeof(len));
+	return ntohl(len);
+}
+
+size_t ipcFrameBuffer::wanted() const
+{
+	size_t avail = end - start;
+
+	if (avail < header_size)
+		return header_size - avail;
+
+	size_t len = frame_length(&buf[start]);
+	if (len > max_frame) {
+		log_error("frame of %zu bytes exceeds the limit of %u bytes",
+				len, max_frame);
+		throw std::runtime_error("IPC frame too large");
+	}
+	return (header_size + len > avail) ? header_size + len - avail : 0;
+}
+
+ssize_t ipcFrameBuffer::fill(int fd)
+{
+	size_t need = wanted();
+
+	/* Move a partial frame to the front rather than growing behind it */
+	if (start > 0) {
+		if (end > start)
+			memmove(&buf[0], &buf[start], end - start);
+		end -= start;
+		start = 0;
+	}
+	if (need < min_read_size)
+		need = min_read_size;
+
+	/*
+	 * Grow no more than twice over per call, so that the memory held for
+	 * a frame is proportional to the data that has actually arrived, not
+	 * to the length that the peer claims it is going to send.
+	 */
+	if (buf.size() - end < need)
+		buf.resize(std::min(end + need, std::max(2 * buf.size(), min_read_size)));
+
+	for (;;) {
+		ssize_t bytes = ::read(fd, &buf[end], buf.size() - end);
+		if (bytes >= 0) {
+			end += bytes;
+			return bytes;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -1;
+		log_errno("read(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+}
+
+bool ipcFrameBuffer::next(std::string& message)
+{
+	if (end - start < header_size || wanted() > 0)
+		return false;
+
+	size_t len = frame_length(&buf[start]);
+	message.assign(&buf[start + header_size], len);
+	start += header_size + len;
+	if (start == end) {
+		start = end = 0;
+		if (buf.size() > max_idle_capacity)
+			std::vector<char>().swap(buf);
+	}
+	return true;
+}
+
+void ipcFrameBuffer::read(int fd, std::string& message)
+{
+	while (!next(message)) {
+		ssize_t bytes = fill(fd);
+		if (bytes == 0) {
+			log_error("connection closed %s", partial() ? "in the middle of a message" : "before a message was received");
+			throw std::runtime_error("unexpected end of file on IPC socket");
+		}
+		if (bytes < 0)
+			throw std::logic_error("read() called on a non-blocking socket");
+	}
+}
+
+std::string ipc_frame(const std::string& message)
+{
+	if (message.size() > ipcMaxFrameSize)
+		throw std::length_error("IPC message too large");
+
+	uint32_t len = htonl(message.size());
+	std::string frame;
+	frame.reserve(header_size + message.size());
+	frame.append((const char *) &len, sizeof(len));
+	frame.append(message);
+	return frame;
+}
+
+void ipc_write_frame(int fd, const std::string& message)
+{
+	if (message.size() > ipcMaxFrameSize)
+		throw std::length_error("IPC message too large");
+
+	uint32_t len = htonl(message.size());
+	struct iovec iov[2];
+	iov[0].iov_base = &len;
+	iov[0].iov_len = sizeof(len);
+	iov[1].iov_base = (void *) message.data();
+	iov[1].iov_len = message.size();
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	/* Partial writes are normal for large messages; resume where they stopped */
+	while (msg.msg_iovlen > 0) {
+		ssize_t bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			log_errno("sendmsg(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+		while (msg.msg_iovlen > 0 && (size_t) bytes >= msg.msg_iov->iov_len) {
+			bytes -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + bytes;
+			msg.msg_iov->iov_len -= bytes;
+		}
+	}
+}
+
+}
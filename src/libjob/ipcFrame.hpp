@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+namespace libjob {
+
+	/**
+	 * Messages on the IPC socket are framed as a 4-byte length in network
+	 * byte order, followed by that many bytes of JSON text. Frames larger
+	 * than this are treated as a protocol error rather than an allocation
+	 * request.
+	 */
+	static const uint32_t ipcMaxFrameSize = 1024 * 1024 * 1024;
+
+	/**
+	 * The largest request that jobd accepts from a client. Responses, such
+	 * as the list of every job, can be much larger than any request.
+	 */
+	static const uint32_t ipcMaxRequestSize = 16 * 1024 * 1024;
+
+	/**
+	 * A growable receive buffer that splits a byte stream into frames.
+	 * The storage is reused across messages. It grows as the data of a
+	 * frame arrives, rather than to the length announced in the header,
+	 * and is released again once a large frame has been taken out.
+	 */
+	class ipcFrameBuffer {
+	public:
+		/** Frames longer than @max_frame are treated as a protocol error */
+		explicit ipcFrameBuffer(uint32_t max_frame = ipcMaxFrameSize)
+			: max_frame(max_frame) {}
+
+		/**
+		 * Read whatever is available on a socket into the buffer.
+		 *
+		 * @return the number of bytes read, 0 at end of file, or -1 if
+		 *   the socket is non-blocking and has nothing to read
+		 */
+		ssize_t fill(int fd);
+
+		/** Remove the next complete frame from the buffer, if there is one */
+		bool next(std::string& message);
+
+		/** Block until a complete frame has been read from a socket */
+		void read(int fd, std::string& message);
+
+		/** True if part of a frame has been received */
+		bool partial() const { return end > start; }
+
+		size_t capacity() const { return buf.size(); }
+
+	private:
+		std::vector<char> buf;
+		size_t start = 0, end = 0;
+		uint32_t max_frame;
+
+		/** The number of bytes needed to complete the current frame */
+		size_t wanted() const;
+	};
+
+	/** Write a message to a blocking socket as a single frame */
+	void ipc_write_frame(int fd, const std::string& message);
+
+	/** Build a frame for a message, for callers that queue their writes */
+	std::string ipc_frame(const std::string& message);
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <system_error>
+#include <utility>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include "ipcSession.hpp"
+#include "logger.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace libjob {
+
+ipcSession::ipcSession(int sockfd)
+	: frames(ipcMaxRequestSize), sockfd(sockfd)
+{
+	try {
+		configure();
+	} catch (...) {
+		(void) ::close(sockfd);
+		this->sockfd = -1;
+		throw;
+	}
+}
+
+void ipcSession::configure()
+{
+	int flags = fcntl(sockfd, F_GETFL);
+	if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		log_errno("fcntl(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+
+	/* Do not leak the connection into jobs */
+	if (fcntl(sockfd, F_SETFD, FD_CLOEXEC) < 0) {
+		log_errno("fcntl(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) < 0) {
+		log_errno("setsockopt(2)");
+		throw std::system_error(errno, std::system_category());
+	}
+#endif
+}
+
+ipcSession::ipcSession(ipcSession&& other)
+	: frames(std::move(other.frames)),
+	  output(std::move(other.output)),
+	  output_offset(other.output_offset),
+	  sockfd(other.sockfd),
+	  encoding(other.encoding),
+	  next_encoding(other.next_encoding)
+{
+	/* The moved-from session must not close the descriptor */
+	other.sockfd = -1;
+}
+
+ipcSession::~ipcSession()
+{
+	if (sockfd >= 0)
+		(void) ::close(sockfd);
+}
+
+bool ipcSession::fill()
+{
+	return frames.fill(sockfd) != 0;
+}
+
+bool ipcSession::nextRequest(jsonRpcBatch& batch)
+{
+	std::string buf;
+
+	if (!frames.next(buf))
+		return false;
+	try {
+		batch.parse(buf, encoding);
+	} catch (...) {
+		if (encoding == JSONRPC_ENCODING_JSON)
+			log_error("request parsing failed; buf=%s", buf.c_str());
+		else
+			log_error("request parsing failed; %zu bytes of %s", buf.size(), jsonrpc_encoding_name(encoding).c_str());
+		throw;
+	}
+	return true;
+}
+
+void ipcSession::queueResponse(const jsonRpcBatch& batch)
+{
+	std::string buf = batch.dumpResponses(encoding);
+
+	encoding = next_encoding;
+
+	/* Notifications do not get a response */
+	if (!buf.empty())
+		appendFrame(buf);
+}
+
+void ipcSession::queueMessage(const json& message)
+{
+	appendFrame(jsonrpc_encode(message, encoding));
+}
+
+void ipcSession::appendFrame(const std::string& buf)
+{
+	/* Drop the part that has already been sent, rather than growing forever */
+	if (output_offset > 0) {
+		output.erase(0, output_offset);
+		output_offset = 0;
+	}
+	output.append(ipc_frame(buf));
+}
+
+bool ipcSession::flush()
+{
+	while (output_offset < output.size()) {
+		ssize_t bytes = send(sockfd, output.data() + output_offset,
+				output.size() - output_offset, MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
+			log_errno("send(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+		output_offset += bytes;
+	}
+	output.clear();
+	output_offset = 0;
+	return true;
+}
+
+void ipcSession::close()
+{
+	if (sockfd >= 0) {
+		log_debug("closing socket %d", sockfd);
+		(void) ::close(sockfd);
+		sockfd = -1;
+	} else {
+		log_warning("unnecessary call - socket is already closed");
+	}
+}
+
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <string>
+
+#include "ipcFrame.hpp"
+#include "jsonRPC.hpp"
+
+namespace libjob {
+
+	/**
+	 * The server side of a connection to the IPC socket.
+	 *
+	 * A session is non-blocking, and lives for as long as the client keeps
+	 * the connection open, so one connection can carry any number of
+	 * requests. The client may send requests without waiting for the
+	 * responses; they are answered in order, and each response has the
+	 * id of its request.
+	 */
+	class ipcSession {
+	public:
+		/** Take ownership of a descriptor returned by accept(2) */
+		explicit ipcSession(int sockfd);
+		ipcSession(ipcSession&& other);
+		ipcSession(const ipcSession&) = delete;
+		ipcSession& operator=(const ipcSession&) = delete;
+		~ipcSession();
+
+		/**
+		 * Read whatever the client has sent so far.
+		 *
+		 * @return false if the client has closed the connection
+		 */
+		bool fill();
+
+		/**
+		 * Take the next complete message, if there is one. A message is
+		 * either one request or a batch of them.
+		 */
+		bool nextRequest(jsonRpcBatch& batch);
+
+		/** Queue the responses to a message to be written by flush() */
+		void queueResponse(const jsonRpcBatch& batch);
+
+		/** Queue a message that is not a response, such as a notification */
+		void queueMessage(const json& message);
+
+		/**
+		 * Write as much of the queued output as the socket will take.
+		 *
+		 * @return true if all of the output has been written
+		 */
+		bool flush();
+
+		bool hasPendingOutput() const { return output_offset < output.size(); }
+
+		jsonRpcEncoding getEncoding() const { return encoding; }
+
+		/**
+		 * Switch to another encoding once the responses to the current
+		 * message have been queued, so that the client can read the
+		 * reply to its "setEncoding" request in the encoding it used.
+		 */
+		void setEncodingAfterResponse(jsonRpcEncoding next) { next_encoding = next; }
+
+		int get_sockfd() const { return this->sockfd; }
+		void close();
+
+	private:
+		ipcFrameBuffer frames;
+		std::string output;
+		size_t output_offset = 0;
+		int sockfd = -1;
+		jsonRpcEncoding encoding = JSONRPC_ENCODING_JSON;
+		jsonRpcEncoding next_encoding = JSONRPC_ENCODING_JSON;
+
+		/** Make the socket non-blocking and close-on-exec */
+		void configure();
+
+		void appendFrame(const std::string& buf);
+	};
+}
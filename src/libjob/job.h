@@ -50,6 +50,14 @@ public:
 		return socketPath;
 	}
 
+	const std::string getStatusTablePath() const {
+		return statusTablePath;
+	}
+
+	const std::string getManifestCachePath() const {
+		return (dataDir + "/manifest.cache");
+	}
+
 	const std::string getVersion() const {
 		return version;
 	}
@@ -70,6 +78,9 @@ public:
 		/** The path to the pidfile */
 		std::string pidfilePath;
 
+		/** The path to the memory-mapped table of job status */
+		std::string statusTablePath;
+
 		// Tell jobd to reload it's configuration
 		void signal_jobd_reload();
 
@@ -15,7 +15,6 @@
  */
 
 #include <fstream>
-#include <iostream>
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -29,9 +28,31 @@ namespace libjob
 
 std::string JobProperty::dataDir = "";
 
+/* Never destroyed; see JobStatus::getJournal() */
+Journal& JobProperty::getJournal()
+{
+	static Journal* journal = new Journal();
+	return *journal;
+}
+
 void JobProperty::readFile()
 {
-	if (access(this->path.c_str(), F_OK) < 0) {
+	std::string buf;
+
+	if (getJournal().take(this->label, buf)) {
+		try {
+			this->json = nlohmann::json::parse(buf);
+		} catch (std::exception& e) {
+			log_error("error parsing the properties of %s: %s", this->label.c_str(), e.what());
+			throw;
+		}
+		log_debug("loaded properties of %s from the journal", this->label.c_str());
+		return;
+	}
+
+	/* Older versions of jobd kept the properties of each job in a separate file */
+	std::string path = JobProperty::dataDir + "/" + this->label + ".json";
+	if (access(path.c_str(), F_OK) < 0) {
 		if (errno == ENOENT) {
 			return;
 		} else {
@@ -41,35 +62,36 @@ void JobProperty::readFile()
 	}
 
 	try {
-		std::ifstream ifs(this->path, std::ifstream::in);
+		std::ifstream ifs(path, std::ifstream::in);
 		ifs >> this->json;
 	} catch (std::exception& e) {
-		log_error("error parsing %s: %s", this->path.c_str(), e.what());
+		log_error("error parsing %s: %s", path.c_str(), e.what());
 		throw;
 	}
-	log_debug("loaded properties from %s", this->path.c_str());
+	log_debug("loaded properties from %s", path.c_str());
+
+	/* Move them into the journal the next time the job is committed */
+	this->dirty = true;
 }
 
 void JobProperty::sync()
 {
-	try {
-		std::ofstream ofs(this->path, std::ofstream::out);
-		ofs << this->json;
-	} catch (std::exception& e) {
-		log_error("error writing to %s: %s", path.c_str(), e.what());
-		throw;
-	}
+	getJournal().put(this->label, this->json.dump());
+	this->writeCount++;
 }
 
 void JobProperty::setDataDirectory(std::string& path)
 {
 	JobProperty::dataDir = path;
 	(void) mkdir(path.c_str(), 0755);
+	getJournal().open(path);
 }
 
 void JobProperty::unloadHandler()
 {
-	(void) unlink(path.c_str()); // TODO: error checking
+	this->dirty = false;
+	getJournal().erase(this->label);
+	(void) unlink((JobProperty::dataDir + "/" + this->label + ".json").c_str());
 }
 
 }
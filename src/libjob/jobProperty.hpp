@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <string>
 
+#include "journal.hpp"
 #include "parser.hpp"
 
 namespace libjob
@@ -57,11 +58,24 @@ public:
 
 	~JobProperty() {}
 
+	/** Choose when the property journal is synced. Call this before setDataDirectory(). */
+	static void setSyncPolicy(journal_sync_t policy) { getJournal().setSyncPolicy(policy); }
+
+	/** Open the property journal in @path, and replay it */
 	static void setDataDirectory(std::string& path);
 
+	/** Write the records committed since the last flush to the property journal */
+	static void flushJournal() { getJournal().flush(); }
+
+	/** The number of times the property journal has been synced */
+	static unsigned long getSyncCount() { return getJournal().getSyncCount(); }
+
+	/** Flush and close the property journal */
+	static void closeJournal() { getJournal().close(); }
+
 	void setLabel(const std::string& label) {
 		this->json["Label"] = label;
-		this->path = JobProperty::dataDir + "/" + label + ".json";
+		this->label = label;
 		this->readFile();
 	}
 
@@ -73,7 +87,12 @@ public:
 	void setEnabled(bool enabled = false)
 	{
 		this->json["Enabled"] = enabled;
-		this->sync();
+		this->dirty = true;
+	}
+
+	e_fault_state getFaultState() const
+	{
+		return static_cast<e_fault_state>(this->json["FaultState"].get<int>());
 	}
 
 	bool isFaulted() const
@@ -85,7 +104,7 @@ public:
 	{
 		this->json["FaultState"] = state;
 		this->json["FaultMessage"] = message;
-		this->sync();
+		this->dirty = true;
 	}
 
 	const std::string getFaultStateString() const
@@ -98,12 +117,30 @@ public:
 		return fault_state_as_string[this->json["FaultState"].get<int>()];
 	}
 
+	/** True if there are changes that have not been written out by commit() */
+	bool isDirty() const { return this->dirty; }
+
+	/** Append the properties to the journal if anything has changed since the last commit */
+	void commit()
+	{
+		if (this->dirty) {
+			this->sync();
+			this->dirty = false;
+		}
+	}
+
+	/** The number of times the properties have been appended to the journal */
+	unsigned long getWriteCount() const { return this->writeCount; }
+
 	void unloadHandler();
 
 private:
 	static std::string dataDir;
-	std::string path;
+	static Journal& getJournal();
+	std::string label;
 	nlohmann::json json;
+	bool dirty = false;
+	unsigned long writeCount = 0;
 
 	void sync();
 	void readFile();
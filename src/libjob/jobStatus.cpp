@@ -14,9 +14,6 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <fstream>
-#include <iostream>
-
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -27,39 +24,55 @@
 namespace libjob
 {
 
-std::string JobStatus::runtimeDir = "";
+/*
+ * The journal is never destroyed, because the JobManager commits the state
+ * of every job from its own destructor, and the order in which static
+ * objects in different translation units are destroyed is unspecified.
+ */
+Journal& JobStatus::getJournal()
+{
+	static Journal* journal = new Journal();
+	return *journal;
+}
 
 void JobStatus::readFile()
 {
+	std::string buf;
+
+	if (!getJournal().take(this->label, buf)) {
+		return;
+	}
+
+	/*
+	 * Only the exit status of the last run is carried over. The process
+	 * in the Pid field belonged to a previous instance of jobd, and has
+	 * either exited or been orphaned.
+	 */
 	try {
-		std::ifstream ifs(this->path, std::ifstream::in);
-		ifs >> this->json;
+		nlohmann::json j = nlohmann::json::parse(buf);
+		this->json["LastExitStatus"] = j["LastExitStatus"];
+		this->json["TermSignal"] = j["TermSignal"];
 	} catch (std::exception& e) {
-		log_error("error parsing %s: %s", this->path.c_str(), e.what());
-		throw;
+		log_error("error parsing the status of %s: %s", this->label.c_str(), e.what());
 	}
 }
 
 void JobStatus::sync()
 {
-	try {
-		std::ofstream ofs(this->path, std::ofstream::out);
-		ofs << this->json;
-	} catch (std::exception& e) {
-		log_error("error writing to %s: %s", path.c_str(), e.what());
-		throw;
-	}
+	getJournal().put(this->label, this->json.dump());
+	this->writeCount++;
 }
 
 void JobStatus::setRuntimeDirectory(std::string& path)
 {
-	JobStatus::runtimeDir = path;
 	(void) mkdir(path.c_str(), 0755);
+	getJournal().open(path);
 }
 
 void JobStatus::unloadHandler()
 {
-	(void) unlink(path.c_str()); //TODO: log errors
+	this->dirty = false;
+	getJournal().erase(this->label);
 }
 
 }
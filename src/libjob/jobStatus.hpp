@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <string>
 
+#include "journal.hpp"
 #include "parser.hpp"
 
 namespace libjob
@@ -43,13 +44,24 @@ public:
 	~JobStatus() {}
 
 	pid_t getPid() const { return this->json["Pid"].get<unsigned int>(); }
-	void setPid(pid_t pid) { this->json["Pid"] = pid; }
+	void setPid(pid_t pid)
+	{
+		this->json["Pid"] = pid;
+		this->dirty = true;
+	}
+	/** Open the status journal in @path, and replay it */
 	static void setRuntimeDirectory(std::string& path);
+
+	/** Write the records committed since the last flush to the status journal */
+	static void flushJournal() { getJournal().flush(); }
+
+	/** Flush and close the status journal */
+	static void closeJournal() { getJournal().close(); }
+
 	void setLabel(const std::string& label) {
 		this->json["Label"] = label;
-		this->path = JobStatus::runtimeDir + "/" + label + ".json";
-		//FIXME: definitely not accurate yet: this->readFile();
-		//TODO: verify the status is still accurate, the process might not exist anymore
+		this->label = label;
+		this->readFile();
 	}
 
 	int getLastExitStatus() const
@@ -60,26 +72,47 @@ public:
 	void setLastExitStatus(int lastExitStatus)
 	{
 		this->json["LastExitStatus"] = lastExitStatus;
-		this->sync();
+		this->dirty = true;
 	}
 
 	int getTermSignal() const
 	{
-		return this->json["LastExitStatus"].get<unsigned int>();
+		return this->json["TermSignal"].get<unsigned int>();
 	}
 
 	void setTermSignal(int termSignal)
 	{
 		this->json["TermSignal"] = termSignal;
-		this->sync();
+		this->dirty = true;
 	}
 
+	/** True if there are changes that have not been written out by commit() */
+	bool isDirty() const { return this->dirty; }
+
+	/**
+	 * Append the status to the journal if anything has changed since the
+	 * last commit. The setters only modify the in-memory copy, so a batch
+	 * of changes costs a single record.
+	 */
+	void commit()
+	{
+		if (this->dirty) {
+			this->sync();
+			this->dirty = false;
+		}
+	}
+
+	/** The number of times the status has been appended to the journal */
+	unsigned long getWriteCount() const { return this->writeCount; }
+
 	void unloadHandler();
 
 private:
-	static std::string runtimeDir;
-	std::string path;
+	static Journal& getJournal();
+	std::string label;
 	nlohmann::json json;
+	bool dirty = false;
+	unsigned long writeCount = 0;
 	void readFile();
 	void sync();
 };
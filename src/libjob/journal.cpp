@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <cstring>
+#include <system_error>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "journal.hpp"
+#include "logger.h"
+
+namespace libjob
+{
+
+enum {
+	JOURNAL_OP_PUT = 1,
+	JOURNAL_OP_ERASE = 2,
+};
+
+/* Precedes the body of each record. The body is the op, the length of the key, the key, and the value */
+struct journal_record_header {
+	uint32_t length;
+	uint32_t checksum;
+};
+
+static const size_t body_overhead = sizeof(uint8_t) + sizeof(uint32_t);
+
+static std::vector<uint32_t> make_crc32_table()
+{
+	std::vector<uint32_t> table(256);
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		table[i] = c;
+	}
+	return table;
+}
+
+static uint32_t crc32(const char *data, size_t len)
+{
+	static const std::vector<uint32_t> table = make_crc32_table();
+	uint32_t c = 0xffffffff;
+
+	for (size_t i = 0; i < len; i++) {
+		c = table[(c ^ (uint8_t) data[i]) & 0xff] ^ (c >> 8);
+	}
+	return c ^ 0xffffffff;
+}
+
+static void encode_record(std::vector<char>& buf, uint8_t op, const std::string& key, const std::string& value)
+{
+	struct journal_record_header hdr;
+	uint32_t key_length = key.size();
+	size_t offset = buf.size();
+
+	hdr.length = body_overhead + key.size() + value.size();
+	buf.resize(offset + sizeof(hdr) + hdr.length);
+
+	char *body = buf.data() + offset + sizeof(hdr);
+	body[0] = op;
+	memcpy(body + sizeof(uint8_t), &key_length, sizeof(key_length));
+	memcpy(body + body_overhead, key.data(), key.size());
+	memcpy(body + body_overhead + key.size(), value.data(), value.size());
+
+	hdr.checksum = crc32(body, hdr.length);
+	memcpy(buf.data() + offset, &hdr, sizeof(hdr));
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_errno("write(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Force the contents of a file to stable storage */
+static int sync_file(int fd)
+{
+#ifdef __linux__
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+/* Force the entries in a directory to stable storage, after a file was created or renamed */
+static void sync_directory(const std::string& path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno("open(2) of %s", path.c_str());
+		return;
+	}
+	if (fsync(fd) < 0) {
+		log_errno("fsync(2) of %s", path.c_str());
+	}
+	(void) ::close(fd);
+}
+
+static bool file_exists(const std::string& path)
+{
+	return access(path.c_str(), F_OK) == 0;
+}
+
+Journal::~Journal()
+{
+	try {
+		this->close();
+	} catch (const std::exception& e) {
+		log_error("error closing journal in %s: %s", directory.c_str(), e.what());
+	}
+}
+
+/*
+ * Read the records in @path into @records. Returns the number of bytes
+ * that were valid; anything after that was torn by a crash.
+ */
+size_t Journal::replayFile(const std::string& path, record_map_t& records)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		log_errno("open(2) of %s", path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		log_errno("fstat(2)");
+		(void) ::close(fd);
+		throw std::system_error(errno, std::system_category());
+	}
+
+	std::vector<char> buf(sb.st_size);
+	size_t len = 0;
+	while (len < buf.size()) {
+		ssize_t n = read(fd, buf.data() + len, buf.size() - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			log_errno("read(2) of %s", path.c_str());
+			(void) ::close(fd);
+			throw std::system_error(errno, std::system_category());
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	(void) ::close(fd);
+
+	size_t offset = 0;
+	while (offset + sizeof(journal_record_header) <= len) {
+		struct journal_record_header hdr;
+		memcpy(&hdr, buf.data() + offset, sizeof(hdr));
+		if (hdr.length < body_overhead || hdr.length > len - offset - sizeof(hdr))
+			break;
+
+		const char *body = buf.data() + offset + sizeof(hdr);
+		if (crc32(body, hdr.length) != hdr.checksum)
+			break;
+
+		uint32_t key_length;
+		memcpy(&key_length, body + sizeof(uint8_t), sizeof(key_length));
+		if (key_length > hdr.length - body_overhead)
+			break;
+
+		std::string key(body + body_overhead, key_length);
+		if (body[0] == JOURNAL_OP_PUT) {
+			size_t value_offset = body_overhead + key_length;
+			records[key] = std::string(body + value_offset, hdr.length - value_offset);
+		} else if (body[0] == JOURNAL_OP_ERASE) {
+			records.erase(key);
+		} else {
+			break;
+		}
+		offset += sizeof(hdr) + hdr.length;
+	}
+
+	if (offset < len) {
+		log_warning("ignoring %zu bytes of damaged records at the end of %s",
+				len - offset, path.c_str());
+	}
+	return offset;
+}
+
+size_t Journal::writeSnapshot(const std::string& path, const record_map_t& records)
+{
+	std::string tmp_path = path + ".tmp";
+	std::vector<char> buf;
+
+	for (auto& it : records) {
+		encode_record(buf, JOURNAL_OP_PUT, it.first, it.second);
+	}
+
+	int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_errno("open(2) of %s", tmp_path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	try {
+		write_all(fd, buf.data(), buf.size());
+	} catch (...) {
+		(void) ::close(fd);
+		throw;
+	}
+	if (fsync(fd) < 0 || ::close(fd) < 0) {
+		log_errno("unable to save %s", tmp_path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+		log_errno("rename(2) of %s", tmp_path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	sync_directory(path.substr(0, path.rfind('/')));
+	return buf.size();
+}
+
+void Journal::openJournalFile()
+{
+	std::string path = getPath("journal");
+
+	this->fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (this->fd < 0) {
+		log_errno("open(2) of %s", path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	if (this->syncPolicy != JOURNAL_SYNC_NONE) {
+		sync_directory(this->directory);
+	}
+}
+
+bool Journal::parseSyncPolicy(const std::string& name, journal_sync_t& policy)
+{
+	if (name == "none") {
+		policy = JOURNAL_SYNC_NONE;
+	} else if (name == "batch") {
+		policy = JOURNAL_SYNC_BATCH;
+	} else if (name == "write") {
+		policy = JOURNAL_SYNC_WRITE;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void Journal::open(const std::string& directory)
+{
+	if (this->isOpen()) {
+		this->close();
+	}
+	this->directory = directory;
+	this->replayed.clear();
+	this->buffer.clear();
+
+	struct stat sb;
+	if (stat(getPath("snapshot").c_str(), &sb) == 0) {
+		this->snapshotSize = sb.st_size;
+	} else {
+		this->snapshotSize = 0;
+	}
+	replayFile(getPath("snapshot"), this->replayed);
+	replayFile(getPath("journal.old"), this->replayed);
+	this->journalSize = replayFile(getPath("journal"), this->replayed);
+
+	this->openJournalFile();
+	if (fstat(this->fd, &sb) == 0 && (size_t) sb.st_size > this->journalSize) {
+		if (ftruncate(this->fd, this->journalSize) < 0) {
+			log_errno("ftruncate(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+	}
+	log_debug("replayed %zu records from %s", this->replayed.size(), directory.c_str());
+
+	/* Finish a compaction that was interrupted */
+	if (file_exists(getPath("journal.old"))) {
+		this->compact();
+	}
+}
+
+void Journal::close()
+{
+	if (!this->isOpen()) {
+		return;
+	}
+	this->flush();
+	this->waitForCompaction();
+	(void) ::close(this->fd);
+	this->fd = -1;
+}
+
+bool Journal::take(const std::string& key, std::string& value)
+{
+	auto it = this->replayed.find(key);
+	if (it == this->replayed.end()) {
+		return false;
+	}
+	value = std::move(it->second);
+	this->replayed.erase(it);
+	return true;
+}
+
+void Journal::append(uint8_t op, const std::string& key, const std::string& value)
+{
+	encode_record(this->buffer, op, key, value);
+	this->recordCount++;
+}
+
+void Journal::put(const std::string& key, const std::string& value)
+{
+	this->append(JOURNAL_OP_PUT, key, value);
+	if (this->syncPolicy == JOURNAL_SYNC_WRITE) {
+		this->flush();
+	}
+}
+
+void Journal::erase(const std::string& key)
+{
+	this->replayed.erase(key);
+	this->append(JOURNAL_OP_ERASE, key, "");
+	if (this->syncPolicy == JOURNAL_SYNC_WRITE) {
+		this->flush();
+	}
+}
+
+void Journal::flush()
+{
+	if (this->buffer.empty() || !this->isOpen()) {
+		return;
+	}
+
+	this->flushBuffered();
+	if (this->journalSize > this->compactionThreshold &&
+			this->journalSize > 2 * this->snapshotSize) {
+		this->compact();
+	}
+}
+
+void Journal::flushBuffered()
+{
+	if (this->buffer.empty() || !this->isOpen()) {
+		return;
+	}
+
+	write_all(this->fd, this->buffer.data(), this->buffer.size());
+	this->journalSize += this->buffer.size();
+	this->buffer.clear();
+
+	if (this->syncPolicy != JOURNAL_SYNC_NONE) {
+		if (sync_file(this->fd) < 0) {
+			log_errno("unable to sync the journal in %s", this->directory.c_str());
+			throw std::system_error(errno, std::system_category());
+		}
+		this->syncCount++;
+	}
+}
+
+void Journal::compact()
+{
+	if (this->compacting) {
+		return;
+	}
+	if (this->compactionThread.joinable()) {
+		this->compactionThread.join();
+	}
+
+	/*
+	 * If journal.old is still around, the last compaction did not finish.
+	 * Merge it into the snapshot before starting a new journal.
+	 */
+	if (!file_exists(getPath("journal.old"))) {
+		/* flush() would start another compaction, which is this one */
+		this->flushBuffered();
+		if (rename(getPath("journal").c_str(), getPath("journal.old").c_str()) < 0) {
+			log_errno("rename(2)");
+			throw std::system_error(errno, std::system_category());
+		}
+		(void) ::close(this->fd);
+		this->openJournalFile();
+		this->journalSize = 0;
+	}
+
+	this->compacting = true;
+	this->compactionThread = std::thread(&Journal::compactFiles, this);
+}
+
+/* Runs in the compaction thread, and only touches the snapshot and journal.old */
+void Journal::compactFiles()
+{
+	try {
+		record_map_t records;
+		replayFile(getPath("snapshot"), records);
+		replayFile(getPath("journal.old"), records);
+		this->snapshotSize = writeSnapshot(getPath("snapshot"), records);
+		if (unlink(getPath("journal.old").c_str()) < 0) {
+			log_errno("unlink(2)");
+		}
+		log_debug("compacted %s: %zu records", directory.c_str(), records.size());
+	} catch (const std::exception& e) {
+		log_error("compaction of %s failed: %s", directory.c_str(), e.what());
+	}
+	this->compacting = false;
+}
+
+void Journal::waitForCompaction()
+{
+	if (this->compactionThread.joinable()) {
+		this->compactionThread.join();
+	}
+}
+
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace libjob
+{
+
+/** When the journal is forced to stable storage with fsync(2) */
+typedef enum {
+	/** Never; leave it to the kernel */
+	JOURNAL_SYNC_NONE,
+
+	/** Once for each flush(), so a batch of updates shares one fsync */
+	JOURNAL_SYNC_BATCH,
+
+	/** After every update */
+	JOURNAL_SYNC_WRITE,
+} journal_sync_t;
+
+/**
+ * An append-only log of key/value records, used to persist the state of
+ * every job in a single file instead of one file per job.
+ *
+ * A journal lives in a directory, and consists of:
+ *
+ *   snapshot     - the value of every key, as of the last compaction
+ *   journal      - records appended since the last compaction
+ *   journal.old  - records appended before the compaction that is in progress
+ *
+ * Each record carries a CRC-32 of its contents. Replay stops at the first
+ * record that is short or fails the checksum, which is what a crash in the
+ * middle of an append leaves behind.
+ *
+ * Updates are buffered in memory, and written with a single write(2) by
+ * flush(), followed by an fsync(2) if the sync policy calls for one. The
+ * snapshot is always written to a temporary file, synced, and renamed into
+ * place, so a crash leaves either the old snapshot or the new one.
+ *
+ * When the journal grows to twice the size of the snapshot, it is
+ * renamed to journal.old and a background thread merges it into a new
+ * snapshot.
+ */
+class Journal
+{
+public:
+	Journal() {}
+	~Journal();
+
+	/** Open the journal in @directory and replay everything it contains */
+	void open(const std::string& directory);
+
+	/** Flush any buffered records, wait for compaction, and close the journal */
+	void close();
+
+	bool isOpen() const { return fd >= 0; }
+
+	/**
+	 * Remove the value of @key that was found during replay, and store it
+	 * in @value. Returns false if replay did not find the key.
+	 */
+	bool take(const std::string& key, std::string& value);
+
+	/** Record a new value for @key */
+	void put(const std::string& key, const std::string& value);
+
+	/** Record that @key has been deleted */
+	void erase(const std::string& key);
+
+	/** Append the buffered records to the journal, and compact it if needed */
+	void flush();
+
+	/** Wait for a running compaction to finish */
+	void waitForCompaction();
+
+	/** Choose when to sync the journal. This should be called before open(). */
+	void setSyncPolicy(journal_sync_t policy) { syncPolicy = policy; }
+
+	journal_sync_t getSyncPolicy() const { return syncPolicy; }
+
+	/** Convert "none", "batch" or "write" to a sync policy. Returns false if @name is not one of these. */
+	static bool parseSyncPolicy(const std::string& name, journal_sync_t& policy);
+
+	/** The number of times the journal has been synced */
+	unsigned long getSyncCount() const { return syncCount; }
+
+	/** The number of records that have been appended to the journal */
+	unsigned long getRecordCount() const { return recordCount; }
+
+	/** The size of the journal file, not including the buffer */
+	size_t getJournalSize() const { return journalSize; }
+
+	/** Compaction starts when the journal is larger than this, and twice the snapshot */
+	void setCompactionThreshold(size_t bytes) { compactionThreshold = bytes; }
+
+private:
+	typedef std::unordered_map<std::string, std::string> record_map_t;
+
+	std::string directory;
+	int fd = -1;
+	std::vector<char> buffer;
+	size_t journalSize = 0;
+	unsigned long recordCount = 0;
+	size_t compactionThreshold = 1024 * 1024;
+	journal_sync_t syncPolicy = JOURNAL_SYNC_NONE;
+	unsigned long syncCount = 0;
+
+	/** Values found by replay, that have not been taken yet */
+	record_map_t replayed;
+
+	std::thread compactionThread;
+	std::atomic<bool> compacting { false };
+	std::atomic<size_t> snapshotSize { 0 };
+
+	Journal(const Journal&) = delete;
+	Journal& operator=(const Journal&) = delete;
+
+	std::string getPath(const char *name) const { return directory + "/" + name; }
+	void append(uint8_t op, const std::string& key, const std::string& value);
+
+	/** Append the buffered records to the journal, without compacting it */
+	void flushBuffered();
+
+	/** Start compacting the journal now, unless a compaction is already running */
+	void compact();
+
+	void openJournalFile();
+	void syncDirectory();
+	void compactFiles();
+
+	static size_t replayFile(const std::string& path, record_map_t& records);
+	static size_t writeSnapshot(const std::string& path, const record_map_t& records);
+};
+
+}
@@ -16,15 +16,57 @@
 
 #pragma once
 
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "cbor.hpp"
 #include "parser.hpp"
 
 namespace libjob {
 
 	using json = nlohmann::json;
 
+	/** Error codes defined by the JSON-RPC 2.0 specification */
+	enum {
+		JSONRPC_INVALID_REQUEST = -32600,
+		JSONRPC_METHOD_NOT_FOUND = -32601,
+		JSONRPC_INVALID_PARAMS = -32602,
+		JSONRPC_INTERNAL_ERROR = -32603,
+	};
+
+	/**
+	 * How messages are encoded on the IPC socket. Every connection starts
+	 * out with JSON text, and can switch to CBOR with the "setEncoding"
+	 * method.
+	 */
+	enum jsonRpcEncoding {
+		JSONRPC_ENCODING_JSON,
+		JSONRPC_ENCODING_CBOR,
+	};
+
+	/** Throws std::invalid_argument if the name is not a known encoding */
+	static inline jsonRpcEncoding jsonrpc_encoding_from_string(const std::string& name) {
+		if (name == "json")
+			return JSONRPC_ENCODING_JSON;
+		if (name == "cbor")
+			return JSONRPC_ENCODING_CBOR;
+		throw std::invalid_argument("unsupported encoding: " + name);
+	}
+
+	static inline std::string jsonrpc_encoding_name(jsonRpcEncoding encoding) {
+		return (encoding == JSONRPC_ENCODING_CBOR) ? "cbor" : "json";
+	}
+
+	static inline json jsonrpc_decode(const std::string& buf, jsonRpcEncoding encoding) {
+		return (encoding == JSONRPC_ENCODING_CBOR) ? cbor_decode(buf) : json::parse(buf);
+	}
+
+	static inline std::string jsonrpc_encode(const json& j, jsonRpcEncoding encoding) {
+		return (encoding == JSONRPC_ENCODING_CBOR) ? cbor_encode(j) : j.dump();
+	}
+
 	class jsonRpcRequest {
 	public:
 		jsonRpcRequest() {
@@ -46,6 +88,9 @@ namespace libjob {
 		}
 #endif
 
+		/** Wrap one element of a batch */
+		explicit jsonRpcRequest(json j) : request(std::move(j)) {}
+
 		void parse(std::string buf) {
 			this->request = json::parse(buf);
 		}
@@ -58,7 +103,15 @@ namespace libjob {
 			return this->request["params"][where];
 		}
 
+		unsigned int getParamCount() {
+			auto it = this->request.find("params");
+			return (it == this->request.end()) ? 0 : it->size();
+		}
+
 		unsigned int id() { return this->request["id"]; }
+
+		/** A request without an id is a notification, and gets no response */
+		bool hasId() const { return this->request.count("id") > 0; }
 		std::string method() { return this->request["method"]; }
 
 		std::string dump() { return this->request.dump(); }
@@ -71,6 +124,20 @@ namespace libjob {
 			// todo: ensure method and id are present
 		}
 
+		/** True if the request is an object with a method, and a numeric id if it has one */
+		bool isValid() const {
+			if (!this->request.is_object())
+				return false;
+			auto method = this->request.find("method");
+			auto id = this->request.find("id");
+			auto params = this->request.find("params");
+			return method != this->request.end() && method->is_string() &&
+				(id == this->request.end() || id->is_number_unsigned()) &&
+				(params == this->request.end() || params->is_array());
+		}
+
+		const json& getJSON() const { return this->request; }
+
 	private:
 		json request;
 	};
@@ -79,18 +146,143 @@ namespace libjob {
 	public:
 		jsonRpcResponse() {
 			this->response["jsonrpc"] = "2.0";
+			this->response["id"] = nullptr;
 		}
 
+		/** Wrap one element of a batch response */
+		explicit jsonRpcResponse(json j) : response(std::move(j)) {}
+
 		jsonRpcResponse(unsigned int id) {
 			this->response["jsonrpc"] = "2.0",
 			this->response["id"] = id;
 		}
 
+		void parse(std::string buf) {
+			this->response = json::parse(buf);
+		}
+
+		unsigned int id() { return this->response["id"]; }
+		bool hasId() const {
+			auto it = this->response.find("id");
+			return it != this->response.end() && it->is_number();
+		}
+
 		void setResult(json j) { this->response["result"] = j; }
 		json getResult() { return this->response["result"]; }
+
+		void setError(int code, std::string message) {
+			this->response.erase("result");
+			this->response["error"]["code"] = code;
+			this->response["error"]["message"] = message;
+		}
+		bool isError() const { return this->response.count("error") > 0; }
+		std::string getErrorMessage() { return this->response["error"]["message"]; }
+
 		std::string dump() { return this->response.dump(); }
 
+		const json& getJSON() const { return this->response; }
+
 	private:
 		json response;
 	};
+
+	/**
+	 * A JSON-RPC 2.0 batch: several requests sent as one array, which are
+	 * handled together and answered with one array of responses. A message
+	 * that holds a single request is parsed as a batch of one, for which
+	 * isBatch() is false, so that both can be handled the same way.
+	 */
+	class jsonRpcBatch {
+	public:
+		void add(jsonRpcRequest request) { requests.push_back(std::move(request)); }
+		size_t size() const { return requests.size(); }
+		jsonRpcRequest& getRequest(size_t i) { return requests[i]; }
+		bool isBatch() const { return is_batch; }
+
+		/** True if at least one request has an id, so a response will be sent */
+		bool expectsResponse() const {
+			for (auto& it : requests) {
+				if (it.hasId())
+					return true;
+			}
+			return false;
+		}
+
+		/** Parse a message that holds either one request or a batch of them */
+		void parse(const std::string& buf, jsonRpcEncoding encoding = JSONRPC_ENCODING_JSON) {
+			json j = jsonrpc_decode(buf, encoding);
+
+			clear();
+			is_batch = j.is_array();
+			if (is_batch) {
+				json::array_t& array = *j.get_ptr<json::array_t *>();
+				requests.reserve(array.size());
+				for (auto& it : array) {
+					requests.emplace_back(std::move(it));
+				}
+			} else {
+				requests.emplace_back(std::move(j));
+			}
+		}
+
+		std::string dump(jsonRpcEncoding encoding = JSONRPC_ENCODING_JSON) const {
+			json j = json::array();
+			for (auto& it : requests) {
+				j.push_back(it.getJSON());
+			}
+			return jsonrpc_encode(j, encoding);
+		}
+
+		void addResponse(jsonRpcResponse response) { responses.push_back(std::move(response)); }
+		size_t getResponseCount() const { return responses.size(); }
+		jsonRpcResponse& getResponse(size_t i) { return responses[i]; }
+
+		/**
+		 * The responses, in the same form as the requests. The reply to an
+		 * empty batch is a single error, not an array. If there are no
+		 * responses, because every request was a notification, the result
+		 * is empty and nothing should be sent.
+		 */
+		std::string dumpResponses(jsonRpcEncoding encoding = JSONRPC_ENCODING_JSON) const {
+			if (responses.empty())
+				return "";
+			if (!is_batch || requests.empty())
+				return jsonrpc_encode(responses[0].getJSON(), encoding);
+
+			json j = json::array();
+			for (auto& it : responses) {
+				j.push_back(it.getJSON());
+			}
+			return jsonrpc_encode(j, encoding);
+		}
+
+		void parseResponses(const std::string& buf, jsonRpcEncoding encoding = JSONRPC_ENCODING_JSON) {
+			setResponses(jsonrpc_decode(buf, encoding));
+		}
+
+		/** Take the responses from a decoded message */
+		void setResponses(json j) {
+			responses.clear();
+			if (j.is_array()) {
+				json::array_t& array = *j.get_ptr<json::array_t *>();
+				responses.reserve(array.size());
+				for (auto& it : array) {
+					responses.emplace_back(std::move(it));
+				}
+			} else {
+				responses.emplace_back(std::move(j));
+			}
+		}
+
+		void clear() {
+			requests.clear();
+			responses.clear();
+			is_batch = false;
+		}
+
+	private:
+		std::vector<jsonRpcRequest> requests;
+		std::vector<jsonRpcResponse> responses;
+		bool is_batch = false;
+	};
 }
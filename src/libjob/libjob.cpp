@@ -126,4 +126,5 @@ libjob::jobdConfig::jobdConfig() {
 	createDirectories();
 	socketPath = getRuntimeDir() + "/jobd.sock";
 	pidfilePath = getRuntimeDir() + "/jobd.pid";
+	statusTablePath = getRuntimeDir() + "/jobd.status";
 }
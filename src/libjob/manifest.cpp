@@ -16,11 +16,17 @@
 
 #include <fstream>
 #include <iostream>
-#include <unistd.h>
+#include <system_error>
 
-#include <grp.h>
-#include <pwd.h>
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
 
+#include "contentHash.hpp"
+#include "credentialCache.hpp"
 #include "logger.h"
 #include "manifest.hpp"
 #include "parser.hpp"
@@ -41,11 +47,10 @@ static string getFileExtension(const string& path)
 	}
 }
 
-void Manifest::parseJSON()
+void Manifest::parseJSON(const string& text)
 {
 	try {
-		std::ifstream ifs(path, std::ifstream::in);
-		ifs >> this->json;
+		this->json = nlohmann::json::parse(text);
 	} catch (std::exception& e) {
 		log_error("error parsing %s: %s", path.c_str(), e.what());
 		throw;
@@ -54,11 +59,10 @@ void Manifest::parseJSON()
 	}
 }
 
-void Manifest::parseUCL()
+void Manifest::parseUCL(const char *data, size_t len)
 {
 	struct ucl_parser* parser = NULL;
 	ucl_object_t* obj = NULL;
-	unsigned char *ucl_buf = NULL;
 
 	try {
 		parser = ucl_parser_new(0);
@@ -66,111 +70,399 @@ void Manifest::parseUCL()
 			throw std::runtime_error("parser_new() failed");
 		}
 
-		std::ifstream ifs(path, std::ifstream::in);
-		std::stringstream buf;
-		buf << ifs.rdbuf();
-
-		if (!ucl_parser_add_string(parser, buf.str().c_str(), buf.str().length() + 1)) {
-			throw std::runtime_error("add_string() failed");
+		if (!ucl_parser_add_chunk(parser, (const unsigned char *) data, len)) {
+			const char *error = ucl_parser_get_error(parser);
+			throw std::runtime_error(error ? error : "UCL parser error");
 		}
 
-		if (ucl_parser_get_error (parser)) {
-			throw std::runtime_error("UCL parser error"); //TODO: add ucl_parser_get_error()
+		obj = ucl_parser_get_object(parser);
+		if (!obj) {
+			throw std::runtime_error("UCL parser error");
 		}
+		this->json = ucl_to_json(obj);
 
-	    obj = ucl_parser_get_object (parser);
-	    ucl_buf = ucl_object_emit(obj, UCL_EMIT_JSON);
-	    if (!ucl_buf) {
-			throw std::runtime_error("ucl_object_emit() failed");
-	    }
-	    this->json = nlohmann::json::parse((char*)ucl_buf);
-
-	    free(ucl_buf);
-	    ucl_parser_free(parser);
-	    ucl_object_unref(obj);
-	} catch (std::exception& e) {
-		log_error("parsing failed: %s", e.what());
-		throw;
+		ucl_object_unref(obj);
+		ucl_parser_free(parser);
 	} catch (...) {
-		if (parser != NULL) {
-		    ucl_parser_free(parser);
-		}
 		if (obj != NULL) {
-		    ucl_object_unref(obj);
+			ucl_object_unref(obj);
 		}
-		if (ucl_buf != NULL) {
-			free(ucl_buf);
+		if (parser != NULL) {
+			ucl_parser_free(parser);
 		}
+		log_error("error parsing %s", path.c_str());
 		throw;
 	}
 }
 
+/* A read-only mapping of a whole file */
+class MappedFile
+{
+public:
+	MappedFile(const string& path)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			int saved_errno = errno;
+			log_error("unable to open %s", path.c_str());
+			throw std::system_error(saved_errno, std::system_category());
+		}
+
+		struct stat sb;
+		if (fstat(fd, &sb) < 0) {
+			int saved_errno = errno;
+			log_errno("fstat(2) of %s", path.c_str());
+			(void) close(fd);
+			throw std::system_error(saved_errno, std::system_category());
+		}
+
+		/* mmap(2) refuses to map an empty file */
+		if (sb.st_size > 0) {
+			void *p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				int saved_errno = errno;
+				log_errno("mmap(2) of %s", path.c_str());
+				(void) close(fd);
+				throw std::system_error(saved_errno, std::system_category());
+			}
+			this->base = p;
+			this->size = sb.st_size;
+		}
+		(void) close(fd);
+	}
+
+	~MappedFile()
+	{
+		if (this->base) {
+			(void) munmap(this->base, this->size);
+		}
+	}
+
+	const char *data() const { return static_cast<const char *>(base); }
+	size_t length() const { return size; }
+
+private:
+	void *base = nullptr;
+	size_t size = 0;
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+};
+
 void Manifest::readFile(const string path)
 {
 	this->path = path;
 	string ext = getFileExtension(path);
 
+	if (ext != "json" && ext != "ucl") {
+		throw std::invalid_argument("unsupported file extension");
+	}
+
+	MappedFile file(path);
+	this->sourceHash = content_hash(file.data(), file.length());
+
 	if (ext == "json") {
-		parseJSON();
-	} else if (ext == "ucl") {
-		parseUCL();
+		/* This version of nlohmann::json can only parse a string or a stream */
+		parseJSON(string(file.data(), file.length()));
 	} else {
-		throw std::invalid_argument("unsupported file extension");
+		parseUCL(file.data(), file.length());
 	}
 	try {
 		this->normalize();
+		this->compile();
 	} catch (std::exception& e) {
 		log_error("normalization failed: %s", e.what());
 		throw;
 	}
-	this->label = this->json["Label"];
+	this->label = this->fields.label;
+	this->jsonText.clear();
+	this->contentHash = content_hash(this->serialize());
+}
+
+string Manifest::serialize() const
+{
+	if (this->jsonText.empty()) {
+		this->jsonText = this->json.dump(4) + '\n';
+	}
+	return this->jsonText;
+}
+
+const nlohmann::json& Manifest::getJSON() const
+{
+	if (this->json.is_null() && !this->jsonText.empty()) {
+		this->json = nlohmann::json::parse(this->jsonText);
+	}
+	return this->json;
+}
+
+/* The type of value that a key in a manifest must have */
+typedef enum {
+	KEY_ANY,
+	KEY_STRING,
+	KEY_BOOLEAN,
+	KEY_INTEGER,
+	KEY_STRING_ARRAY,
+	KEY_OBJECT,
+	/** An object whose values are strings, or the empty array */
+	KEY_STRING_MAP,
+} manifest_key_type_t;
+
+struct manifest_key {
+	const char *name;
+	manifest_key_type_t type;
+	bool required;
+
+	/** The default value as JSON text, or NULL if a missing key stays missing */
+	const char *default_value;
+};
+
+/*
+ * Every key that a manifest may contain. UserName and GroupName default to
+ * the credentials of jobd, so they are filled in by normalize() itself.
+ */
+static const manifest_key manifest_schema[] = {
+	{ "CapsicumRights", KEY_OBJECT, false, NULL },
+	{ "ChrootDirectory", KEY_ANY, false, "null" },
+	{ "ChrootJail", KEY_OBJECT, false, NULL },
+	{ "CreateDescriptors", KEY_OBJECT, false, NULL },
+	{ "Description", KEY_STRING, false, "\"\"" },
+	{ "Enable", KEY_BOOLEAN, false, "false" },
+	{ "EnableGlobbing", KEY_BOOLEAN, false, "false" },
+	{ "EnvironmentVariables", KEY_STRING_MAP, false, "[]" },
+	{ "GroupName", KEY_STRING, false, NULL },
+	{ "InitGroups", KEY_BOOLEAN, false, "true" },
+	{ "KeepAlive", KEY_BOOLEAN, false, "false" },
+	{ "Label", KEY_STRING, true, NULL },
+	{ "Nice", KEY_INTEGER, false, "0" },
+	{ "Program", KEY_STRING_ARRAY, true, NULL },
+	{ "RootDirectory", KEY_STRING, false, "\"/\"" },
+	{ "Sockets", KEY_OBJECT, false, "{}" },
+	{ "StandardErrorPath", KEY_STRING, false, "\"/dev/null\"" },
+	{ "StandardInPath", KEY_STRING, false, "\"/dev/null\"" },
+	{ "StandardOutPath", KEY_STRING, false, "\"/dev/null\"" },
+	{ "StartInterval", KEY_INTEGER, false, "0" },
+	{ "ThrottleInterval", KEY_INTEGER, false, "10" },
+	{ "Umask", KEY_STRING, false, "\"022\"" },
+	{ "UserName", KEY_STRING, false, NULL },
+	{ "WorkingDirectory", KEY_STRING, false, "\"/\"" },
+};
+
+/* A key from manifest_schema, with its default value already parsed */
+struct compiled_key {
+	const manifest_key *key;
+	nlohmann::json default_value;
+};
+
+/* The schema, indexed by name. It is built once, the first time it is needed. */
+static const std::map<string, compiled_key>& get_schema()
+{
+	static const std::map<string, compiled_key> schema = []() {
+		std::map<string, compiled_key> result;
+		for (const manifest_key& key : manifest_schema) {
+			compiled_key& ck = result[key.name];
+			ck.key = &key;
+			if (key.default_value) {
+				ck.default_value = nlohmann::json::parse(key.default_value);
+			}
+		}
+		return result;
+	}();
+	return schema;
+}
+
+static bool has_type(const nlohmann::json& value, manifest_key_type_t type)
+{
+	switch (type) {
+	case KEY_ANY:
+		return true;
+	case KEY_STRING:
+		return value.is_string();
+	case KEY_BOOLEAN:
+		return value.is_boolean();
+	case KEY_INTEGER:
+		/* UCL turns a time such as 60s into a float */
+		return value.is_number_integer()
+				|| (value.is_number_float() && value.get<double>() == (long) value.get<double>());
+	case KEY_STRING_ARRAY:
+		if (!value.is_array()) {
+			return false;
+		}
+		for (const nlohmann::json& elt : value) {
+			if (!elt.is_string()) {
+				return false;
+			}
+		}
+		return true;
+	case KEY_OBJECT:
+		return value.is_object();
+	case KEY_STRING_MAP:
+		if (value.is_array()) {
+			return value.empty();
+		}
+		if (!value.is_object()) {
+			return false;
+		}
+		for (const nlohmann::json& elt : value) {
+			if (!elt.is_string()) {
+				return false;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+static const char *type_name(manifest_key_type_t type)
+{
+	switch (type) {
+	case KEY_ANY: return "any value";
+	case KEY_STRING: return "a string";
+	case KEY_BOOLEAN: return "true or false";
+	case KEY_INTEGER: return "an integer";
+	case KEY_STRING_ARRAY: return "an array of strings";
+	case KEY_OBJECT: return "an object";
+	case KEY_STRING_MAP: return "an object whose values are strings";
+	}
+	return "unknown";
 }
 
 void Manifest::normalize() {
-	auto default_json = R"(
-	  {
-            "ChrootDirectory": null,
-            "Description": "",
-            "EnableGlobbing": false,
-            "EnvironmentVariables": [],
-	    "KeepAlive": false,
-	    "Nice": 0,            
-	    "InitGroups": true,
-	    "RootDirectory": "/",
-	    "Enable": false,
-	    "Sockets": {},
-            "StandardErrorPath": "/dev/null",
-            "StandardInPath": "/dev/null",
-            "StandardOutPath": "/dev/null",
-            "StartInterval": 0,
-            "ThrottleInterval": 10,
-            "Umask": "022",
-            "WorkingDirectory": "/"
-	  }
-	)"_json;
-
-	if (this->json.count("Program") == 1) {
-		//FIXME: convert from string to array,
-		// this->json["Program"].type()
-		//abort();
+	const std::map<string, compiled_key>& schema = get_schema();
+
+	if (!this->json.is_object()) {
+		throw std::invalid_argument("a manifest must be an object");
 	}
-	if (this->json.count("UserName") == 0) {
-		struct passwd *pwd = getpwuid(getuid());
-		this->json["UserName"] = string(pwd->pw_name);
+
+	/* A Program that is a string is the path to a program without arguments */
+	auto program = this->json.find("Program");
+	if (program != this->json.end() && program->is_string()) {
+		*program = nlohmann::json::array({ *program });
+	}
+
+	/* Check the keys that are present */
+	size_t known_keys = 0;
+	for (nlohmann::json::iterator it = this->json.begin(); it != this->json.end(); ++it) {
+		auto key = schema.find(it.key());
+		if (key == schema.end()) {
+			throw std::invalid_argument("unknown key: " + it.key());
+		}
+		if (!has_type(it.value(), key->second.key->type)) {
+			throw std::invalid_argument(it.key() + " must be " + type_name(key->second.key->type));
+		}
+		known_keys++;
+	}
+
+	/* Add default values for the keys that are missing */
+	if (known_keys < schema.size()) {
+		for (auto& it : schema) {
+			const manifest_key *key = it.second.key;
+			if (this->json.count(key->name) != 0) {
+				continue;
+			}
+			if (key->required) {
+				throw std::invalid_argument(string("missing required key: ") + key->name);
+			}
+			if (key->default_value) {
+				this->json[key->name] = it.second.default_value;
+			}
+		}
 	}
 
+	if (this->json.count("UserName") == 0) {
+		this->json["UserName"] = CredentialCache::instance().getUser(getuid()).name;
+	}
 	if (this->json.count("GroupName") == 0) {
-		struct group *grp = getgrgid(getgid());
-		this->json["GroupName"] = string(grp->gr_name);
+		this->json["GroupName"] = CredentialCache::instance().getGroup(getgid()).name;
+	}
+}
+
+/* Get the value of a key, or throw std::invalid_argument if it is not of type T */
+template <typename T>
+static T get_field(const nlohmann::json& json, const char *key)
+{
+	auto it = json.find(key);
+	if (it == json.end()) {
+		throw std::invalid_argument(string("missing key: ") + key);
+	}
+	try {
+		return it->get<T>();
+	} catch (std::exception& e) {
+		throw std::invalid_argument(string("invalid value for ") + key + ": " + e.what());
+	}
+}
+
+void Manifest::compile() {
+	const nlohmann::json& j = this->json;
+	ManifestFields f;
+
+	f.label = get_field<string>(j, "Label");
+	if (f.label.empty()) {
+		throw std::invalid_argument("Label must not be empty");
 	}
 
+	if (!j.count("Program") || !j.at("Program").is_array() || j.at("Program").empty()) {
+		throw std::invalid_argument("Program must be a non-empty array of strings");
+	}
+	f.program = get_field<vector<string>>(j, "Program");
+	f.enable_globbing = get_field<bool>(j, "EnableGlobbing");
+
+	/* The default is an empty array, but any variables must be in an object */
+	const nlohmann::json& env = j.at("EnvironmentVariables");
+	if (env.is_object()) {
+		for (auto it = env.begin(); it != env.end(); ++it) {
+			if (!it.value().is_string()) {
+				throw std::invalid_argument("invalid value for EnvironmentVariables: " + it.key());
+			}
+			f.environment_variables[it.key()] = it.value().get<string>();
+		}
+	} else if (!(env.is_array() && env.empty())) {
+		throw std::invalid_argument("EnvironmentVariables must be an object");
+	}
+
+	f.enable = get_field<bool>(j, "Enable");
+	f.keep_alive = get_field<bool>(j, "KeepAlive");
+	f.start_interval = get_field<unsigned long>(j, "StartInterval");
+	f.throttle_interval = get_field<unsigned int>(j, "ThrottleInterval");
+	if (get_field<long>(j, "StartInterval") < 0 || get_field<long>(j, "ThrottleInterval") < 0) {
+		throw std::invalid_argument("intervals must not be negative");
+	}
 
-	// Add default values for missing keys
-	for (nlohmann::json::iterator it = default_json.begin(); it != default_json.end(); ++it) {
-		if (this->json.count(it.key()) == 0) {
-			this->json[it.key()] = it.value();
+	f.user_name = get_field<string>(j, "UserName");
+	f.group_name = get_field<string>(j, "GroupName");
+
+	f.nice = get_field<int>(j, "Nice");
+	if (f.nice < -20 || f.nice > 20) {
+		throw std::invalid_argument("Nice must be between -20 and 20");
+	}
+	f.working_directory = get_field<string>(j, "WorkingDirectory");
+	f.root_directory = get_field<string>(j, "RootDirectory");
+	f.stdin_path = get_field<string>(j, "StandardInPath");
+	f.stdout_path = get_field<string>(j, "StandardOutPath");
+	f.stderr_path = get_field<string>(j, "StandardErrorPath");
+
+	if (j.count("CreateDescriptors")) {
+		const nlohmann::json& o = j.at("CreateDescriptors");
+		if (!o.is_object()) {
+			throw std::invalid_argument("CreateDescriptors must be an object");
+		}
+		for (auto it = o.begin(); it != o.end(); ++it) {
+			if (!it.value().is_array() || it.value().empty()) {
+				throw std::invalid_argument("invalid value for CreateDescriptors: " + it.key());
+			}
+			vector<string> args;
+			try {
+				args = it.value().get<vector<string>>();
+			} catch (std::exception& e) {
+				throw std::invalid_argument("invalid value for CreateDescriptors: " + it.key());
+			}
+			f.create_descriptors.push_back(std::make_pair(it.key(), args));
 		}
 	}
+
+	f.has_chroot_jail = (j.count("ChrootJail") > 0);
+	f.has_capsicum_rights = (j.count("CapsicumRights") > 0);
+
+	this->fields = f;
 }
 
 }
@@ -22,10 +22,62 @@
 namespace libjob
 {
 
+/**
+ * The settings in a manifest that jobd consults while it is running,
+ * decoded and validated once, when the manifest is parsed.
+ */
+struct ManifestFields
+{
+	std::string label;
+
+	/* What to run */
+	std::vector<std::string> program;
+	bool enable_globbing = false;
+	std::map<std::string, std::string> environment_variables;
+
+	/* When to run it */
+	bool enable = false;
+	bool keep_alive = false;
+	unsigned int throttle_interval = 0;
+	unsigned long start_interval = 0;
+
+	/* Who to run it as */
+	std::string user_name;
+	std::string group_name;
+
+	/* How to run it */
+	int nice = 0;
+	std::string working_directory;
+	std::string root_directory;
+	std::string stdin_path;
+	std::string stdout_path;
+	std::string stderr_path;
+
+	/**
+	 * CreateDescriptors: the name of each descriptor, and the system
+	 * call and arguments that create it.
+	 */
+	std::vector<std::pair<std::string, std::vector<std::string>>> create_descriptors;
+
+	/* Features that are still configured from the raw JSON */
+	bool has_chroot_jail = false;
+	bool has_capsicum_rights = false;
+};
+
+class ManifestCache;
+
 class Manifest
 {
 public:
-	nlohmann::json json;
+	/**
+	 * The version of the parser. Bump this whenever parsing, normalize() or
+	 * compile() change what they produce, so that cached manifests are
+	 * thrown away.
+	 */
+	static const uint32_t parserVersion = 2;
+
+	/** The typed settings, which are what the rest of jobd should read */
+	ManifestFields fields;
 
 	Manifest()
 	{
@@ -33,16 +85,56 @@ public:
 
 	void readFile(const string path);
 
-	/** Convert datatypes and provide default values for missing keys. */
-	void normalize();
+	/** The normalized manifest, as jobd writes it to the manifest directory */
+	string serialize() const;
 
-	Manifest(const string label)
+	/**
+	 * The manifest as it was parsed, plus defaults. Only needed for writing
+	 * it back out, and for the keys that are not in fields yet. A manifest
+	 * that came from the ManifestCache is not parsed until this is called.
+	 */
+	const nlohmann::json& getJSON() const;
+
+	/** The content_hash() of serialize(), computed when the file is read */
+	uint64_t getContentHash() const
 	{
-		this->setLabel(label);
+		return contentHash;
 	}
 
-	~Manifest()
+	/** The content_hash() of the file that was read */
+	uint64_t getSourceHash() const
 	{
+		return sourceHash;
+	}
+
+	/** Record that the file that was read has been replaced with serialize() */
+	void markSourceNormalized()
+	{
+		sourceHash = contentHash;
+	}
+
+	/** The path of the file that was read */
+	const string& getPath() const
+	{
+		return path;
+	}
+
+	/**
+	 * Check every key against the schema, and provide default values for
+	 * missing keys. Throws std::invalid_argument if a key is unknown, has
+	 * the wrong type, or is required and missing.
+	 */
+	void normalize();
+
+	/**
+	 * Decode the normalized JSON into fields. Throws std::invalid_argument
+	 * if a key has the wrong type or an unacceptable value.
+	 */
+	void compile();
+
+	Manifest(const string label)
+	{
+		this->setLabel(label);
 	}
 
 	bool operator<(const Manifest& j) const
@@ -61,10 +153,20 @@ public:
 	}
 
 private:
+	friend class ManifestCache;
+
 	string label = "__invalid_label__";
 	string path;
+	uint64_t contentHash = 0;
+	uint64_t sourceHash = 0;
+
+	/** The normalized manifest. Empty if it came from the cache and has not been parsed yet */
+	mutable nlohmann::json json;
+
+	/** The output of serialize(), if it is known */
+	mutable string jsonText;
 
-	void parseJSON();
-	void parseUCL();
+	void parseJSON(const string& text);
+	void parseUCL(const char *data, size_t len);
 };
 }
@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <cstring>
+#include <system_error>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "contentHash.hpp"
+#include "logger.h"
+#include "manifestCache.hpp"
+
+namespace libjob
+{
+
+static const uint32_t MANIFEST_CACHE_MAGIC = 0x4a4d4346; /* "JMCF" */
+static const uint32_t MANIFEST_CACHE_VERSION = 1;
+
+struct manifest_cache_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t parser_version;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t count;
+
+	/** The size and content_hash() of everything after the header */
+	uint64_t body_size;
+	uint64_t body_hash;
+};
+
+static_assert(sizeof(manifest_cache_header) == 40, "unexpected size of manifest_cache_header");
+
+/* Appends values to an entry, in host byte order */
+class CacheWriter
+{
+public:
+	CacheWriter(std::string& buf) : buf(buf) {}
+
+	template <typename T>
+	void put(T value)
+	{
+		buf.append(reinterpret_cast<const char *>(&value), sizeof(value));
+	}
+
+	void put(const std::string& s)
+	{
+		put<uint32_t>(s.size());
+		buf.append(s);
+	}
+
+	void put(const std::vector<std::string>& v)
+	{
+		put<uint32_t>(v.size());
+		for (const std::string& s : v) {
+			put(s);
+		}
+	}
+
+private:
+	std::string& buf;
+};
+
+/*
+ * Reads values back out of an entry. The only checking is that nothing is
+ * read past the end of the entry; after that, failed() is true and every
+ * value is zero or empty.
+ */
+class CacheReader
+{
+public:
+	CacheReader(const char *p, const char *end) : p(p), end(end) {}
+
+	template <typename T>
+	T get()
+	{
+		T value = T();
+		if (take(sizeof(value))) {
+			memcpy(&value, p - sizeof(value), sizeof(value));
+		}
+		return value;
+	}
+
+	std::string getString()
+	{
+		uint32_t len = get<uint32_t>();
+		if (!take(len)) {
+			return std::string();
+		}
+		return std::string(p - len, len);
+	}
+
+	std::vector<std::string> getStrings()
+	{
+		uint32_t count = get<uint32_t>();
+		std::vector<std::string> v;
+		for (uint32_t i = 0; i < count && !failed(); i++) {
+			v.push_back(getString());
+		}
+		return v;
+	}
+
+	bool failed() const { return p == nullptr; }
+
+private:
+	const char *p;
+	const char *end;
+
+	bool take(size_t len)
+	{
+		if (p == nullptr || (size_t)(end - p) < len) {
+			p = nullptr;
+			return false;
+		}
+		p += len;
+		return true;
+	}
+};
+
+/* What identifies a version of the file at @path */
+struct file_key
+{
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t inode;
+};
+
+static bool get_file_key(const std::string& path, file_key& key)
+{
+	struct stat sb;
+
+	if (stat(path.c_str(), &sb) < 0) {
+		return false;
+	}
+	key.size = sb.st_size;
+	key.mtime_sec = sb.st_mtim.tv_sec;
+	key.mtime_nsec = sb.st_mtim.tv_nsec;
+	key.inode = sb.st_ino;
+	return true;
+}
+
+static void encode_entry(std::string& buf, const std::string& path, const file_key& key,
+		uint64_t source_hash, uint64_t content_hash, const ManifestFields& f,
+		const std::string& json_text)
+{
+	CacheWriter w(buf);
+
+	w.put<uint32_t>(0); /* the size of the entry; filled in below */
+	w.put(path);
+	w.put(key.size);
+	w.put(key.mtime_sec);
+	w.put(key.mtime_nsec);
+	w.put(key.inode);
+	w.put(source_hash);
+	w.put(content_hash);
+
+	w.put(f.label);
+	w.put(f.program);
+	w.put<uint8_t>(f.enable_globbing);
+	w.put<uint32_t>(f.environment_variables.size());
+	for (auto& it : f.environment_variables) {
+		w.put(it.first);
+		w.put(it.second);
+	}
+	w.put<uint8_t>(f.enable);
+	w.put<uint8_t>(f.keep_alive);
+	w.put<uint32_t>(f.throttle_interval);
+	w.put<uint64_t>(f.start_interval);
+	w.put(f.user_name);
+	w.put(f.group_name);
+	w.put<int32_t>(f.nice);
+	w.put(f.working_directory);
+	w.put(f.root_directory);
+	w.put(f.stdin_path);
+	w.put(f.stdout_path);
+	w.put(f.stderr_path);
+	w.put<uint32_t>(f.create_descriptors.size());
+	for (auto& it : f.create_descriptors) {
+		w.put(it.first);
+		w.put(it.second);
+	}
+	w.put<uint8_t>(f.has_chroot_jail);
+	w.put<uint8_t>(f.has_capsicum_rights);
+	w.put(json_text);
+
+	uint32_t entry_size = buf.size() - sizeof(uint32_t);
+	memcpy(&buf[0], &entry_size, sizeof(entry_size));
+}
+
+ManifestCache::~ManifestCache()
+{
+	this->unmap();
+}
+
+void ManifestCache::unmap()
+{
+	if (this->base) {
+		(void) munmap(this->base, this->size);
+		this->base = nullptr;
+		this->size = 0;
+	}
+	this->index.clear();
+}
+
+void ManifestCache::open(const std::string& path)
+{
+	this->close();
+	this->path = path;
+
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			log_errno("open(2) of %s", path.c_str());
+		}
+		return;
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		log_errno("fstat(2) of %s", path.c_str());
+		(void) ::close(fd);
+		return;
+	}
+	if ((size_t) sb.st_size >= sizeof(manifest_cache_header)) {
+		void *p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			log_errno("mmap(2) of %s", path.c_str());
+		} else {
+			this->base = p;
+			this->size = sb.st_size;
+		}
+	}
+	(void) ::close(fd);
+
+	if (this->base && !this->buildIndex()) {
+		log_warning("ignoring the manifest cache at %s", path.c_str());
+		this->unmap();
+	}
+	this->saved_count = this->index.size();
+	log_debug("%zu manifests in the cache at %s", this->index.size(), path.c_str());
+}
+
+/* Check the header and checksum, and find the offset of each entry */
+bool ManifestCache::buildIndex()
+{
+	const manifest_cache_header *header = static_cast<const manifest_cache_header *>(this->base);
+	const char *body = static_cast<const char *>(this->base) + sizeof(*header);
+	const char *end = static_cast<const char *>(this->base) + this->size;
+
+	if (header->magic != MANIFEST_CACHE_MAGIC || header->version != MANIFEST_CACHE_VERSION) {
+		return false;
+	}
+	if (header->parser_version != Manifest::parserVersion
+			|| header->uid != getuid() || header->gid != getgid()) {
+		log_debug("the manifest cache was written by a different parser or user");
+		return false;
+	}
+	if (header->body_size != (uint64_t)(end - body)
+			|| header->body_hash != content_hash(body, header->body_size)) {
+		return false;
+	}
+
+	this->index.reserve(header->count);
+	for (uint32_t i = 0; i < header->count; i++) {
+		CacheReader r(body, end);
+		uint32_t entry_size = r.get<uint32_t>();
+		std::string entry_path = r.getString();
+		if (r.failed() || entry_size > (size_t)(end - body) - sizeof(entry_size)) {
+			return false;
+		}
+		this->index[entry_path] = body - static_cast<const char *>(this->base);
+		body += sizeof(entry_size) + entry_size;
+	}
+	return (body == end);
+}
+
+void ManifestCache::close()
+{
+	this->unmap();
+	this->entries.clear();
+	this->changed = false;
+	this->saved_count = 0;
+	this->hits = 0;
+	this->misses = 0;
+}
+
+bool ManifestCache::lookup(const std::string& path, Manifest& manifest)
+{
+	auto it = this->index.find(path);
+	file_key key;
+
+	if (it == this->index.end() || !get_file_key(path, key)) {
+		this->misses++;
+		return false;
+	}
+
+	const char *entry = static_cast<const char *>(this->base) + it->second;
+	CacheReader r(entry, static_cast<const char *>(this->base) + this->size);
+	uint32_t entry_size = r.get<uint32_t>();
+	(void) r.getString();
+	if (r.get<uint64_t>() != key.size || r.get<int64_t>() != key.mtime_sec
+			|| r.get<int64_t>() != key.mtime_nsec || r.get<uint64_t>() != key.inode) {
+		this->misses++;
+		return false;
+	}
+
+	Manifest m;
+	ManifestFields& f = m.fields;
+	m.sourceHash = r.get<uint64_t>();
+	m.contentHash = r.get<uint64_t>();
+	f.label = r.getString();
+	f.program = r.getStrings();
+	f.enable_globbing = r.get<uint8_t>();
+	uint32_t count = r.get<uint32_t>();
+	for (uint32_t i = 0; i < count && !r.failed(); i++) {
+		std::string name = r.getString();
+		f.environment_variables[name] = r.getString();
+	}
+	f.enable = r.get<uint8_t>();
+	f.keep_alive = r.get<uint8_t>();
+	f.throttle_interval = r.get<uint32_t>();
+	f.start_interval = r.get<uint64_t>();
+	f.user_name = r.getString();
+	f.group_name = r.getString();
+	f.nice = r.get<int32_t>();
+	f.working_directory = r.getString();
+	f.root_directory = r.getString();
+	f.stdin_path = r.getString();
+	f.stdout_path = r.getString();
+	f.stderr_path = r.getString();
+	count = r.get<uint32_t>();
+	for (uint32_t i = 0; i < count && !r.failed(); i++) {
+		std::string name = r.getString();
+		f.create_descriptors.push_back(std::make_pair(name, r.getStrings()));
+	}
+	f.has_chroot_jail = r.get<uint8_t>();
+	f.has_capsicum_rights = r.get<uint8_t>();
+	m.jsonText = r.getString();
+	if (r.failed() || m.jsonText.empty()) {
+		log_warning("corrupt entry for %s in the manifest cache", path.c_str());
+		this->misses++;
+		return false;
+	}
+
+	m.path = path;
+	m.label = f.label;
+	manifest = std::move(m);
+	this->entries[path] = std::string(entry, sizeof(entry_size) + entry_size);
+	this->hits++;
+	return true;
+}
+
+void ManifestCache::store(const std::string& path, const Manifest& manifest)
+{
+	file_key key;
+
+	if (!get_file_key(path, key)) {
+		log_debug("not caching %s: it can no longer be found", path.c_str());
+		return;
+	}
+
+	std::string& buf = this->entries[path];
+	buf.clear();
+	encode_entry(buf, path, key, manifest.getSourceHash(), manifest.getContentHash(),
+			manifest.fields, manifest.serialize());
+	this->changed = true;
+}
+
+void ManifestCache::save()
+{
+	if (this->path.empty() || (!this->changed && this->entries.size() == this->saved_count)) {
+		return;
+	}
+
+	std::string body;
+	for (auto& it : this->entries) {
+		body.append(it.second);
+	}
+
+	manifest_cache_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = MANIFEST_CACHE_MAGIC;
+	header.version = MANIFEST_CACHE_VERSION;
+	header.parser_version = Manifest::parserVersion;
+	header.uid = getuid();
+	header.gid = getgid();
+	header.count = this->entries.size();
+	header.body_size = body.size();
+	header.body_hash = content_hash(body);
+
+	/* Nothing is lost if this is interrupted, so there is no need to fsync(2) */
+	std::string tmp_path = this->path + ".new";
+	int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_errno("open(2) of %s", tmp_path.c_str());
+		return;
+	}
+	std::string buf(reinterpret_cast<const char *>(&header), sizeof(header));
+	buf.append(body);
+	const char *p = buf.data();
+	size_t remaining = buf.size();
+	while (remaining > 0) {
+		ssize_t written = write(fd, p, remaining);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_errno("write(2) to %s", tmp_path.c_str());
+			(void) ::close(fd);
+			(void) unlink(tmp_path.c_str());
+			return;
+		}
+		p += written;
+		remaining -= written;
+	}
+	(void) ::close(fd);
+
+	if (rename(tmp_path.c_str(), this->path.c_str()) < 0) {
+		log_errno("rename(2) of %s", tmp_path.c_str());
+		(void) unlink(tmp_path.c_str());
+		return;
+	}
+	log_debug("saved %zu manifests to %s", this->entries.size(), this->path.c_str());
+
+	/* The old file stays mapped, and the index into it is still good for lookups */
+	this->changed = false;
+	this->saved_count = this->entries.size();
+}
+
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "manifest.hpp"
+
+namespace libjob
+{
+
+/**
+ * A persistent cache of compiled manifests, so that jobd does not have to
+ * parse, normalize and compile every manifest each time it starts.
+ *
+ * The cache is a single file that holds, for each manifest, its path, the
+ * size, mtime and inode number of the file, its ManifestFields, and its
+ * normalized JSON text. An entry is only used if the file still has the
+ * same size, mtime and inode number, and the cache was written by the
+ * same Manifest::parserVersion running as the same user and group.
+ *
+ * open() maps the file and indexes it by path. lookup() decodes an entry
+ * straight into a Manifest, without parsing or validating anything, and
+ * the JSON text is only parsed if something asks for it. The file as a
+ * whole is covered by a content_hash(), so a damaged cache is ignored.
+ *
+ * save() rewrites the file with the entries that were looked up or stored
+ * since open(), which drops the manifests that have gone away.
+ */
+class ManifestCache
+{
+public:
+	ManifestCache() {}
+	~ManifestCache();
+
+	/** Map the cache at @path. A missing or unusable file is an empty cache. */
+	void open(const std::string& path);
+
+	/** Unmap the cache, discarding anything that has not been saved */
+	void close();
+
+	/**
+	 * If there is a valid entry for the file at @path, decode it into
+	 * @manifest and return true.
+	 */
+	bool lookup(const std::string& path, Manifest& manifest);
+
+	/** Add or replace the entry for the file at @path */
+	void store(const std::string& path, const Manifest& manifest);
+
+	/** Write the cache back out, if anything changed since open() */
+	void save();
+
+	size_t getHitCount() const { return hits; }
+	size_t getMissCount() const { return misses; }
+
+private:
+	std::string path;
+	void *base = nullptr;
+	size_t size = 0;
+
+	/** The offset of each entry in the mapped file */
+	std::unordered_map<std::string, size_t> index;
+
+	/** The encoded entries to write out in save() */
+	std::unordered_map<std::string, std::string> entries;
+
+	bool changed = false;
+
+	/** How many entries the file on disk has */
+	size_t saved_count = 0;
+	size_t hits = 0;
+	size_t misses = 0;
+
+	ManifestCache(const ManifestCache&) = delete;
+	ManifestCache& operator=(const ManifestCache&) = delete;
+
+	bool buildIndex();
+	void unmap();
+};
+
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include "logger.h"
+#include "manifestLoader.hpp"
+
+namespace libjob
+{
+
+static void parse_one(ManifestLoadResult& result)
+{
+	try {
+		result.manifest.readFile(result.path);
+	} catch (const std::exception& e) {
+		result.error = e.what();
+	} catch (...) {
+		result.error = "unknown error";
+	}
+}
+
+std::vector<ManifestLoadResult> load_manifests(const std::vector<std::string>& paths,
+		ManifestCache *cache, unsigned int threads)
+{
+	std::vector<ManifestLoadResult> results(paths.size());
+	std::vector<size_t> pending;
+
+	for (size_t i = 0; i < paths.size(); i++) {
+		ManifestLoadResult& result = results[i];
+		result.path = paths[i];
+		if (cache && cache->lookup(result.path, result.manifest)) {
+			result.cached = true;
+		} else {
+			pending.push_back(i);
+		}
+	}
+
+	if (threads == 0) {
+		threads = std::max(std::thread::hardware_concurrency(), 1U);
+	}
+	threads = std::min<size_t>(threads, pending.size());
+	if (threads <= 1) {
+		for (size_t i : pending) {
+			parse_one(results[i]);
+		}
+		return results;
+	}
+
+	/* Each worker takes the next manifest that nobody has claimed yet */
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t n = next++; n < pending.size(); n = next++) {
+			parse_one(results[pending[n]]);
+		}
+	};
+
+	log_debug("parsing %zu manifests with %u threads", pending.size(), threads);
+	std::vector<std::thread> workers;
+	for (unsigned int i = 1; i < threads; i++) {
+		try {
+			workers.emplace_back(worker);
+		} catch (const std::system_error& e) {
+			log_warning("unable to start a parser thread: %s", e.what());
+			break;
+		}
+	}
+	worker();
+	for (std::thread& t : workers) {
+		t.join();
+	}
+
+	return results;
+}
+
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "manifest.hpp"
+#include "manifestCache.hpp"
+
+namespace libjob
+{
+
+/** The outcome of reading one manifest with load_manifests() */
+struct ManifestLoadResult
+{
+	std::string path;
+	Manifest manifest;
+
+	/** True if the manifest came from the cache instead of being parsed */
+	bool cached = false;
+
+	/** Why the manifest could not be read, or empty if it was */
+	std::string error;
+};
+
+/**
+ * Read every manifest in @paths. Manifests that are up to date in @cache
+ * are taken from it first, on the calling thread. The rest are parsed,
+ * normalized and compiled by up to @threads threads; 0 means one per CPU.
+ *
+ * The results are in the same order as @paths, whatever order they were
+ * parsed in, so the caller sees the same outcome every time.
+ */
+std::vector<ManifestLoadResult> load_manifests(const std::vector<std::string>& paths,
+		ManifestCache *cache, unsigned int threads);
+
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "parser.hpp"
+
+namespace libjob
+{
+
+static nlohmann::json ucl_value_to_json(const ucl_object_t *obj)
+{
+	ucl_object_iter_t it = NULL;
+	const ucl_object_t *cur;
+
+	switch (ucl_object_type(obj)) {
+	case UCL_OBJECT: {
+		nlohmann::json result = nlohmann::json::object();
+		while ((cur = ucl_object_iterate(obj, &it, true)) != NULL) {
+			size_t keylen;
+			const char *key = ucl_object_keyl(cur, &keylen);
+			result[std::string(key, keylen)] = ucl_to_json(cur);
+		}
+		return result;
+	}
+	case UCL_ARRAY: {
+		nlohmann::json result = nlohmann::json::array();
+		while ((cur = ucl_object_iterate(obj, &it, true)) != NULL) {
+			result.push_back(ucl_to_json(cur));
+		}
+		return result;
+	}
+	case UCL_INT:
+		return nlohmann::json(ucl_object_toint(obj));
+	case UCL_FLOAT:
+	case UCL_TIME:
+		return nlohmann::json(ucl_object_todouble(obj));
+	case UCL_STRING: {
+		size_t len;
+		const char *s = ucl_object_tolstring(obj, &len);
+		return nlohmann::json(std::string(s, len));
+	}
+	case UCL_BOOLEAN:
+		return nlohmann::json(ucl_object_toboolean(obj));
+	default:
+		return nlohmann::json();
+	}
+}
+
+nlohmann::json ucl_to_json(const ucl_object_t *obj)
+{
+	if (obj->next == NULL) {
+		return ucl_value_to_json(obj);
+	}
+
+	/* A key that was given more than once has a chain of values */
+	nlohmann::json result = nlohmann::json::array();
+	ucl_object_iter_t it = NULL;
+	const ucl_object_t *cur;
+	while ((cur = ucl_object_iterate(obj, &it, false)) != NULL) {
+		result.push_back(ucl_value_to_json(cur));
+	}
+	return result;
+}
+
+}
@@ -27,3 +27,15 @@
 #pragma GCC diagnostic ignored "-Wall"
 #include <nlohmann/json.hpp>
 #pragma GCC diagnostic pop
+
+namespace libjob {
+
+/**
+ * Convert a UCL object into the same JSON document that emitting it with
+ * ucl_object_emit(UCL_EMIT_JSON) and parsing the result would produce,
+ * without the round trip through text. Keys that appear more than once in
+ * an object become an array of their values.
+ */
+nlohmann::json ucl_to_json(const ucl_object_t *obj);
+
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+#include "logger.h"
+#include "statusTable.hpp"
+
+namespace libjob
+{
+
+static const uint32_t STATUS_TABLE_MAGIC = 0x4a535442; /* "JSTB" */
+static const uint32_t STATUS_TABLE_VERSION = 1;
+
+/* How many times a reader retries a slot that keeps changing under it */
+static const int STATUS_TABLE_READ_ATTEMPTS = 1000;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the status table needs lock-free 32-bit atomics");
+static_assert(sizeof(status_table_header) == 64, "unexpected size of status_table_header");
+static_assert(sizeof(status_table_slot) == 64, "unexpected size of status_table_slot");
+
+static size_t table_size(uint32_t capacity, uint32_t label_space)
+{
+	return sizeof(status_table_header) + capacity * sizeof(status_table_slot) + label_space;
+}
+
+static status_table_slot *slots_of(void *base)
+{
+	return reinterpret_cast<status_table_slot *>(
+			static_cast<char *>(base) + sizeof(status_table_header));
+}
+
+static char *labels_of(void *base, uint32_t capacity)
+{
+	return static_cast<char *>(base) + sizeof(status_table_header) +
+			capacity * sizeof(status_table_slot);
+}
+
+static void begin_write(status_table_slot *slot)
+{
+	uint32_t seq = slot->sequence.load(std::memory_order_relaxed);
+	slot->sequence.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void end_write(status_table_slot *slot)
+{
+	uint32_t seq = slot->sequence.load(std::memory_order_relaxed);
+	slot->sequence.store(seq + 1, std::memory_order_release);
+}
+
+const char *JobStatusRecord::getStateString() const
+{
+	static const char *names[] = {
+		"invalid", "defined", "loaded", "waiting", "running", "killed", "exited",
+	};
+
+	if (state >= sizeof(names) / sizeof(names[0])) {
+		return "corrupt";
+	}
+	return names[state];
+}
+
+StatusTable::~StatusTable()
+{
+	this->unmap();
+}
+
+void StatusTable::unmap()
+{
+	if (this->base) {
+		(void) munmap(this->base, this->size);
+		(void) close(this->fd);
+	}
+	this->base = nullptr;
+	this->header = nullptr;
+	this->slots = nullptr;
+	this->labels = nullptr;
+	this->fd = -1;
+	this->size = 0;
+}
+
+void StatusTable::create(const std::string& path, uint32_t capacity)
+{
+	this->unmap();
+	this->free_slots.clear();
+	this->path = path;
+	this->rebuild(std::max(capacity, 1U), std::max(capacity, 1U) * 64);
+	log_debug("created status table at %s", path.c_str());
+}
+
+void StatusTable::destroy()
+{
+	if (this->isOpen()) {
+		(void) unlink(this->path.c_str());
+		this->unmap();
+	}
+}
+
+/*
+ * Copy the slots in use into a new file with room for @capacity slots and
+ * @label_space bytes of labels, and atomically replace the current file.
+ */
+void StatusTable::rebuild(uint32_t capacity, uint32_t label_space)
+{
+	std::string tmp_path = this->path + ".new";
+	size_t new_size = table_size(capacity, label_space);
+
+	int new_fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (new_fd < 0) {
+		log_errno("open(2) of %s", tmp_path.c_str());
+		throw std::system_error(errno, std::system_category());
+	}
+	/* Held until the file is closed, to show readers that jobd is alive */
+	if (flock(new_fd, LOCK_EX | LOCK_NB) < 0) {
+		int saved_errno = errno;
+		log_errno("flock(2) of %s", tmp_path.c_str());
+		(void) close(new_fd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	if (ftruncate(new_fd, new_size) < 0) {
+		int saved_errno = errno;
+		log_errno("ftruncate(2)");
+		(void) close(new_fd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	void *new_base = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, new_fd, 0);
+	if (new_base == MAP_FAILED) {
+		int saved_errno = errno;
+		log_errno("mmap(2)");
+		(void) close(new_fd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+
+	status_table_header *new_header = static_cast<status_table_header *>(new_base);
+	status_table_slot *new_slots = slots_of(new_base);
+	char *new_labels = labels_of(new_base, capacity);
+	uint32_t new_label_used = 0;
+	uint32_t high_water = 0;
+
+	new_header->magic = STATUS_TABLE_MAGIC;
+	new_header->version = STATUS_TABLE_VERSION;
+	new_header->capacity = capacity;
+	new_header->label_space = label_space;
+
+	if (this->header) {
+		high_water = this->header->high_water.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < high_water; i++) {
+			status_table_slot *src = &this->slots[i];
+			status_table_slot *dst = &new_slots[i];
+			if (!src->in_use.load(std::memory_order_relaxed)) {
+				continue;
+			}
+
+			uint32_t length = src->label_length.load(std::memory_order_relaxed);
+			std::copy(this->labels + src->label_offset.load(std::memory_order_relaxed),
+					this->labels + src->label_offset.load(std::memory_order_relaxed) + length,
+					new_labels + new_label_used);
+
+			dst->in_use.store(1, std::memory_order_relaxed);
+			dst->label_offset.store(new_label_used, std::memory_order_relaxed);
+			dst->label_length.store(length, std::memory_order_relaxed);
+			dst->pid.store(src->pid.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst->state.store(src->state.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst->enabled.store(src->enabled.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst->fault_state.store(src->fault_state.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst->last_exit_status.store(src->last_exit_status.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst->term_signal.store(src->term_signal.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst->started_at.store(src->started_at.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst->exited_at.store(src->exited_at.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst->updated_at.store(src->updated_at.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			new_label_used += length;
+		}
+	}
+	new_header->high_water.store(high_water, std::memory_order_release);
+
+	if (rename(tmp_path.c_str(), this->path.c_str()) < 0) {
+		int saved_errno = errno;
+		log_errno("rename(2) of %s", tmp_path.c_str());
+		(void) munmap(new_base, new_size);
+		(void) close(new_fd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+
+	/* Tell readers of the old file to open the new one */
+	if (this->header) {
+		this->header->retired.store(1, std::memory_order_release);
+		log_debug("grew status table to %u slots and %u bytes of labels", capacity, label_space);
+	}
+	this->unmap();
+
+	this->fd = new_fd;
+	this->base = new_base;
+	this->size = new_size;
+	this->header = new_header;
+	this->slots = new_slots;
+	this->labels = new_labels;
+	this->label_used = new_label_used;
+}
+
+uint32_t StatusTable::allocate(const std::string& label)
+{
+	if (!this->isOpen()) {
+		throw std::logic_error("the status table is not open");
+	}
+
+	if (this->label_used + label.size() > this->header->label_space) {
+		this->rebuild(this->header->capacity, 2 * this->header->label_space + label.size());
+	}
+
+	uint32_t slot;
+	if (!this->free_slots.empty()) {
+		slot = this->free_slots.back();
+		this->free_slots.pop_back();
+	} else {
+		slot = this->header->high_water.load(std::memory_order_relaxed);
+		if (slot == this->header->capacity) {
+			this->rebuild(2 * this->header->capacity, 2 * this->header->label_space);
+		}
+	}
+
+	std::copy(label.begin(), label.end(), this->labels + this->label_used);
+
+	status_table_slot *s = &this->slots[slot];
+	begin_write(s);
+	s->in_use.store(1, std::memory_order_relaxed);
+	s->label_offset.store(this->label_used, std::memory_order_relaxed);
+	s->label_length.store(label.size(), std::memory_order_relaxed);
+	s->pid.store(0, std::memory_order_relaxed);
+	s->state.store(JOB_STATUS_DEFINED, std::memory_order_relaxed);
+	s->enabled.store(0, std::memory_order_relaxed);
+	s->fault_state.store(0, std::memory_order_relaxed);
+	s->last_exit_status.store(0, std::memory_order_relaxed);
+	s->term_signal.store(0, std::memory_order_relaxed);
+	s->started_at.store(0, std::memory_order_relaxed);
+	s->exited_at.store(0, std::memory_order_relaxed);
+	s->updated_at.store(time(NULL), std::memory_order_relaxed);
+	end_write(s);
+
+	this->label_used += label.size();
+	if (slot == this->header->high_water.load(std::memory_order_relaxed)) {
+		this->header->high_water.store(slot + 1, std::memory_order_release);
+	}
+	return slot;
+}
+
+void StatusTable::release(uint32_t slot)
+{
+	if (!this->isOpen() || slot >= this->header->capacity) {
+		return;
+	}
+
+	status_table_slot *s = &this->slots[slot];
+	begin_write(s);
+	s->in_use.store(0, std::memory_order_relaxed);
+	end_write(s);
+	this->free_slots.push_back(slot);
+}
+
+void StatusTable::update(uint32_t slot, const JobStatusRecord& status)
+{
+	if (!this->isOpen() || slot >= this->header->capacity) {
+		return;
+	}
+
+	status_table_slot *s = &this->slots[slot];
+	begin_write(s);
+	s->pid.store(status.pid, std::memory_order_relaxed);
+	s->state.store(status.state, std::memory_order_relaxed);
+	s->enabled.store(status.enabled, std::memory_order_relaxed);
+	s->fault_state.store(status.fault_state, std::memory_order_relaxed);
+	s->last_exit_status.store(status.last_exit_status, std::memory_order_relaxed);
+	s->term_signal.store(status.term_signal, std::memory_order_relaxed);
+	s->started_at.store(status.started_at, std::memory_order_relaxed);
+	s->exited_at.store(status.exited_at, std::memory_order_relaxed);
+	s->updated_at.store(status.updated_at, std::memory_order_relaxed);
+	end_write(s);
+}
+
+StatusTableReader::~StatusTableReader()
+{
+	this->unmap();
+}
+
+void StatusTableReader::unmap()
+{
+	if (this->base) {
+		(void) munmap(this->base, this->size);
+		(void) close(this->fd);
+	}
+	this->base = nullptr;
+	this->fd = -1;
+	this->size = 0;
+}
+
+bool StatusTableReader::writerIsAlive()
+{
+	if (flock(this->fd, LOCK_SH | LOCK_NB) == 0) {
+		(void) flock(this->fd, LOCK_UN);
+		return false;
+	}
+	if (errno != EWOULDBLOCK) {
+		throw std::system_error(errno, std::system_category());
+	}
+	return true;
+}
+
+void StatusTableReader::open(const std::string& path)
+{
+	this->unmap();
+	this->path = path;
+
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		int saved_errno = errno;
+		(void) close(fd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	if ((size_t) sb.st_size < sizeof(status_table_header)) {
+		(void) close(fd);
+		throw std::runtime_error("the status table is truncated");
+	}
+
+	/* The descriptor is kept open to check the lock of the writer */
+	void *base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		int saved_errno = errno;
+		(void) close(fd);
+		throw std::system_error(saved_errno, std::system_category());
+	}
+	this->fd = fd;
+	this->base = base;
+	this->size = sb.st_size;
+
+	const status_table_header *header = static_cast<const status_table_header *>(base);
+	if (header->magic != STATUS_TABLE_MAGIC || header->version != STATUS_TABLE_VERSION ||
+			this->size < table_size(header->capacity, header->label_space)) {
+		this->unmap();
+		throw std::runtime_error("the status table is not valid");
+	}
+}
+
+std::vector<JobStatusRecord> StatusTableReader::read()
+{
+	std::vector<JobStatusRecord> result;
+
+	if (!this->base) {
+		throw std::logic_error("the status table is not open");
+	}
+
+	status_table_header *header = static_cast<status_table_header *>(this->base);
+	if (header->retired.load(std::memory_order_acquire)) {
+		this->open(this->path);
+		header = static_cast<status_table_header *>(this->base);
+	}
+	if (!this->writerIsAlive()) {
+		throw std::runtime_error("jobd is not running");
+	}
+
+	status_table_slot *slots = slots_of(this->base);
+	const char *labels = labels_of(this->base, header->capacity);
+	uint32_t high_water = std::min(header->high_water.load(std::memory_order_acquire),
+			header->capacity);
+
+	for (uint32_t i = 0; i < high_water; i++) {
+		status_table_slot *s = &slots[i];
+		JobStatusRecord rec;
+		bool in_use = false;
+		bool consistent = false;
+
+		for (int attempt = 0; attempt < STATUS_TABLE_READ_ATTEMPTS; attempt++) {
+			uint32_t seq = s->sequence.load(std::memory_order_acquire);
+			if (seq & 1) {
+				sched_yield();
+				continue;
+			}
+
+			in_use = s->in_use.load(std::memory_order_relaxed);
+			uint32_t offset = s->label_offset.load(std::memory_order_relaxed);
+			uint32_t length = s->label_length.load(std::memory_order_relaxed);
+			rec.pid = s->pid.load(std::memory_order_relaxed);
+			rec.state = s->state.load(std::memory_order_relaxed);
+			rec.enabled = s->enabled.load(std::memory_order_relaxed);
+			rec.fault_state = s->fault_state.load(std::memory_order_relaxed);
+			rec.last_exit_status = s->last_exit_status.load(std::memory_order_relaxed);
+			rec.term_signal = s->term_signal.load(std::memory_order_relaxed);
+			rec.started_at = s->started_at.load(std::memory_order_relaxed);
+			rec.exited_at = s->exited_at.load(std::memory_order_relaxed);
+			rec.updated_at = s->updated_at.load(std::memory_order_relaxed);
+
+			/* Labels are never overwritten, so only the offset needs to be consistent */
+			if (in_use && offset <= header->label_space && length <= header->label_space - offset) {
+				rec.label.assign(labels + offset, length);
+			} else {
+				in_use = false;
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (s->sequence.load(std::memory_order_relaxed) == seq) {
+				consistent = true;
+				break;
+			}
+		}
+
+		if (consistent && in_use) {
+			result.push_back(std::move(rec));
+		}
+	}
+
+	return result;
+}
+
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+namespace libjob
+{
+
+/** The state of a job, in the same order as job_state_t in jobd */
+typedef enum {
+	JOB_STATUS_INVALID,
+	JOB_STATUS_DEFINED,
+	JOB_STATUS_LOADED,
+	JOB_STATUS_WAITING,
+	JOB_STATUS_RUNNING,
+	JOB_STATUS_KILLED,
+	JOB_STATUS_EXITED,
+} job_status_state_t;
+
+/** A consistent copy of one entry in the status table */
+struct JobStatusRecord
+{
+	std::string label;
+	pid_t pid = 0;
+	uint32_t state = JOB_STATUS_INVALID;
+	bool enabled = false;
+	uint32_t fault_state = 0;
+	int32_t last_exit_status = 0;
+	int32_t term_signal = 0;
+
+	/* Wall clock times, in seconds since the epoch, or 0 if it never happened */
+	uint32_t started_at = 0;
+	uint32_t exited_at = 0;
+	uint32_t updated_at = 0;
+
+	/** The name of the state, as shown by jobadm(1) */
+	const char *getStateString() const;
+};
+
+/*
+ * The layout of the status table file. Every field that changes after
+ * the table is created is a lock-free 32-bit atomic, so that it can be
+ * shared between processes.
+ */
+struct status_table_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t label_space;
+
+	/** Set when jobd has replaced this file with a larger one */
+	std::atomic<uint32_t> retired;
+
+	/** Slots at or above this index have never been used */
+	std::atomic<uint32_t> high_water;
+
+	uint32_t reserved[10];
+};
+
+/*
+ * One job. The sequence number is odd while jobd is updating the slot;
+ * readers copy the slot, and retry if the sequence number was odd or
+ * changed while they were copying it.
+ */
+struct status_table_slot {
+	std::atomic<uint32_t> sequence;
+	std::atomic<uint32_t> in_use;
+	std::atomic<uint32_t> label_offset;
+	std::atomic<uint32_t> label_length;
+	std::atomic<int32_t> pid;
+	std::atomic<uint32_t> state;
+	std::atomic<uint32_t> enabled;
+	std::atomic<uint32_t> fault_state;
+	std::atomic<int32_t> last_exit_status;
+	std::atomic<int32_t> term_signal;
+	std::atomic<uint32_t> started_at;
+	std::atomic<uint32_t> exited_at;
+	std::atomic<uint32_t> updated_at;
+	uint32_t reserved[3];
+};
+
+/**
+ * The writer side of the status table: a memory-mapped file in the runtime
+ * directory, where jobd publishes the status of every job so that clients
+ * can read it without making a request over IPC.
+ *
+ * Labels are stored in an append-only area after the slots, so a label is
+ * never overwritten while a reader might be looking at it. When the slots
+ * or the label area run out, the table is rebuilt in a new file with room
+ * to grow, which replaces the old one. Slot numbers do not change.
+ *
+ * The writer holds an exclusive flock(2) on the file for as long as it has
+ * it open. The kernel drops the lock when jobd exits for any reason, which
+ * is how readers tell a live table from one that a crashed jobd left behind.
+ */
+class StatusTable
+{
+public:
+	StatusTable() {}
+	~StatusTable();
+
+	/** Create a new, empty table at @path */
+	void create(const std::string& path, uint32_t capacity = 256);
+
+	/** Unmap the table and remove the file */
+	void destroy();
+
+	bool isOpen() const { return header != nullptr; }
+
+	/** Allocate a slot for the job named @label, and return its number */
+	uint32_t allocate(const std::string& label);
+
+	/** Release a slot that was returned by allocate() */
+	void release(uint32_t slot);
+
+	/** Publish the status of the job in @slot. The label is ignored. */
+	void update(uint32_t slot, const JobStatusRecord& status);
+
+private:
+	std::string path;
+	int fd = -1;
+	void *base = nullptr;
+	size_t size = 0;
+	status_table_header *header = nullptr;
+	status_table_slot *slots = nullptr;
+	char *labels = nullptr;
+	uint32_t label_used = 0;
+	std::vector<uint32_t> free_slots;
+
+	StatusTable(const StatusTable&) = delete;
+	StatusTable& operator=(const StatusTable&) = delete;
+
+	void rebuild(uint32_t capacity, uint32_t label_space);
+	void unmap();
+};
+
+/**
+ * The reader side of the status table. Reading does not involve jobd in
+ * any way, so it is safe to poll as often as needed.
+ */
+class StatusTableReader
+{
+public:
+	StatusTableReader() {}
+	~StatusTableReader();
+
+	/** Map the table at @path. Throws std::system_error if it cannot be opened. */
+	void open(const std::string& path);
+
+	/**
+	 * Copy the status of every job. Throws std::runtime_error if jobd is no
+	 * longer running, because the table then shows how things were when it
+	 * went away.
+	 */
+	std::vector<JobStatusRecord> read();
+
+private:
+	std::string path;
+	int fd = -1;
+	void *base = nullptr;
+	size_t size = 0;
+
+	StatusTableReader(const StatusTableReader&) = delete;
+	StatusTableReader& operator=(const StatusTableReader&) = delete;
+
+	void unmap();
+
+	/** True if the writer still holds its lock on the table */
+	bool writerIsAlive();
+};
+
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Credential cache: parse a large number of manifests, each naming its own
+ * user and group, and resolve the credentials the way jobd does: once
+ * to fill in defaults during normalization, and once more each time the
+ * job is started. This is compared with going to getpwnam(3) and friends
+ * every time.
+ *
+ * The users and groups are taken round-robin from the local databases, so
+ * each distinct user is looked up many times when there are few of them.
+ *
+ * Usage: credcache [manifests] [starts per manifest]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <grp.h>
+#include <pwd.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+/* The parser in this version of json.hpp trips a false positive at -O2 in newer GCCs */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <nlohmann/json.hpp>
+#include <libjob/credentialCache.hpp>
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static std::vector<std::string> all_users()
+{
+	std::vector<std::string> result;
+	struct passwd *pwent;
+
+	setpwent();
+	while ((pwent = getpwent()) != NULL)
+		result.push_back(pwent->pw_name);
+	endpwent();
+	return result;
+}
+
+static std::vector<std::string> all_groups()
+{
+	std::vector<std::string> result;
+	struct group *grent;
+
+	setgrent();
+	while ((grent = getgrent()) != NULL)
+		result.push_back(grent->gr_name);
+	endgrent();
+	return result;
+}
+
+/* The lookups that jobd did for each manifest before it had a cache */
+static void resolve_uncached(const nlohmann::json& manifest, size_t starts)
+{
+	if (getpwuid(getuid()) == NULL || getgrgid(getgid()) == NULL)
+		errx(1, "lookup failed");
+	for (size_t i = 0; i < starts; i++) {
+		if (getpwnam(manifest["UserName"].get<std::string>().c_str()) == NULL)
+			errx(1, "getpwnam(3) failed");
+		if (getgrnam(manifest["GroupName"].get<std::string>().c_str()) == NULL)
+			errx(1, "getgrnam(3) failed");
+	}
+}
+
+static void resolve_cached(const nlohmann::json& manifest, size_t starts)
+{
+	libjob::CredentialCache& cache = libjob::CredentialCache::instance();
+
+	(void) cache.getUser(getuid());
+	(void) cache.getGroup(getgid());
+	for (size_t i = 0; i < starts; i++) {
+		(void) cache.getUser(manifest["UserName"].get<std::string>());
+		(void) cache.getGroup(manifest["GroupName"].get<std::string>());
+	}
+}
+
+static double run(const std::vector<std::string>& texts, size_t starts,
+		void (*resolve)(const nlohmann::json&, size_t))
+{
+	double t0 = now_usec();
+	for (const std::string& text : texts) {
+		nlohmann::json manifest = nlohmann::json::parse(text);
+		resolve(manifest, starts);
+	}
+	return now_usec() - t0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 10000;
+	size_t starts = 1;
+	std::vector<std::string> texts;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		starts = strtoul(argv[2], NULL, 10);
+
+	std::vector<std::string> users = all_users();
+	std::vector<std::string> groups = all_groups();
+	if (users.empty() || groups.empty())
+		errx(1, "no users or groups to look up");
+
+	for (size_t i = 0; i < count; i++) {
+		nlohmann::json j = {
+			{ "Label", "com.example.job" + std::to_string(i) },
+			{ "Program", { "/usr/bin/true" } },
+			{ "UserName", users[i % users.size()] },
+			{ "GroupName", groups[i % groups.size()] },
+		};
+		texts.push_back(j.dump());
+	}
+
+	double uncached = run(texts, starts, resolve_uncached);
+	double cached = run(texts, starts, resolve_cached);
+
+	printf("%zu manifests, %zu users, %zu groups, %zu start(s) each\n",
+			count, users.size(), groups.size(), starts);
+	printf("%10s %12s %14s\n", "", "total(ms)", "per manifest(us)");
+	printf("%10s %12.1f %14.2f\n", "uncached", uncached / 1000, uncached / count);
+	printf("%10s %12.1f %14.2f\n", "cached", cached / 1000, cached / count);
+
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * StartInterval timers: load 100k periodic jobs with intervals from one
+ * second to several days into the TimerWheel, then measure insert, cancel
+ * and expire throughput over a simulated hour. For comparison, the old
+ * timer.cpp scanned every periodic job on each wakeup; the cost of one
+ * such scan is shown as "scan".
+ *
+ * Usage: intervaltimers [jobs] [seconds]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "timerwheel.h"
+
+static double elapsed_ms(std::chrono::steady_clock::time_point t0)
+{
+	return std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - t0).count();
+}
+
+static void report(const char *op, size_t count, double ms)
+{
+	printf("%8s %10zu %12.2f %12.1f\n", op, count, ms, (ms * 1e6) / count);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t njobs = 100000;
+	time_t duration = 3600;
+
+	if (argc > 1)
+		njobs = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		duration = strtoul(argv[2], NULL, 10);
+
+	/* Intervals from 1 second up to about 4 days, biased towards short ones */
+	std::vector<time_t> interval(njobs);
+	for (size_t i = 0; i < njobs; i++) {
+		switch (i % 4) {
+		case 0: interval[i] = 1 + (i % 60); break;
+		case 1: interval[i] = 60 + (i % 3600); break;
+		case 2: interval[i] = 3600 + (i % 86400); break;
+		case 3: interval[i] = 86400 + (i % (3 * 86400)); break;
+		}
+	}
+
+	printf("%8s %10s %12s %12s\n", "op", "count", "total(ms)", "per-op(ns)");
+
+	TimerWheel wheel(0);
+	std::vector<TimerWheel::Entry> entries(njobs);
+
+	auto t0 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < njobs; i++)
+		wheel.schedule(entries[i], interval[i]);
+	report("insert", njobs, elapsed_ms(t0));
+
+	t0 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < njobs; i += 2)
+		wheel.cancel(entries[i]);
+	report("cancel", (njobs + 1) / 2, elapsed_ms(t0));
+
+	for (size_t i = 0; i < njobs; i += 2)
+		wheel.schedule(entries[i], interval[i]);
+
+	/* Follow the single kernel timer from one wakeup to the next */
+	std::vector<TimerWheel::Entry *> expired;
+	size_t wakeups = 0, fired = 0;
+	time_t now = 0;
+	t0 = std::chrono::steady_clock::now();
+	while (now < duration) {
+		now = wheel.nextWakeup();
+		wakeups++;
+		expired.clear();
+		wheel.advance(now, expired);
+		for (TimerWheel::Entry *entry : expired) {
+			wheel.schedule(*entry, now + interval[entry - entries.data()]);
+		}
+		fired += expired.size();
+	}
+	report("expire", fired, elapsed_ms(t0));
+
+	/* One pass over an unsorted list, as the old timer_handler() did */
+	std::vector<time_t> next_start(interval);
+	size_t due = 0;
+	t0 = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < njobs; i++) {
+		if (next_start[i] <= 30) {
+			next_start[i] += interval[i];
+			due++;
+		}
+	}
+	double scan_ms = elapsed_ms(t0);
+
+	printf("\n%zu kernel timer wakeups over %ld seconds; %zu timers pending\n",
+			wakeups, (long)duration, wheel.size());
+	printf("one full scan of %zu jobs: %.3f ms (%zu due), once per wakeup\n",
+			njobs, scan_ms, due);
+
+	return 0;
+}
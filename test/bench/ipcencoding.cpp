@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+/*
+ * IPC encoding: build the response to a `list' request for a large
+ * number of jobs, with the same fields that JobManager::listAllJobs()
+ * reports, and measure how long it takes to encode it as JSON text and as
+ * CBOR, and to decode it again. Both decoders must return the original
+ * document.
+ *
+ * Usage: ipcencoding [jobs] [iterations]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+extern "C" {
+#include <err.h>
+#include <time.h>
+}
+
+/* The parser in this version of json.hpp trips a false positive at -O2 in newer GCCs */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <libjob/contentHash.hpp>
+#include <libjob/jsonRPC.hpp>
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+using json = nlohmann::json;
+
+static json make_list_response(size_t jobs)
+{
+	json result = json::object();
+
+	for (size_t i = 0; i < jobs; i++) {
+		std::string label = "com.example.job" + std::to_string(i);
+		result[label] = {
+			{ "Pid", (i % 3) ? (int) (1000 + i) : 0 },
+			{ "State", (i % 3) ? "running" : "loaded" },
+			{ "Enabled", (i % 7) != 0 },
+			{ "FaultState", "none" },
+			{ "ManifestHash", libjob::content_hash_string(libjob::content_hash(label)) },
+		};
+	}
+
+	libjob::jsonRpcResponse response(1);
+	response.setResult(result);
+	return response.getJSON();
+}
+
+int main(int argc, char *argv[])
+{
+	size_t jobs = 50000;
+	unsigned int iterations = 5;
+
+	if (argc > 1)
+		jobs = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		iterations = strtoul(argv[2], NULL, 10);
+
+	json document = make_list_response(jobs);
+	const libjob::jsonRpcEncoding encodings[] = {
+		libjob::JSONRPC_ENCODING_JSON, libjob::JSONRPC_ENCODING_CBOR
+	};
+	double json_encode = 0, json_decode = 0;
+
+	printf("%8s %10s %12s %12s %12s %10s\n",
+			"encoding", "jobs", "size(bytes)", "encode(ms)", "decode(ms)", "speedup");
+	for (libjob::jsonRpcEncoding encoding : encodings) {
+		std::string buf;
+		json decoded;
+
+		double t0 = now_usec();
+		for (unsigned int i = 0; i < iterations; i++)
+			buf = libjob::jsonrpc_encode(document, encoding);
+		double t1 = now_usec();
+		for (unsigned int i = 0; i < iterations; i++)
+			decoded = libjob::jsonrpc_decode(buf, encoding);
+		double t2 = now_usec();
+
+		if (decoded != document)
+			errx(1, "%s: the decoded document is different",
+					libjob::jsonrpc_encoding_name(encoding).c_str());
+
+		double encode_ms = (t1 - t0) / 1e3 / iterations;
+		double decode_ms = (t2 - t1) / 1e3 / iterations;
+		if (encoding == libjob::JSONRPC_ENCODING_JSON) {
+			json_encode = encode_ms;
+			json_decode = decode_ms;
+		}
+		printf("%8s %10zu %12zu %12.1f %12.1f %9.2fx\n",
+				libjob::jsonrpc_encoding_name(encoding).c_str(), jobs, buf.size(),
+				encode_ms, decode_ms,
+				(json_encode + json_decode) / (encode_ms + decode_ms));
+	}
+
+	return 0;
+}
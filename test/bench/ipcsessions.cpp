@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+/*
+ * IPC sessions: run an IPC server on the native EventBackend, handling
+ * requests the way jobd does (non-blocking ipcSessions, responses queued
+ * and flushed, reads paused while output is pending), and measure the
+ * requests per second and the latency of each request with 1, 10 and 100
+ * concurrent clients. Each client either opens a new connection for every
+ * request, like jobctl used to, or keeps one connection open. The last
+ * mode keeps 16 requests in flight on each connection.
+ *
+ * Usage: ipcsessions [requests per client]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+/* The parser in this version of json.hpp trips a false positive at -O2 in newer GCCs */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <libjob/ipcSession.hpp>
+#include "event.h"
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static const unsigned int pipeline_depth = 16;
+
+static int listen_fd;
+static int stop_pipe[2];
+static struct sockaddr_un server_sa;
+
+/* Markers for the udata of each kind of watch */
+static int accept_marker, session_marker, stop_marker;
+
+static void server_main()
+{
+	std::unique_ptr<EventBackend> events = EventBackend::create();
+	std::unordered_map<int, std::unique_ptr<libjob::ipcSession>> sessions;
+	std::vector<Event> ready;
+
+	events->watchRead(listen_fd, &accept_marker);
+	events->watchRead(stop_pipe[0], &stop_marker);
+	for (;;) {
+		ready.clear();
+		events->wait(ready, 64);
+		for (const Event& ev : ready) {
+			if (ev.udata == &stop_marker)
+				return;
+			if (ev.udata == &accept_marker) {
+				int fd = accept(listen_fd, NULL, NULL);
+				if (fd < 0)
+					continue;
+				sessions[fd].reset(new libjob::ipcSession(fd));
+				events->watchRead(fd, &session_marker);
+				continue;
+			}
+
+			int fd = ev.ident;
+			auto it = sessions.find(fd);
+			if (it == sessions.end())
+				continue;
+			libjob::ipcSession& session = *it->second;
+			bool writable = (ev.type == EVENT_WRITE);
+			if (!writable) {
+				if (!session.fill()) {
+					events->unwatchRead(fd);
+					events->unwatchWrite(fd);
+					sessions.erase(it);
+					continue;
+				}
+				libjob::jsonRpcBatch batch;
+				while (session.nextRequest(batch)) {
+					for (size_t i = 0; i < batch.size(); i++) {
+						libjob::jsonRpcRequest& request = batch.getRequest(i);
+						libjob::jsonRpcResponse response(request.id());
+						response.setResult(request.method());
+						batch.addResponse(response);
+					}
+					session.queueResponse(batch);
+				}
+			}
+			if (session.flush()) {
+				if (writable) {
+					events->unwatchWrite(fd);
+					events->watchRead(fd, &session_marker);
+				}
+			} else if (!writable) {
+				events->unwatchRead(fd);
+				events->watchWrite(fd, &session_marker);
+			}
+		}
+	}
+}
+
+static int connect_to_server()
+{
+	int fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0)
+		err(1, "socket(2)");
+	if (connect(fd, (struct sockaddr *) &server_sa, SUN_LEN(&server_sa)) < 0)
+		err(1, "connect(2)");
+	return fd;
+}
+
+static std::string make_request(unsigned int id)
+{
+	libjob::jsonRpcRequest request;
+	request.setId(id);
+	request.setMethod("ping");
+	return request.dump();
+}
+
+static void check_response(const std::string& buf, unsigned int id)
+{
+	libjob::jsonRpcResponse response;
+	response.parse(buf);
+	if (response.id() != id)
+		errx(1, "expected the response to request %u, got %u", id, response.id());
+}
+
+enum client_mode { CONNECT_EACH, KEEPALIVE, PIPELINED };
+
+static void client_main(client_mode mode, size_t requests, std::vector<double>& latencies)
+{
+	libjob::ipcFrameBuffer frames;
+	std::string buf;
+	int fd = (mode == CONNECT_EACH) ? -1 : connect_to_server();
+
+	latencies.reserve(requests);
+	if (mode == PIPELINED) {
+		std::vector<double> sent(requests);
+		size_t next = 0;
+		for (size_t done = 0; done < requests; done++) {
+			while (next < requests && next < done + pipeline_depth) {
+				sent[next] = now_usec();
+				libjob::ipc_write_frame(fd, make_request(next));
+				next++;
+			}
+			frames.read(fd, buf);
+			check_response(buf, done);
+			latencies.push_back(now_usec() - sent[done]);
+		}
+	} else {
+		for (size_t i = 0; i < requests; i++) {
+			double t0 = now_usec();
+			if (mode == CONNECT_EACH)
+				fd = connect_to_server();
+			libjob::ipc_write_frame(fd, make_request(i));
+			frames.read(fd, buf);
+			check_response(buf, i);
+			if (mode == CONNECT_EACH) {
+				(void) close(fd);
+				fd = -1;
+			}
+			latencies.push_back(now_usec() - t0);
+		}
+	}
+	if (fd >= 0)
+		(void) close(fd);
+}
+
+static void run(client_mode mode, const char *name, unsigned int clients, size_t total)
+{
+	size_t requests = total / clients;
+	std::vector<std::vector<double>> latencies(clients);
+	std::vector<std::thread> threads;
+
+	double t0 = now_usec();
+	for (unsigned int i = 0; i < clients; i++)
+		threads.emplace_back(client_main, mode, requests, std::ref(latencies[i]));
+	for (auto& thread : threads)
+		thread.join();
+	double elapsed = now_usec() - t0;
+
+	std::vector<double> all;
+	for (auto& it : latencies)
+		all.insert(all.end(), it.begin(), it.end());
+	std::sort(all.begin(), all.end());
+
+	printf("%-10s %8u %10zu %12.0f %10.1f %10.1f\n", name, clients, all.size(),
+			all.size() / (elapsed / 1e6),
+			all[all.size() / 2], all[(all.size() * 99) / 100]);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t total = 20000;
+	char tmpl[] = "/tmp/ipcsessions.XXXXXX";
+
+	if (argc > 1)
+		total = strtoul(argv[1], NULL, 10);
+	if (mkdtemp(tmpl) == NULL)
+		err(1, "mkdtemp(3)");
+	std::string path = std::string(tmpl) + "/ipc.sock";
+
+	memset(&server_sa, 0, sizeof(server_sa));
+	server_sa.sun_family = AF_LOCAL;
+	strncpy(server_sa.sun_path, path.c_str(), sizeof(server_sa.sun_path) - 1);
+	if ((listen_fd = socket(AF_LOCAL, SOCK_STREAM, 0)) < 0)
+		err(1, "socket(2)");
+	if (bind(listen_fd, (struct sockaddr *) &server_sa, SUN_LEN(&server_sa)) < 0)
+		err(1, "bind(2)");
+	if (listen(listen_fd, 1024) < 0)
+		err(1, "listen(2)");
+	if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) < 0)
+		err(1, "fcntl(2)");
+	if (pipe(stop_pipe) < 0)
+		err(1, "pipe(2)");
+	std::thread server(server_main);
+
+	printf("%-10s %8s %10s %12s %10s %10s\n",
+			"mode", "clients", "requests", "requests/s", "p50(us)", "p99(us)");
+	const unsigned int client_counts[] = { 1, 10, 100 };
+	for (unsigned int clients : client_counts)
+		run(CONNECT_EACH, "connect", clients, total);
+	for (unsigned int clients : client_counts)
+		run(KEEPALIVE, "keepalive", clients, total);
+	for (unsigned int clients : client_counts)
+		run(PIPELINED, "pipelined", clients, total);
+
+	if (write(stop_pipe[1], "x", 1) != 1)
+		err(1, "write(2)");
+	server.join();
+	(void) unlink(path.c_str());
+	(void) rmdir(tmpl);
+
+	return 0;
+}
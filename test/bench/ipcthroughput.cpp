@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+/*
+ * IPC throughput: push framed messages of increasing size through a
+ * Unix-domain socket pair, the way jobd sends responses to jobadm, and
+ * measure how fast the receiver gets them out of its ipcFrameBuffer.
+ * Every message is checked when it arrives. The second table is a
+ * `list' response for a large number of jobs, end to end: build the
+ * JSON, send it as one frame, receive it and parse it again.
+ *
+ * Usage: ipcthroughput [jobs]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+/* The parser in this version of json.hpp trips a false positive at -O2 in newer GCCs */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <libjob/ipcFrame.hpp>
+#include <libjob/parser.hpp>
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static void frame_sizes()
+{
+	const size_t sizes[] = { 4096, 65536, 1 << 20, 8 << 20, 32 << 20 };
+	const size_t total = 256 << 20;
+
+	printf("%12s %10s %12s %10s %14s\n",
+			"size(bytes)", "messages", "time(ms)", "MB/s", "buffer(bytes)");
+	for (size_t size : sizes) {
+		int sv[2];
+		size_t count = total / size;
+
+		if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) < 0)
+			err(1, "socketpair(2)");
+
+		std::string message(size, 'x');
+		double t0 = now_usec();
+		std::thread writer([&]() {
+			for (size_t i = 0; i < count; i++)
+				libjob::ipc_write_frame(sv[0], message);
+		});
+
+		libjob::ipcFrameBuffer frames;
+		std::string received;
+		for (size_t i = 0; i < count; i++) {
+			frames.read(sv[1], received);
+			if (received.size() != size)
+				errx(1, "message %zu: expected %zu bytes, got %zu", i, size, received.size());
+		}
+		writer.join();
+		double ms = (now_usec() - t0) / 1e3;
+
+		printf("%12zu %10zu %12.1f %10.0f %14zu\n",
+				size, count, ms, (count * size) / (1 << 20) / (ms / 1e3),
+				frames.capacity());
+		(void) close(sv[0]);
+		(void) close(sv[1]);
+	}
+}
+
+static void list_response(size_t jobs)
+{
+	int sv[2];
+
+	if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) < 0)
+		err(1, "socketpair(2)");
+
+	double t0 = now_usec();
+	nlohmann::json result = nlohmann::json::object();
+	for (size_t i = 0; i < jobs; i++) {
+		std::string label = "com.example.job" + std::to_string(i);
+		nlohmann::json& job = result[label];
+		job["Pid"] = 1000 + i;
+		job["State"] = "running";
+		job["ManifestHash"] = "0123456789abcdef";
+		job["Enable"] = true;
+	}
+	nlohmann::json response;
+	response["jsonrpc"] = "2.0";
+	response["id"] = 1;
+	response["result"] = result;
+	std::string text = response.dump();
+	double t1 = now_usec();
+
+	std::thread writer([&]() {
+		libjob::ipc_write_frame(sv[0], text);
+	});
+	libjob::ipcFrameBuffer frames;
+	std::string received;
+	frames.read(sv[1], received);
+	writer.join();
+	double t2 = now_usec();
+
+	nlohmann::json parsed = nlohmann::json::parse(received);
+	double t3 = now_usec();
+	if (parsed["result"].size() != jobs)
+		errx(1, "expected %zu jobs, got %zu", jobs, parsed["result"].size());
+
+	printf("\n%10s %14s %10s %10s %10s\n",
+			"jobs", "response(MB)", "dump(ms)", "send(ms)", "parse(ms)");
+	printf("%10zu %14.1f %10.1f %10.1f %10.1f\n",
+			jobs, text.size() / 1048576.0,
+			(t1 - t0) / 1e3, (t2 - t1) / 1e3, (t3 - t2) / 1e3);
+	(void) close(sv[0]);
+	(void) close(sv[1]);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t jobs = 100000;
+
+	if (argc > 1)
+		jobs = strtoul(argv[1], NULL, 10);
+
+	frame_sizes();
+	list_response(jobs);
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Crash-looping KeepAlive jobs: every defined job exits again as soon as
+ * it is restarted, so the keepalive timer fires once per second with a
+ * handful of jobs due each time. Compare the old JobManager behavior of
+ * scanning every job twice per fire (once to restart, once to find the
+ * next wakeup) with the KeepaliveQueue min-heap.
+ *
+ * Usage: keepalivequeue [jobs] [fires] [throttle]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+#include "keepalive.h"
+
+/* Stand-in for the parts of Job that the scan touches */
+struct BenchJob {
+	bool exited;
+	time_t restart_after;
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point t0)
+{
+	return std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char *argv[])
+{
+	size_t njobs = 50000, nfires = 2000;
+	time_t throttle = 1000;
+	unsigned long scan_restarts = 0, heap_restarts = 0;
+
+	if (argc > 1)
+		njobs = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		nfires = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		throttle = strtoul(argv[3], NULL, 10);
+
+	std::vector<BenchJob> jobs(njobs);
+	for (size_t i = 0; i < njobs; i++) {
+		jobs[i].exited = true;
+		jobs[i].restart_after = 1 + (i % throttle);
+	}
+
+	auto t0 = std::chrono::steady_clock::now();
+	time_t now = 1;
+	for (size_t fire = 0; fire < nfires; fire++) {
+		for (BenchJob& job : jobs) {
+			if (job.exited && job.restart_after <= now) {
+				/* restarted, then promptly exits again */
+				job.restart_after = now + throttle;
+				scan_restarts++;
+			}
+		}
+		time_t next = std::numeric_limits<time_t>::max();
+		for (BenchJob& job : jobs) {
+			if (job.exited && job.restart_after > 0 && job.restart_after < next)
+				next = job.restart_after;
+		}
+		now = next;
+	}
+	double scan_ms = elapsed_ms(t0);
+
+	KeepaliveQueue queue;
+	std::vector<KeepaliveQueue::Entry> entries(njobs);
+	for (size_t i = 0; i < njobs; i++)
+		queue.schedule(entries[i], 1 + (i % throttle));
+
+	t0 = std::chrono::steady_clock::now();
+	now = 1;
+	std::vector<KeepaliveQueue::Entry*> due;
+	for (size_t fire = 0; fire < nfires; fire++) {
+		KeepaliveQueue::Entry* entry;
+		while ((entry = queue.popDue(now)) != nullptr)
+			due.push_back(entry);
+		for (KeepaliveQueue::Entry* e : due) {
+			queue.schedule(*e, now + throttle);
+			heap_restarts++;
+		}
+		due.clear();
+		now = queue.nextWakeup();
+	}
+	double heap_ms = elapsed_ms(t0);
+
+	if (scan_restarts != heap_restarts)
+		abort();
+
+	printf("%8s %8s %10s %8s %12s %12s\n", "jobs", "fires", "restarts", "method", "total(ms)", "per-fire(us)");
+	printf("%8zu %8zu %10lu %8s %12.2f %12.3f\n", njobs, nfires, scan_restarts, "scan",
+			scan_ms, (scan_ms * 1000) / nfires);
+	printf("%8zu %8zu %10lu %8s %12.2f %12.3f\n", njobs, nfires, heap_restarts, "heap",
+			heap_ms, (heap_ms * 1000) / nfires);
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Manifest cache: time how long it takes to go from a directory of
+ * manifests to a compiled Manifest for every one of them, the way
+ * JobManager::scanJobDirectory() does at startup. "parse" reads, parses,
+ * normalizes and compiles each file. "cold cache" does the same, and also
+ * fills and saves a libjob::ManifestCache. "warm cache" opens the saved
+ * cache and looks up every manifest in it.
+ *
+ * Usage: manifestcache [manifests]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <dirent.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+}
+
+/* The parser in this version of json.hpp trips a false positive at -O2 in newer GCCs */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <libjob/manifest.hpp>
+#include <libjob/manifestCache.hpp>
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static void write_manifests(const std::string& dir, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		std::string label = "com.example.job" + std::to_string(i);
+		std::ofstream ofs(dir + "/" + label + ".json");
+		ofs << "{\n"
+			<< "  \"Label\": \"" << label << "\",\n"
+			<< "  \"Program\": [\"/usr/bin/true\", \"--job\", \"" << i << "\"],\n"
+			<< "  \"EnvironmentVariables\": { \"JOB\": \"" << i << "\" },\n"
+			<< "  \"KeepAlive\": " << (i % 2 ? "true" : "false") << ",\n"
+			<< "  \"StartInterval\": " << (i % 5 ? 0 : 60) << ",\n"
+			<< "  \"StandardOutPath\": \"/var/log/" << label << ".log\"\n"
+			<< "}\n";
+		if (!ofs)
+			errx(1, "unable to write %s", label.c_str());
+	}
+}
+
+static std::vector<std::string> scan(const std::string& dir)
+{
+	std::vector<std::string> paths;
+	DIR *dirp = opendir(dir.c_str());
+	struct dirent *ent;
+
+	if (dirp == NULL)
+		err(1, "opendir(3)");
+	while ((ent = readdir(dirp)) != NULL) {
+		if (ent->d_name[0] != '.')
+			paths.push_back(dir + "/" + ent->d_name);
+	}
+	(void) closedir(dirp);
+	return paths;
+}
+
+/* Load every manifest in @dir, and return how long it took in milliseconds */
+static double load_all(const std::string& dir, libjob::ManifestCache *cache,
+		const std::string& cache_path)
+{
+	double t0 = now_usec();
+
+	if (cache)
+		cache->open(cache_path);
+	for (const std::string& path : scan(dir)) {
+		libjob::Manifest manifest;
+		if (!cache || !cache->lookup(path, manifest)) {
+			manifest.readFile(path);
+			if (cache)
+				cache->store(path, manifest);
+		}
+		if (manifest.fields.program.empty())
+			errx(1, "%s was not loaded", path.c_str());
+	}
+	if (cache)
+		cache->save();
+
+	return (now_usec() - t0) / 1e3;
+}
+
+static void report(const char *name, double ms, size_t count)
+{
+	printf("%-12s %12.1f %16.2f\n", name, ms, (ms * 1e3) / count);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 20000;
+	char tmpl[] = "/tmp/manifestcache.XXXXXX";
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (mkdtemp(tmpl) == NULL)
+		err(1, "mkdtemp(3)");
+	std::string tmpdir = tmpl;
+	std::string cache_path = tmpdir + "/manifest.cache";
+	std::string manifest_dir = tmpdir + "/manifest";
+	if (mkdir(manifest_dir.c_str(), 0755) < 0)
+		err(1, "mkdir(2)");
+	write_manifests(manifest_dir, count);
+
+	printf("%zu manifests\n", count);
+	printf("%-12s %12s %16s\n", "", "startup(ms)", "us/manifest");
+
+	report("parse", load_all(manifest_dir, NULL, cache_path), count);
+
+	libjob::ManifestCache cold;
+	report("cold cache", load_all(manifest_dir, &cold, cache_path), count);
+	if (cold.getMissCount() != count)
+		errx(1, "expected %zu misses, got %zu", count, cold.getMissCount());
+
+	libjob::ManifestCache warm;
+	report("warm cache", load_all(manifest_dir, &warm, cache_path), count);
+	if (warm.getHitCount() != count)
+		errx(1, "expected %zu hits, got %zu", count, warm.getHitCount());
+
+	std::string cleanup = "rm -rf " + tmpdir;
+	if (system(cleanup.c_str()) != 0)
+		errx(1, "unable to remove %s", tmpdir.c_str());
+
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Manifest parsing: time libjob::load_manifests() on a directory of
+ * manifests with 1, 2, 4 ... up to the given number of threads, without
+ * a manifest cache, so every manifest is read, parsed, normalized and
+ * compiled. This is what JobManager::scanJobDirectory() does at startup
+ * for the manifests that have changed.
+ *
+ * Usage: manifestparse [max-threads] [manifests...]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+}
+
+/* The parser in this version of json.hpp trips a false positive at -O2 in newer GCCs */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <libjob/manifestLoader.hpp>
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static std::vector<std::string> write_manifests(const std::string& dir, size_t count)
+{
+	std::vector<std::string> paths;
+
+	for (size_t i = 0; i < count; i++) {
+		std::string label = "com.example.job" + std::to_string(i);
+		std::string path = dir + "/" + label + ".json";
+		std::ofstream ofs(path);
+		ofs << "{\n"
+			<< "  \"Label\": \"" << label << "\",\n"
+			<< "  \"Program\": [\"/usr/bin/true\", \"--job\", \"" << i << "\"],\n"
+			<< "  \"EnvironmentVariables\": { \"JOB\": \"" << i << "\" },\n"
+			<< "  \"KeepAlive\": " << (i % 2 ? "true" : "false") << ",\n"
+			<< "  \"StartInterval\": " << (i % 5 ? 0 : 60) << ",\n"
+			<< "  \"StandardOutPath\": \"/var/log/" << label << ".log\"\n"
+			<< "}\n";
+		if (!ofs)
+			errx(1, "unable to write %s", path.c_str());
+		paths.push_back(path);
+	}
+	return paths;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+	std::vector<size_t> counts = { 10000, 50000, 100000 };
+	char tmpl[] = "/tmp/manifestparse.XXXXXX";
+
+	if (argc > 1)
+		max_threads = strtoul(argv[1], NULL, 10);
+	if (argc > 2) {
+		counts.clear();
+		for (int i = 2; i < argc; i++)
+			counts.push_back(strtoul(argv[i], NULL, 10));
+	}
+	if (mkdtemp(tmpl) == NULL)
+		err(1, "mkdtemp(3)");
+	std::string tmpdir = tmpl;
+
+	printf("%10s %8s %12s %14s %8s\n",
+			"manifests", "threads", "time(ms)", "manifests/s", "speedup");
+	for (size_t count : counts) {
+		std::string dir = tmpdir + "/" + std::to_string(count);
+		if (mkdir(dir.c_str(), 0755) < 0)
+			err(1, "mkdir(2)");
+		std::vector<std::string> paths = write_manifests(dir, count);
+
+		double base = 0;
+		for (unsigned int threads = 1; threads <= max_threads; threads *= 2) {
+			double t0 = now_usec();
+			auto results = libjob::load_manifests(paths, NULL, threads);
+			double ms = (now_usec() - t0) / 1e3;
+			for (auto& it : results) {
+				if (!it.error.empty())
+					errx(1, "%s: %s", it.path.c_str(), it.error.c_str());
+			}
+			if (threads == 1)
+				base = ms;
+			printf("%10zu %8u %12.1f %14.0f %7.2fx\n",
+					count, threads, ms, count / (ms / 1e3), base / ms);
+			if (threads < max_threads && threads * 2 > max_threads)
+				threads = max_threads / 2;
+		}
+	}
+
+	std::string cleanup = "rm -rf " + tmpdir;
+	if (system(cleanup.c_str()) != 0)
+		errx(1, "unable to remove %s", tmpdir.c_str());
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reap 10k child exits across 50k defined jobs, looking up the job that
+ * owns each pid with a scan of the label-keyed job table (the old
+ * JobManager::getJobByPid) and with the pid index. The index cost
+ * includes keeping it in sync: one erase per reap and one insert per restart.
+ *
+ * Usage: pidindex [jobs] [exits]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+/* Stand-in for the parts of Job that the lookup touches */
+struct BenchJob {
+	std::string label;
+	pid_t pid;
+};
+
+typedef std::map<std::string, std::unique_ptr<BenchJob>> job_table_t;
+
+static BenchJob& scan_for_pid(job_table_t& jobs, pid_t pid)
+{
+	for (auto& it : jobs) {
+		if (it.second->pid == pid)
+			return *it.second;
+	}
+	throw std::out_of_range("job not found");
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point t0)
+{
+	return std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char *argv[])
+{
+	size_t njobs = 50000, nexits = 10000;
+	job_table_t jobs;
+	std::unordered_map<pid_t, BenchJob*> index;
+	std::vector<BenchJob*> running;
+	pid_t next_pid = 100;
+
+	if (argc > 1)
+		njobs = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		nexits = strtoul(argv[2], NULL, 10);
+
+	for (size_t i = 0; i < njobs; i++) {
+		std::unique_ptr<BenchJob> job(new BenchJob);
+		job->label = "com.example.job." + std::to_string(i);
+		job->pid = next_pid++;
+		index[job->pid] = job.get();
+		running.push_back(job.get());
+		jobs.insert(std::make_pair(job->label, std::move(job)));
+	}
+
+	/* Reap pids in a scattered order, restarting each job with a new pid */
+	std::vector<size_t> order(nexits);
+	for (size_t i = 0; i < nexits; i++)
+		order[i] = (i * 7919) % njobs;
+
+	auto t0 = std::chrono::steady_clock::now();
+	unsigned long checksum = 0;
+	for (size_t i : order) {
+		BenchJob& job = scan_for_pid(jobs, running[i]->pid);
+		checksum += job.label.size();
+		job.pid = next_pid++;
+	}
+	double scan_ms = elapsed_ms(t0);
+
+	index.clear();
+	for (BenchJob* job : running)
+		index[job->pid] = job;
+
+	t0 = std::chrono::steady_clock::now();
+	for (size_t i : order) {
+		pid_t pid = running[i]->pid;
+		auto it = index.find(pid);
+		if (it == index.end())
+			throw std::out_of_range("job not found");
+		BenchJob& job = *it->second;
+		checksum -= job.label.size();
+		index.erase(it);
+		job.pid = next_pid++;
+		index[job.pid] = &job;
+	}
+	double index_ms = elapsed_ms(t0);
+
+	if (checksum != 0)
+		abort();
+
+	printf("%8s %8s %12s %12s %12s\n", "jobs", "exits", "method", "total(ms)", "per-reap(us)");
+	printf("%8zu %8zu %12s %12.2f %12.3f\n", njobs, nexits, "scan",
+			scan_ms, (scan_ms * 1000) / nexits);
+	printf("%8zu %8zu %12s %12.2f %12.3f\n", njobs, nexits, "index",
+			index_ms, (index_ms * 1000) / nexits);
+
+	return 0;
+}
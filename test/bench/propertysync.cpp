@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Property sync: enable and then disable a large number of jobs, under each
+ * of the sync policies of the property journal. The changes are either all
+ * made in one wakeup of the main loop (one IPC batch), or one per wakeup.
+ *
+ * Usage: propertysync [jobs]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <stdlib.h>
+#include <time.h>
+}
+
+#include <libjob/jobProperty.hpp>
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static void toggle(std::vector<std::unique_ptr<libjob::JobProperty>>& jobs,
+		bool enabled, bool one_batch)
+{
+	for (auto& job : jobs) {
+		job->setEnabled(enabled);
+		job->commit();
+		if (!one_batch)
+			libjob::JobProperty::flushJournal();
+	}
+	libjob::JobProperty::flushJournal();
+}
+
+static void run(const std::string& tmpdir, const char *policy_name, bool one_batch, size_t count)
+{
+	libjob::journal_sync_t policy;
+	if (!libjob::Journal::parseSyncPolicy(policy_name, policy))
+		errx(1, "bad policy");
+
+	std::string dir = tmpdir + "/" + policy_name + (one_batch ? "-batch" : "-each");
+	libjob::JobProperty::closeJournal();
+	libjob::JobProperty::setSyncPolicy(policy);
+	libjob::JobProperty::setDataDirectory(dir);
+
+	std::vector<std::unique_ptr<libjob::JobProperty>> jobs;
+	for (size_t i = 0; i < count; i++) {
+		jobs.emplace_back(new libjob::JobProperty);
+		jobs.back()->setLabel("com.example.job" + std::to_string(i));
+	}
+
+	unsigned long syncs = libjob::JobProperty::getSyncCount();
+	double t0 = now_usec();
+	toggle(jobs, true, one_batch);
+	toggle(jobs, false, one_batch);
+	double elapsed = now_usec() - t0;
+	syncs = libjob::JobProperty::getSyncCount() - syncs;
+
+	printf("%-8s %-12s %12.1f %14.2f %10lu\n", policy_name,
+			one_batch ? "one batch" : "per change",
+			elapsed / 1000, elapsed / (2 * count), syncs);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 10000;
+	char tmpl[] = "/tmp/propertysync.XXXXXX";
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (mkdtemp(tmpl) == NULL)
+		err(1, "mkdtemp(3)");
+	std::string tmpdir = tmpl;
+
+	printf("%zu jobs, enabled and then disabled\n", count);
+	printf("%-8s %-12s %12s %14s %10s\n", "policy", "wakeups", "total(ms)", "per change(us)", "fsyncs");
+	for (const char *policy : { "none", "batch", "write" }) {
+		run(tmpdir, policy, true, count);
+		run(tmpdir, policy, false, count);
+	}
+	libjob::JobProperty::closeJournal();
+
+	std::string cleanup = "rm -rf " + tmpdir;
+	if (system(cleanup.c_str()) != 0)
+		errx(1, "unable to remove %s", tmpdir.c_str());
+
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Reap latency: measure the time from the moment a child process calls
+ * _exit(2) until its exit status is delivered by the EventBackend, for
+ * the kqueue(2) backend and, on Linux, the native epoll(7) backend.
+ *
+ * On Linux the kqueue backend runs on top of libkqueue. Where that does
+ * not implement EVFILT_PROC, the exit is observed through SIGCHLD instead,
+ * followed by a waitpid(2) call, which is the best a kqueue-based jobd
+ * could do there.
+ *
+ * Usage: reaplatency [children]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <system_error>
+#include <vector>
+
+extern "C" {
+#include <dirent.h>
+#include <err.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+#include "event.h"
+#include "bench.h"
+
+/* Log to syslog, so that the probe for EVFILT_PROC does not clutter the table */
+FILE *logfile = NULL;
+
+/* The number of threads in this process, or 0 if that cannot be determined */
+static size_t count_threads()
+{
+	size_t count = 0;
+	DIR *dir = opendir("/proc/self/task");
+
+	if (!dir)
+		return 0;
+	while (struct dirent *ent = readdir(dir)) {
+		if (ent->d_name[0] != '.')
+			count++;
+	}
+	(void) closedir(dir);
+	return count;
+}
+
+/* Start a child, and return its pid once the backend is watching it */
+static pid_t spawn(EventBackend& events, bool use_sigchld, volatile double *exit_time)
+{
+	int pipefd[2];
+	char c = 0;
+
+	if (pipe(pipefd) < 0)
+		err(1, "pipe(2)");
+	pid_t pid = fork();
+	if (pid < 0) {
+		err(1, "fork(2)");
+	} else if (pid == 0) {
+		(void) close(pipefd[1]);
+		(void) read(pipefd[0], &c, 1);
+		*exit_time = now_usec();
+		_exit(0);
+	}
+	(void) close(pipefd[0]);
+	if (!use_sigchld)
+		events.watchProcess(pid, NULL);
+	if (write(pipefd[1], &c, 1) != 1)
+		err(1, "write(2)");
+	(void) close(pipefd[1]);
+	return pid;
+}
+
+static void reap_latency(const char *name, EventBackend& events, size_t children)
+{
+	std::vector<double> latency;
+	std::vector<Event> batch;
+	bool use_sigchld = false;
+	volatile double *exit_time;
+
+	exit_time = (volatile double *) mmap(NULL, sizeof(double),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (exit_time == MAP_FAILED)
+		err(1, "mmap(2)");
+
+	/* Probe for EVFILT_PROC support */
+	try {
+		events.watchProcess(getpid(), NULL);
+		events.unwatchProcess(getpid());
+	} catch (const std::system_error& e) {
+		use_sigchld = true;
+		events.watchSignal(SIGCHLD, NULL);
+	}
+
+	latency.reserve(children);
+	for (size_t i = 0; i < children; i++) {
+		pid_t pid = spawn(events, use_sigchld, exit_time);
+		bool reaped = false;
+
+		while (!reaped) {
+			batch.clear();
+			events.wait(batch, 64);
+			for (const Event& ev : batch) {
+				int status;
+				if (ev.type == EVENT_PROCESS_EXIT && (pid_t) ev.ident == pid) {
+					reaped = true;
+				} else if (ev.type == EVENT_SIGNAL && waitpid(pid, &status, WNOHANG) == pid) {
+					reaped = true;
+				}
+			}
+		}
+		latency.push_back(now_usec() - *exit_time);
+	}
+	(void) munmap((void *) exit_time, sizeof(double));
+
+	std::sort(latency.begin(), latency.end());
+	printf("%-8s %-10s %8zu %8zu %10.1f %10.1f %10.1f\n",
+			name, use_sigchld ? "SIGCHLD" : "process",
+			children, count_threads(),
+			latency[children / 2],
+			latency[(children * 99) / 100],
+			latency[children - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t children = 2000;
+
+	if (argc > 1)
+		children = strtoul(argv[1], NULL, 10);
+
+	printf("%-8s %-10s %8s %8s %10s %10s %10s\n",
+			"backend", "watch", "children", "threads", "p50(us)", "p99(us)", "max(us)");
+	{
+		std::unique_ptr<EventBackend> events = create_kqueue_backend();
+		reap_latency("kqueue", *events, children);
+	}
+#ifdef __linux__
+	{
+		std::unique_ptr<EventBackend> events = create_epoll_backend();
+		reap_latency("epoll", *events, children);
+	}
+#endif
+
+	return 0;
+}
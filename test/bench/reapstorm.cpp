@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reap storm: start a large number of children, make them all exit at the
+ * same instant, and measure how quickly the parent can harvest the
+ * NOTE_EXIT events when it pulls one event per kevent(2) call (the old
+ * behavior of JobManager::mainLoop) versus a batch of events per call.
+ *
+ * On Linux, libkqueue implements EVFILT_PROC by reaping the child itself,
+ * so its exit status can no longer be collected with waitpid(2). There, and
+ * wherever EVFILT_PROC is not available, each child holds the write end of
+ * a pipe instead, and the exit is observed as EOF.
+ *
+ * Usage: reapstorm [children] [batch...]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+#include "bench.h"
+
+#ifdef __linux__
+static bool have_evfilt_proc = false;
+#else
+static bool have_evfilt_proc = true;
+#endif
+
+/* Returns false if @exitfd was not needed, and has been closed */
+static bool watch_child(int kqfd, pid_t pid, int exitfd)
+{
+	struct kevent kev;
+
+	if (have_evfilt_proc) {
+		EV_SET(&kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
+		if (kevent(kqfd, &kev, 1, NULL, 0, NULL) == 0) {
+			(void) close(exitfd);
+			return false;
+		}
+		if (errno != ENOSYS && errno != EINVAL)
+			err(1, "kevent(2)");
+		have_evfilt_proc = false;
+	}
+
+	/* EOF is reported until the descriptor is closed, so only take it once */
+	EV_SET(&kev, exitfd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, (void *)(intptr_t) pid);
+	if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent(2)");
+	return true;
+}
+
+static pid_t event_pid(const struct kevent& kev)
+{
+	if (kev.filter == EVFILT_PROC) {
+		return kev.ident;
+	} else {
+		(void) close(kev.ident);
+		return (pid_t)(intptr_t) kev.udata;
+	}
+}
+
+static void reap_storm(size_t children, size_t batch)
+{
+	std::vector<struct kevent> events(batch);
+	std::vector<double> latency;
+	std::vector<int> exitfds;
+	size_t syscalls = 0;
+	int kqfd, pipefd[2];
+
+	if ((kqfd = kqueue()) < 0)
+		err(1, "kqueue(2)");
+	if (pipe(pipefd) < 0)
+		err(1, "pipe(2)");
+
+	/* Each child blocks until the write end of the pipe is closed */
+	for (size_t i = 0; i < children; i++) {
+		int exitfd[2];
+
+		if (pipe(exitfd) < 0)
+			err(1, "pipe(2)");
+		pid_t pid = fork();
+		if (pid < 0) {
+			err(1, "fork(2)");
+		} else if (pid == 0) {
+			char c;
+			(void) close(pipefd[1]);
+			(void) close(exitfd[0]);
+			/* The parent has to be the only holder of the earlier read ends */
+			for (int fd : exitfds)
+				(void) close(fd);
+			(void) read(pipefd[0], &c, 1);
+			_exit(0);
+		}
+		(void) close(exitfd[1]);
+		if (watch_child(kqfd, pid, exitfd[0]))
+			exitfds.push_back(exitfd[0]);
+	}
+
+	(void) close(pipefd[0]);
+	double t0 = now_usec();
+	(void) close(pipefd[1]);
+
+	latency.reserve(children);
+	while (latency.size() < children) {
+		int rv = kevent(kqfd, NULL, 0, events.data(), events.size(), NULL);
+		syscalls++;
+		if (rv < 0)
+			err(1, "kevent(2)");
+		for (int i = 0; i < rv; i++) {
+			int status;
+			if (waitpid(event_pid(events[i]), &status, 0) < 0)
+				err(1, "waitpid(2)");
+			latency.push_back(now_usec() - t0);
+		}
+	}
+	(void) close(kqfd);
+
+	std::sort(latency.begin(), latency.end());
+	printf("%6zu %8zu %10zu %12.3f %10.1f %10.1f %10.1f\n",
+			batch, children, syscalls,
+			(double) syscalls / children,
+			latency[children / 2],
+			latency[(children * 99) / 100],
+			latency[children - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t children = 500;
+	std::vector<size_t> batches = { 1, 64 };
+
+	if (argc > 1)
+		children = strtoul(argv[1], NULL, 10);
+	if (argc > 2) {
+		batches.clear();
+		for (int i = 2; i < argc; i++)
+			batches.push_back(strtoul(argv[i], NULL, 10));
+	}
+
+	printf("%6s %8s %10s %12s %10s %10s %10s\n",
+			"batch", "events", "kevent()", "calls/event",
+			"p50(us)", "p99(us)", "max(us)");
+	for (size_t batch : batches) {
+		reap_storm(children, batch);
+	}
+	if (!have_evfilt_proc)
+		puts("(EVFILT_PROC was not used; exits were observed via pipe EOF)");
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Spawn latency: measure how long it takes to start a job, as seen by the
+ * parent, when jobd calls fork(2) itself versus when it asks the spawn
+ * helper to do it. The number of loaded jobs is simulated by keeping a
+ * normalized manifest in memory for each one, so the address space that
+ * fork(2) has to copy grows as it does in jobd.
+ *
+ * Usage: spawnlatency [iterations] [jobs...]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+#include <nlohmann/json.hpp>
+
+#include "spawn.h"
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static std::vector<nlohmann::json> loaded_jobs;
+
+static void load_jobs(size_t count)
+{
+	while (loaded_jobs.size() < count) {
+		std::string label = "com.example.job" + std::to_string(loaded_jobs.size());
+		nlohmann::json j = {
+			{ "Label", label },
+			{ "Program", { "/usr/sbin/daemon", "-f", "/usr/local/bin/" + label } },
+			{ "EnvironmentVariables", { { "LABEL", label }, { "LANG", "C" } } },
+			{ "Enable", true },
+			{ "KeepAlive", false },
+			{ "Nice", 0 },
+			{ "StandardErrorPath", "/dev/null" },
+			{ "StandardInPath", "/dev/null" },
+			{ "StandardOutPath", "/dev/null" },
+			{ "StartInterval", 0 },
+			{ "ThrottleInterval", 10 },
+			{ "UserName", "root" },
+			{ "GroupName", "wheel" },
+			{ "WorkingDirectory", "/" },
+		};
+		loaded_jobs.push_back(j);
+	}
+}
+
+static double percentile(std::vector<double>& v, size_t pct)
+{
+	std::sort(v.begin(), v.end());
+	return v[(v.size() * pct) / 100];
+}
+
+static void fork_latency(size_t iterations, std::vector<double>& latency)
+{
+	for (size_t i = 0; i < iterations; i++) {
+		int status;
+
+		double t0 = now_usec();
+		pid_t pid = fork();
+		if (pid < 0) {
+			err(1, "fork(2)");
+		} else if (pid == 0) {
+			execl("/bin/true", "/bin/true", (char *) NULL);
+			_exit(127);
+		}
+		latency.push_back(now_usec() - t0);
+		if (waitpid(pid, &status, 0) < 0)
+			err(1, "waitpid(2)");
+	}
+}
+
+static void helper_latency(SpawnHelper& helper, size_t iterations, std::vector<double>& latency)
+{
+	LaunchDescriptor launch;
+	LaunchPlan plan;
+	std::vector<int> fds;
+
+	launch.argv = { "/bin/true" };
+	launch.working_directory = "/";
+	launch.stdin_path = "/dev/null";
+	launch.stdout_path = "/dev/null";
+	launch.stderr_path = "/dev/null";
+	plan.compile(launch);
+
+	for (size_t i = 0; i < iterations; i++) {
+		struct pollfd pfd;
+		pid_t pid, reaped = -1;
+		int status;
+
+		double t0 = now_usec();
+		pid = helper.spawn(plan, fds);
+		latency.push_back(now_usec() - t0);
+
+		pfd.fd = helper.getExitDescriptor();
+		pfd.events = POLLIN;
+		while (reaped != pid) {
+			if (poll(&pfd, 1, -1) < 0)
+				err(1, "poll(2)");
+			while (helper.readExit(reaped, status) && reaped != pid) {}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	size_t iterations = 200;
+	std::vector<size_t> job_counts = { 0, 1000, 10000, 50000 };
+	SpawnHelper helper;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+	if (argc > 2) {
+		job_counts.clear();
+		for (int i = 2; i < argc; i++)
+			job_counts.push_back(strtoul(argv[i], NULL, 10));
+	}
+
+	/* Like jobd, start the helper before anything is loaded */
+	helper.start();
+
+	printf("%8s %12s %12s %12s %12s\n", "jobs",
+			"fork p50", "fork p99", "helper p50", "helper p99");
+	for (size_t jobs : job_counts) {
+		std::vector<double> forked, spawned;
+
+		load_jobs(jobs);
+		fork_latency(iterations, forked);
+		helper_latency(helper, iterations, spawned);
+		printf("%8zu %10.1fus %10.1fus %10.1fus %10.1fus\n", jobs,
+				percentile(forked, 50), percentile(forked, 99),
+				percentile(spawned, 50), percentile(spawned, 99));
+	}
+
+	helper.stop();
+	return 0;
+}
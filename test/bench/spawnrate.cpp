@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Spawn rate: measure how many jobs per second can be started from a
+ * process the size of jobd, using the full fork(2) path versus the vfork(2)
+ * fast path that is taken by jobs with no chroot jail, Capsicum or custom
+ * descriptors. The number of loaded jobs is simulated by keeping a
+ * normalized manifest in memory for each one.
+ *
+ * The fast path works from a LaunchPlan that was compiled in advance, so
+ * it should not allocate any memory; the number of calls to operator new
+ * per spawn is counted to make sure of that.
+ *
+ * Usage: spawnrate [spawns] [jobs...]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+#include <nlohmann/json.hpp>
+
+#include "spawn.h"
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+	allocations++;
+	void *p = malloc(size);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+static std::vector<nlohmann::json> loaded_jobs;
+
+static void load_jobs(size_t count)
+{
+	while (loaded_jobs.size() < count) {
+		std::string label = "com.example.job" + std::to_string(loaded_jobs.size());
+		nlohmann::json j = {
+			{ "Label", label },
+			{ "Program", { "/usr/sbin/daemon", "-f", "/usr/local/bin/" + label } },
+			{ "EnvironmentVariables", { { "LABEL", label }, { "LANG", "C" } } },
+			{ "Enable", true },
+			{ "KeepAlive", false },
+			{ "Nice", 0 },
+			{ "StandardErrorPath", "/dev/null" },
+			{ "StandardInPath", "/dev/null" },
+			{ "StandardOutPath", "/dev/null" },
+			{ "StartInterval", 0 },
+			{ "ThrottleInterval", 10 },
+			{ "UserName", "root" },
+			{ "GroupName", "wheel" },
+			{ "WorkingDirectory", "/" },
+		};
+		loaded_jobs.push_back(j);
+	}
+}
+
+static LaunchDescriptor true_launch()
+{
+	LaunchDescriptor launch;
+
+	launch.argv = { "/bin/true" };
+	launch.envp = { "PATH=/bin:/usr/bin" };
+	launch.working_directory = "/";
+	launch.stdin_path = "/dev/null";
+	launch.stdout_path = "/dev/null";
+	launch.stderr_path = "/dev/null";
+	return launch;
+}
+
+static LaunchPlan plan;
+
+static void reap(std::vector<pid_t>& pids)
+{
+	int status;
+
+	for (pid_t pid : pids) {
+		if (waitpid(pid, &status, 0) < 0)
+			err(1, "waitpid(2)");
+	}
+	pids.clear();
+}
+
+/* The full path: fork(2), then apply the launch descriptor in the child */
+static double fork_rate(size_t spawns)
+{
+	LaunchDescriptor launch = true_launch();
+	std::vector<pid_t> pids;
+
+	double t0 = now_usec();
+	for (size_t i = 0; i < spawns; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			err(1, "fork(2)");
+		} else if (pid == 0) {
+			launch_descriptor_exec(launch, NULL);
+		}
+		pids.push_back(pid);
+	}
+	double elapsed = now_usec() - t0;
+	reap(pids);
+	return spawns / (elapsed / 1e6);
+}
+
+static double vfork_rate(size_t spawns, double& allocs_per_spawn)
+{
+	std::vector<pid_t> pids;
+
+	pids.reserve(spawns);
+	size_t allocs_before = allocations;
+	double t0 = now_usec();
+	for (size_t i = 0; i < spawns; i++) {
+		pids.push_back(launch_plan_vfork(plan));
+	}
+	double elapsed = now_usec() - t0;
+	allocs_per_spawn = (double)(allocations - allocs_before) / spawns;
+	reap(pids);
+	return spawns / (elapsed / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t spawns = 1000;
+	std::vector<size_t> job_counts = { 0, 10000, 50000 };
+
+	if (argc > 1)
+		spawns = strtoul(argv[1], NULL, 10);
+	if (argc > 2) {
+		job_counts.clear();
+		for (int i = 2; i < argc; i++)
+			job_counts.push_back(strtoul(argv[i], NULL, 10));
+	}
+
+	plan.compile(true_launch());
+
+	printf("%8s %14s %14s %14s\n", "jobs", "fork/sec", "vfork/sec", "allocs/spawn");
+	for (size_t jobs : job_counts) {
+		double allocs;
+
+		load_jobs(jobs);
+		double forked = fork_rate(spawns);
+		double vforked = vfork_rate(spawns, allocs);
+		printf("%8zu %14.0f %14.0f %14.2f\n", jobs, forked, vforked, allocs);
+	}
+
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Status journal: persist the status of a large number of jobs as one JSON
+ * file per job (the way JobStatus used to), and as records in a
+ * libjob::Journal. The update cost is measured both for a burst of updates
+ * that share one flush, and for updates that are flushed one at a time (one
+ * reap per main loop iteration). Startup is the time to read back and parse
+ * the status of every job.
+ *
+ * Usage: statusjournal [jobs]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+}
+
+/* The parser in this version of json.hpp trips a false positive at -O2 in newer GCCs */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <nlohmann/json.hpp>
+#include <libjob/journal.hpp>
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static std::string make_dir(const std::string& parent, const char *name)
+{
+	std::string path = parent + "/" + name;
+	if (mkdir(path.c_str(), 0755) < 0)
+		err(1, "mkdir(2)");
+	return path;
+}
+
+static std::string label_of(size_t i)
+{
+	return "com.example.job" + std::to_string(i);
+}
+
+static std::string status_of(size_t i)
+{
+	nlohmann::json j = {
+		{ "JobStatusAPI", 0 },
+		{ "Label", label_of(i) },
+		{ "Pid", 0 },
+		{ "LastExitStatus", i % 3 },
+		{ "TermSignal", 0 },
+	};
+	return j.dump();
+}
+
+static double files_update(const std::string& dir, const std::vector<std::string>& status)
+{
+	double t0 = now_usec();
+	for (size_t i = 0; i < status.size(); i++) {
+		std::ofstream ofs(dir + "/" + label_of(i) + ".json", std::ofstream::out);
+		ofs << status[i];
+	}
+	return now_usec() - t0;
+}
+
+static double files_startup(const std::string& dir, size_t jobs)
+{
+	double t0 = now_usec();
+	for (size_t i = 0; i < jobs; i++) {
+		std::ifstream ifs(dir + "/" + label_of(i) + ".json", std::ifstream::in);
+		nlohmann::json j;
+		ifs >> j;
+		if (j["Label"].get<std::string>().empty())
+			errx(1, "bad status");
+	}
+	return now_usec() - t0;
+}
+
+static double journal_update(const std::string& dir, const std::vector<std::string>& status,
+		bool flush_each)
+{
+	libjob::Journal journal;
+	journal.open(dir);
+
+	double t0 = now_usec();
+	for (size_t i = 0; i < status.size(); i++) {
+		journal.put(label_of(i), status[i]);
+		if (flush_each)
+			journal.flush();
+	}
+	journal.flush();
+	double elapsed = now_usec() - t0;
+
+	journal.close();
+	return elapsed;
+}
+
+static double journal_startup(const std::string& dir, size_t jobs)
+{
+	double t0 = now_usec();
+	libjob::Journal journal;
+	journal.open(dir);
+	for (size_t i = 0; i < jobs; i++) {
+		std::string buf;
+		if (!journal.take(label_of(i), buf))
+			errx(1, "status of job %zu is missing", i);
+		nlohmann::json j = nlohmann::json::parse(buf);
+		if (j["Label"].get<std::string>().empty())
+			errx(1, "bad status");
+	}
+	double elapsed = now_usec() - t0;
+
+	journal.close();
+	return elapsed;
+}
+
+static void report(const char *name, double update, double startup, size_t jobs)
+{
+	printf("%-16s %16.2f %14.1f\n", name, update / jobs, startup / 1000);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t jobs = 50000;
+	char tmpl[] = "/tmp/statusjournal.XXXXXX";
+
+	if (argc > 1)
+		jobs = strtoul(argv[1], NULL, 10);
+	if (mkdtemp(tmpl) == NULL)
+		err(1, "mkdtemp(3)");
+	std::string tmpdir = tmpl;
+
+	std::vector<std::string> status;
+	for (size_t i = 0; i < jobs; i++)
+		status.push_back(status_of(i));
+
+	printf("%zu jobs\n", jobs);
+	printf("%-16s %16s %14s\n", "", "update(us/job)", "startup(ms)");
+
+	std::string files_dir = make_dir(tmpdir, "files");
+	double update = files_update(files_dir, status);
+	report("file per job", update, files_startup(files_dir, jobs), jobs);
+
+	/* Two passes, so the second one replays a journal with a snapshot */
+	std::string burst_dir = make_dir(tmpdir, "burst");
+	(void) journal_update(burst_dir, status, false);
+	update = journal_update(burst_dir, status, false);
+	report("journal, burst", update, journal_startup(burst_dir, jobs), jobs);
+
+	std::string each_dir = make_dir(tmpdir, "each");
+	(void) journal_update(each_dir, status, true);
+	update = journal_update(each_dir, status, true);
+	report("journal, each", update, journal_startup(each_dir, jobs), jobs);
+
+	std::string cleanup = "rm -rf " + tmpdir;
+	if (system(cleanup.c_str()) != 0)
+		errx(1, "unable to remove %s", tmpdir.c_str());
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * UCL manifests: measure how many UCL manifests per second can be turned
+ * into a JSON document, the way Manifest::parseUCL() used to do it (read
+ * the file into a string, parse it, emit the object as JSON text, and
+ * parse that text again) and the way it does it now (map the file, parse
+ * it, and convert the UCL object with libjob::ucl_to_json()). Both must
+ * produce the same document. The last row is the whole of
+ * Manifest::readFile(), including normalize() and compile().
+ *
+ * Usage: uclmanifest [manifests]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+/* The parser in this version of json.hpp trips a false positive at -O2 in newer GCCs */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <libjob/manifest.hpp>
+#include <libjob/parser.hpp>
+#include "bench.h"
+
+FILE *logfile = NULL;
+
+static std::vector<std::string> write_manifests(const std::string& dir, size_t count)
+{
+	std::vector<std::string> paths;
+
+	for (size_t i = 0; i < count; i++) {
+		std::string label = "com.example.job" + std::to_string(i);
+		std::string path = dir + "/" + label + ".ucl";
+		std::ofstream ofs(path);
+		ofs << "Label = \"" << label << "\";\n"
+			<< "Description = \"Example job number " << i << "\";\n"
+			<< "Program = [ \"/usr/local/bin/exampled\", \"--instance\", \"" << i << "\", \"--verbose\" ];\n"
+			<< "EnvironmentVariables {\n"
+			<< "    INSTANCE = \"" << i << "\";\n"
+			<< "    LANG = \"C.UTF-8\";\n"
+			<< "}\n"
+			<< "KeepAlive = " << (i % 2 ? "true" : "false") << ";\n"
+			<< "StartInterval = " << (i % 5 ? 0 : 60) << ";\n"
+			<< "Nice = " << (int)(i % 10) - 5 << ";\n"
+			<< "StandardOutPath = \"/var/log/" << label << ".log\";\n"
+			<< "StandardErrorPath = \"/var/log/" << label << ".err\";\n"
+			<< "Sockets {\n"
+			<< "    Listener { SockServiceName = " << 8000 + i << "; SockFamily = \"IPv4\"; }\n"
+			<< "}\n";
+		if (!ofs)
+			errx(1, "unable to write %s", path.c_str());
+		paths.push_back(path);
+	}
+	return paths;
+}
+
+static ucl_object_t *parse_ucl(const unsigned char *data, size_t len)
+{
+	struct ucl_parser *parser = ucl_parser_new(0);
+
+	if (!ucl_parser_add_chunk(parser, data, len))
+		errx(1, "%s", ucl_parser_get_error(parser));
+	ucl_object_t *obj = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+	return obj;
+}
+
+/* The way Manifest::parseUCL() used to do it */
+static nlohmann::json load_via_text(const std::string& path)
+{
+	std::ifstream ifs(path, std::ifstream::in);
+	std::stringstream buf;
+	buf << ifs.rdbuf();
+	std::string text = buf.str();
+
+	ucl_object_t *obj = parse_ucl((const unsigned char *) text.c_str(), text.length());
+	unsigned char *ucl_buf = ucl_object_emit(obj, UCL_EMIT_JSON);
+	nlohmann::json result = nlohmann::json::parse((char *) ucl_buf);
+	free(ucl_buf);
+	ucl_object_unref(obj);
+	return result;
+}
+
+/* The way Manifest::parseUCL() does it now */
+static nlohmann::json load_direct(const std::string& path)
+{
+	struct stat sb;
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &sb) < 0)
+		err(1, "%s", path.c_str());
+	void *p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap(2)");
+	(void) close(fd);
+
+	ucl_object_t *obj = parse_ucl((const unsigned char *) p, sb.st_size);
+	nlohmann::json result = libjob::ucl_to_json(obj);
+	ucl_object_unref(obj);
+	(void) munmap(p, sb.st_size);
+	return result;
+}
+
+template <typename F>
+static void report(const char *name, const std::vector<std::string>& paths, F load)
+{
+	double t0 = now_usec();
+	for (const std::string& path : paths)
+		load(path);
+	double elapsed = now_usec() - t0;
+
+	printf("%-14s %12.0f %14.2f\n", name,
+			paths.size() / (elapsed / 1e6), elapsed / paths.size());
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 20000;
+	char tmpl[] = "/tmp/uclmanifest.XXXXXX";
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (mkdtemp(tmpl) == NULL)
+		err(1, "mkdtemp(3)");
+	std::string tmpdir = tmpl;
+	std::vector<std::string> paths = write_manifests(tmpdir, count);
+
+	for (const std::string& path : paths) {
+		if (load_via_text(path) != load_direct(path))
+			errx(1, "the documents for %s are different", path.c_str());
+	}
+
+	printf("%zu manifests\n", count);
+	printf("%-14s %12s %14s\n", "", "manifests/s", "us/manifest");
+	report("emit+parse", paths, load_via_text);
+	report("direct", paths, load_direct);
+	report("readFile()", paths, [](const std::string& path) {
+		libjob::Manifest manifest;
+		manifest.readFile(path);
+	});
+
+	std::string cleanup = "rm -rf " + tmpdir;
+	if (system(cleanup.c_str()) != 0)
+		errx(1, "unable to remove %s", tmpdir.c_str());
+
+	return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Verify that changes to JobStatus and JobProperty are coalesced, so that
+ * reaping a job costs at most one write of each file, and that the journal
+ * they are written to survives a torn write.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+extern "C" {
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include <libjob/journal.hpp>
+#include <libjob/jobProperty.hpp>
+#include <libjob/jobStatus.hpp>
+
+#define run(test) do { \
+	printf("%-32s", ""#test); \
+	if (test() != 0) { \
+		puts("FAILED"); \
+		exit(1); \
+	} else { \
+		puts("passed"); \
+	} \
+} while(0)
+
+#define fail(_message) do { \
+	printf("FAIL: %s\n", _message); \
+	return -1; \
+} while (0)
+
+#define expect_writes(_obj, _count) do { \
+	if ((_obj).getWriteCount() != (_count)) { \
+		printf("FAIL: %s: expected %lu writes, got %lu\n", #_obj, \
+				(unsigned long)(_count), (_obj).getWriteCount()); \
+		return -1; \
+	} \
+} while (0)
+
+static std::string tmpdir;
+
+/* The same sequence of calls that JobManager::reapChildProcess() makes */
+static void reap(libjob::JobStatus& status, int last_exit_status, int term_signal)
+{
+	status.setLastExitStatus(last_exit_status);
+	status.setTermSignal(term_signal);
+	status.setPid(0);
+}
+
+static int test_reap_is_one_write()
+{
+	libjob::JobStatus status;
+
+	status.setLabel("reap");
+	status.setPid(1234);
+	status.commit();
+	expect_writes(status, 1);
+
+	reap(status, 3, 0);
+	expect_writes(status, 1);
+	if (!status.isDirty())
+		fail("reap did not mark the status as dirty");
+	status.commit();
+	expect_writes(status, 2);
+
+	/* Everything committed is appended to the journal with one flush */
+	libjob::JobStatus::flushJournal();
+	libjob::Journal journal;
+	std::string buf;
+	journal.open(tmpdir + "/status");
+	if (!journal.take("reap", buf))
+		fail("status was not written to the journal");
+	nlohmann::json j = nlohmann::json::parse(buf);
+	if (j["LastExitStatus"].get<int>() != 3 || j["TermSignal"].get<int>() != 0 ||
+			j["Pid"].get<int>() != 0)
+		fail("status file does not reflect the reap");
+
+	return 0;
+}
+
+static int test_clean_commit_is_free()
+{
+	libjob::JobStatus status;
+	libjob::JobProperty property;
+
+	status.setLabel("clean");
+	property.setLabel("clean");
+	status.commit();
+	property.commit();
+	expect_writes(status, 0);
+	expect_writes(property, 0);
+
+	reap(status, 0, 9);
+	status.commit();
+	status.commit();
+	expect_writes(status, 1);
+	if (status.getTermSignal() != 9)
+		fail("wrong term signal");
+
+	return 0;
+}
+
+static int test_fault_is_one_write()
+{
+	libjob::JobProperty property;
+
+	property.setLabel("fault");
+	property.setEnabled(true);
+	property.setFaulted(libjob::JobProperty::JOB_FAULT_STATE_OFFLINE,
+			"The process exited unexpectedly");
+	expect_writes(property, 0);
+	property.commit();
+	expect_writes(property, 1);
+
+	/* The properties survive a restart */
+	libjob::JobProperty::closeJournal();
+	std::string property_dir = tmpdir + "/property";
+	libjob::JobProperty::setDataDirectory(property_dir);
+	libjob::JobProperty reloaded;
+	reloaded.setLabel("fault");
+	if (!reloaded.isEnabled() || !reloaded.isFaulted())
+		fail("properties were not persisted");
+
+	return 0;
+}
+
+static int test_unload_discards_changes()
+{
+	libjob::JobStatus status;
+
+	status.setLabel("unload");
+	reap(status, 1, 0);
+	status.unloadHandler();
+	status.commit();
+	expect_writes(status, 0);
+	libjob::JobStatus::flushJournal();
+	libjob::Journal journal;
+	std::string buf;
+	journal.open(tmpdir + "/status");
+	if (journal.take("unload", buf))
+		fail("status was recreated after unload");
+
+	return 0;
+}
+
+/* Write three records to a journal in @dir, and return the size of the first two */
+static off_t write_three_records(const std::string& dir)
+{
+	libjob::Journal journal;
+	struct stat sb;
+
+	if (system(("mkdir -p " + dir).c_str()) != 0)
+		return -1;
+	journal.open(dir);
+	journal.put("first", "1");
+	journal.put("second", "2");
+	journal.flush();
+	off_t size = journal.getJournalSize();
+	journal.put("third", "3");
+	journal.close();
+
+	if (stat((dir + "/journal").c_str(), &sb) < 0 || sb.st_size <= size)
+		return -1;
+	return size;
+}
+
+/* Replay the journal in @dir, and check that only the third record was lost */
+static int expect_torn_tail(const std::string& dir, off_t valid_size)
+{
+	libjob::Journal journal;
+	std::string buf;
+
+	journal.open(dir);
+	if (!journal.take("first", buf) || buf != "1" ||
+			!journal.take("second", buf) || buf != "2")
+		fail("a record before the torn one was lost");
+	if (journal.take("third", buf))
+		fail("the torn record was replayed");
+	if ((off_t) journal.getJournalSize() != valid_size)
+		fail("the torn record was not cut off");
+
+	/* Records appended after the torn one are not hidden behind it */
+	journal.put("fourth", "4");
+	journal.close();
+	journal.open(dir);
+	if (!journal.take("fourth", buf) || buf != "4")
+		fail("a record appended after the torn one was lost");
+	journal.close();
+
+	return 0;
+}
+
+static int test_journal_drops_short_record()
+{
+	std::string dir = tmpdir + "/short";
+	off_t size = write_three_records(dir);
+
+	if (size < 0)
+		fail("unable to write the journal");
+	if (truncate((dir + "/journal").c_str(), size + 5) < 0)
+		fail("truncate(2)");
+	return expect_torn_tail(dir, size);
+}
+
+static int test_journal_drops_bad_checksum()
+{
+	std::string dir = tmpdir + "/checksum";
+	off_t size = write_three_records(dir);
+	struct stat sb;
+
+	if (size < 0)
+		fail("unable to write the journal");
+
+	/* Flip the last byte of the value of the third record */
+	std::string path = dir + "/journal";
+	FILE *f = fopen(path.c_str(), "r+");
+	if (f == NULL || stat(path.c_str(), &sb) < 0)
+		fail("unable to open the journal");
+	if (fseek(f, sb.st_size - 1, SEEK_SET) < 0 || fputc('X', f) == EOF || fclose(f) != 0)
+		fail("unable to damage the journal");
+	return expect_torn_tail(dir, size);
+}
+
+int main(int argc, char *argv[])
+{
+	char tmpl[] = "/tmp/jobstatus-test.XXXXXX";
+
+	if (mkdtemp(tmpl) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	tmpdir = tmpl;
+	std::string status_dir = tmpdir + "/status";
+	std::string property_dir = tmpdir + "/property";
+	libjob::JobStatus::setRuntimeDirectory(status_dir);
+	libjob::JobProperty::setDataDirectory(property_dir);
+
+	run(test_reap_is_one_write);
+	run(test_clean_commit_is_free);
+	run(test_fault_is_one_write);
+	run(test_unload_discards_changes);
+	run(test_journal_drops_short_record);
+	run(test_journal_drops_bad_checksum);
+
+	std::string cleanup = "rm -rf " + tmpdir;
+	if (system(cleanup.c_str()) != 0)
+		return 1;
+
+	return 0;
+}
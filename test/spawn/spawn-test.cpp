@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Verify that the spawn helper starts jobs and reports their exit, and that
+ * a helper which has gone away is reported in a way that jobd can recover from.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+#include "spawn.h"
+
+#define run(test) do { \
+	printf("%-32s", ""#test); \
+	if (test() != 0) { \
+		puts("FAILED"); \
+		exit(1); \
+	} else { \
+		puts("passed"); \
+	} \
+} while(0)
+
+#define fail(_message) do { \
+	printf("FAIL: %s\n", _message); \
+	return -1; \
+} while (0)
+
+static void compile_plan(LaunchPlan& plan, const char *script)
+{
+	LaunchDescriptor launch;
+
+	launch.argv = { "/bin/sh", "-c", script };
+	launch.working_directory = "/";
+	launch.stdin_path = "/dev/null";
+	launch.stdout_path = "/dev/null";
+	launch.stderr_path = "/dev/null";
+	plan.compile(launch);
+}
+
+static int test_spawn_reports_exit()
+{
+	SpawnHelper helper;
+	LaunchPlan plan;
+	struct pollfd pfd;
+	pid_t pid, reaped;
+	int status;
+
+	compile_plan(plan, "exit 3");
+	helper.start();
+	pid = helper.spawn(plan, {});
+	if (pid <= 0)
+		fail("no pid was returned");
+
+	pfd.fd = helper.getExitDescriptor();
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 5000) != 1)
+		fail("the exit was not reported");
+	if (!helper.readExit(reaped, status))
+		fail("there was no exit to read");
+	if (reaped != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 3)
+		fail("wrong exit status");
+
+	helper.stop();
+	return 0;
+}
+
+static int test_spawn_after_helper_killed()
+{
+	SpawnHelper helper;
+	LaunchPlan plan;
+	int status;
+
+	compile_plan(plan, "exit 0");
+	helper.start();
+	if (kill(helper.getPid(), SIGKILL) < 0)
+		fail("kill(2)");
+	/* Wait for it to die, but leave it for stop() to reap */
+	siginfo_t info;
+	if (waitid(P_PID, helper.getPid(), &info, WEXITED | WNOWAIT) < 0)
+		fail("waitid(2)");
+
+	/* jobd stops the helper and forks the job itself when it sees this */
+	try {
+		(void) helper.spawn(plan, {});
+		fail("spawn succeeded without a helper");
+	} catch (const std::system_error& e) {
+		fail("a dead helper looks like a failure to fork the job");
+	} catch (const std::runtime_error& e) {
+	}
+
+	helper.stop();
+	if (helper.isRunning() || helper.getPid() != -1)
+		fail("the helper was not stopped");
+
+	/* Jobs can still be started without the helper */
+	pid_t pid = launch_plan_vfork(plan);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		fail("the job could not be started without the helper");
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	run(test_spawn_reports_exit);
+	run(test_spawn_after_helper_killed);
+
+	return 0;
+}